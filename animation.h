@@ -0,0 +1,176 @@
+// Camera paths for animations. A path is a text file in the style of the
+// scene files, one item per line:
+//
+//     frames 120
+//     key 0    0 0 0    -1 0 0      10
+//     key 60   0 2 4    -1 -0.2 -1  12
+//     set 30 reflection on
+//
+// A key gives a frame number, the eye position, the view direction and the
+// distance d from the eye to the image plane, in increasing frame order.
+// Between keys the eye follows a Catmull-Rom spline through the key
+// positions, and the view direction and d change linearly; before the
+// first key and after the last the camera holds still. A set line changes
+// a toggle from its frame on. Without a frames line the animation ends on
+// the last key.
+
+typedef struct {
+    int frame;
+    Vector eye;
+    Vector view;
+    float d;
+} CameraKey;
+
+typedef enum {
+    TOGGLE_ANTIALIAS,
+    TOGGLE_DOF,
+    TOGGLE_REFLECTION,
+    TOGGLE_TRANSPARENCY,
+    TOGGLE_LIGHTS,
+    TOGGLE_SAMPLES,
+    TOGGLE_COUNT
+} PathToggleType;
+
+const char* pathToggleNames[TOGGLE_COUNT] = {"antialias", "dof", "reflection", "transparency", "lights", "samples"};
+
+typedef struct {
+    int frame;
+    PathToggleType type;
+    int value;
+} PathToggle;
+
+typedef struct {
+    int frames;
+    CameraKey* keys;
+    int keyCount;
+    PathToggle* toggles;
+    int toggleCount;
+} CameraPath;
+
+// Toggle value: on/off for the switches, a count for lights and samples
+int parseToggleValue(PathToggleType type, const char* text, int* value) {
+    char* end;
+
+    if (type < TOGGLE_LIGHTS) {
+        *value = (strcmp(text, "on") == 0) ? 1 : (strcmp(text, "off") == 0) ? 0 : -1;
+        return *value >= 0 ? 0 : -1;
+    }
+    *value = (int)strtol(text, &end, 10);
+    return (end != text && *end == '\0' && *value >= 1 && *value <= 64) ? 0 : -1;
+}
+
+int loadCameraPath(const char* path, CameraPath* camera) {
+    FILE* in = fopen(path, "r");
+    char line[1024];
+    int lineNumber = 0;
+
+    if (in == NULL) {
+        fprintf(stderr, "Unable to open camera path %s\n", path);
+        return -1;
+    }
+    memset(camera, 0, sizeof(*camera));
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char keyword[32], name[32], value[32];
+        char* cursor = line;
+        float values[7];
+        int consumed = 0;
+        int frame;
+
+        lineNumber++;
+        if (sscanf(line, " %31s%n", keyword, &consumed) != 1 || keyword[0] == '#') {
+            continue;
+        }
+        cursor += consumed;
+
+        if (strcmp(keyword, "frames") == 0) {
+            if (sscanf(cursor, "%d", &camera->frames) != 1 || camera->frames < 1) {
+                goto error;
+            }
+        } else if (strcmp(keyword, "key") == 0) {
+            if (sscanf(cursor, "%d%n", &frame, &consumed) != 1 || frame < 0 ||
+                (camera->keyCount > 0 && frame <= camera->keys[camera->keyCount-1].frame)) {
+                goto error;
+            }
+            cursor += consumed;
+            if (readFloats(&cursor, values, 7) != 7 || values[6] <= 0) {
+                goto error;
+            }
+            camera->keys = realloc(camera->keys, sizeof(CameraKey) * (camera->keyCount + 1));
+            CameraKey* key = &camera->keys[camera->keyCount++];
+            key->frame = frame;
+            key->eye = newVector(values[0], values[1], values[2]);
+            key->view = newVector(values[3], values[4], values[5]);
+            key->d = values[6];
+            if (mag(key->view) == 0) {
+                goto error;
+            }
+        } else if (strcmp(keyword, "set") == 0) {
+            PathToggle toggle;
+            int type;
+
+            if (sscanf(cursor, "%d %31s %31s", &toggle.frame, name, value) != 3 || toggle.frame < 0) {
+                goto error;
+            }
+            for (type=0; type<TOGGLE_COUNT && strcmp(name, pathToggleNames[type]) != 0; type++);
+            toggle.type = (PathToggleType)type;
+            if (type == TOGGLE_COUNT || parseToggleValue(toggle.type, value, &toggle.value) != 0) {
+                goto error;
+            }
+            camera->toggles = realloc(camera->toggles, sizeof(PathToggle) * (camera->toggleCount + 1));
+            camera->toggles[camera->toggleCount++] = toggle;
+        } else {
+            goto error;
+        }
+    }
+    fclose(in);
+
+    if (camera->keyCount == 0) {
+        fprintf(stderr, "%s has no camera keys\n", path);
+        return -1;
+    }
+    if (camera->frames == 0) {
+        camera->frames = camera->keys[camera->keyCount-1].frame + 1;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s:%d: invalid camera path line: %s", path, lineNumber, line);
+    fclose(in);
+    return -1;
+}
+
+// Uniform Catmull-Rom spline through p1 (s = 0) and p2 (s = 1)
+Vector catmullRom(Vector p0, Vector p1, Vector p2, Vector p3, float s) {
+    Vector a = scaleVector(2, p1);
+    Vector b = scaleVector(s, minusVector(p2, p0));
+    Vector c = scaleVector(s*s, addVector(minusVector(scaleVector(2, p0), scaleVector(5, p1)), minusVector(scaleVector(4, p2), p3)));
+    Vector d = scaleVector(s*s*s, addVector(minusVector(scaleVector(3, p1), p0), minusVector(p3, scaleVector(3, p2))));
+    return scaleVector(0.5f, addVector(addVector(a, b), addVector(c, d)));
+}
+
+// Camera of a frame
+void cameraAt(const CameraPath* camera, int frame, Vector* eye, Vector* view, float* d) {
+    const CameraKey* keys = camera->keys;
+    int last = camera->keyCount - 1;
+    int k = 0;
+
+    if (frame <= keys[0].frame || frame >= keys[last].frame) {
+        k = (frame <= keys[0].frame) ? 0 : last;
+        *eye = keys[k].eye;
+        *view = keys[k].view;
+        *d = keys[k].d;
+        return;
+    }
+
+    while (keys[k+1].frame <= frame) {
+        k++;
+    }
+    float s = (float)(frame - keys[k].frame) / (keys[k+1].frame - keys[k].frame);
+    const CameraKey* before = &keys[k > 0 ? k-1 : k];
+    const CameraKey* after = &keys[k+1 < last ? k+2 : k+1];
+
+    *eye = catmullRom(before->eye, keys[k].eye, keys[k+1].eye, after->eye, s);
+    *view = addVector(scaleVector(1-s, keys[k].view), scaleVector(s, keys[k+1].view));
+    *d = (1-s) * keys[k].d + s * keys[k+1].d;
+}
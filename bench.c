@@ -0,0 +1,329 @@
+// Benchmark suite. Renders a fixed set of deterministic scenes headlessly
+// and times the hot functions in isolation, then prints the results as
+// JSON on stdout so they can be compared between builds:
+//
+//     make bench > before.json
+//
+// Ray counts come from the RT_STATS counters, which the bench target
+// always enables.
+
+#define NO_MAIN
+#include "main.c"
+
+typedef struct {
+    const char* name;
+    void (*build)(Scene* scene);
+    int width;
+    int height;
+    int lights;
+    GLboolean antialias;
+    GLboolean depthOfField;
+    GLboolean reflection;
+    GLboolean transparency;
+    int samples;
+    GLboolean denoise;
+    int depth;          // Reflection/refraction depth, 0 for the defaults
+} BenchCase;
+
+// Deterministic random number in [min, max) for scene generation
+float benchRandom(uint32_t* state, float min, float max) {
+    *state = pcgHash(*state);
+    return min + (max - min) * bitsToFloat(*state);
+}
+
+// Three lights and the default camera
+void benchLights(Scene* scene) {
+    initScene(scene);
+    scene->lights[0] = newVector(0,-1,-1);
+    scene->lights[1] = newVector(0,-1,1);
+    scene->lights[2] = newVector(-1,1,1);
+    scene->lightCount = 3;
+}
+
+// Many small diffuse spheres filling the view
+void sphereField(Scene* scene, int count) {
+    uint32_t state = 12345;
+    Sphere sphere;
+
+    benchLights(scene);
+    for (int i=0; i<count; i++) {
+        sphere.c = newVector(benchRandom(&state, -40, -2), benchRandom(&state, -12, 12), benchRandom(&state, -12, 12));
+        sphere.r = benchRandom(&state, 0.05f, 0.3f);
+        sphere.color = newRGB(benchRandom(&state, 50, 255), benchRandom(&state, 50, 255), benchRandom(&state, 50, 255));
+        sphere.ri = 1;
+        sphere.reflective = 0;
+        sphere.id = i;
+        addSphere(&scene->spheres, sphere);
+    }
+}
+
+void field10k(Scene* scene) {
+    sphereField(scene, 10000);
+}
+
+void field100k(Scene* scene) {
+    sphereField(scene, 100000);
+}
+
+// A grid of spheres, all reflective or all glass
+void sphereGrid(Scene* scene, int glass) {
+    Sphere sphere;
+    int n = 7;
+
+    benchLights(scene);
+    for (int y=0; y<n; y++) {
+        for (int z=0; z<n; z++) {
+            sphere.c = newVector(-2 - (y+z) % 3, (y - n/2) * 1.2f, (z - n/2) * 1.2f);
+            sphere.r = 0.55f;
+            sphere.color = newRGB(60 + 25*y, 60 + 25*z, 200);
+            sphere.ri = glass ? 1.5f : 1;
+            sphere.reflective = !glass;
+            sphere.id = y*n + z;
+            addSphere(&scene->spheres, sphere);
+        }
+    }
+}
+
+void mirrors(Scene* scene) {
+    sphereGrid(scene, 0);
+}
+
+void glass(Scene* scene) {
+    sphereGrid(scene, 1);
+}
+
+// A packed block of alternating glass and mirror spheres, where every ray
+// keeps bouncing and splitting until the depth limit
+void glassMirrorBlock(Scene* scene) {
+    Sphere sphere;
+    int n = 7;
+
+    benchLights(scene);
+    for (int x=0; x<n; x++) {
+        for (int y=0; y<n; y++) {
+            for (int z=0; z<n; z++) {
+                int glass = (x + y + z) % 2 == 0;
+                sphere.c = newVector((x - n/2) * 1.05f - 4, (y - n/2) * 1.05f, (z - n/2) * 1.05f);
+                sphere.r = 0.5f;
+                sphere.color = glass ? newRGB(200, 220, 255) : newRGB(60 + 25*y, 60 + 25*z, 60 + 25*x);
+                sphere.ri = glass ? 1.5f : 1;
+                sphere.reflective = 1;
+                sphere.id = (x*n + y)*n + z;
+                addSphere(&scene->spheres, sphere);
+            }
+        }
+    }
+}
+
+BenchCase benchCases[] = {
+    {"default",      defaultScene, 512, 512, 3, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE, 1},
+    {"default-full", defaultScene, 512, 512, 3, GL_FALSE, GL_FALSE, GL_TRUE,  GL_TRUE,  1},
+    {"field-10k",    field10k,     512, 512, 3, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE, 1},
+    {"field-100k",   field100k,    512, 512, 3, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE, 1},
+    {"mirrors",      mirrors,      512, 512, 3, GL_FALSE, GL_FALSE, GL_TRUE,  GL_FALSE, 1},
+    {"glass",        glass,        512, 512, 3, GL_FALSE, GL_FALSE, GL_FALSE, GL_TRUE,  1},
+    {"glass-mirror-deep", glassMirrorBlock, 256, 256, 3, GL_FALSE, GL_FALSE, GL_TRUE, GL_TRUE, 1, GL_FALSE, 10},
+    {"antialias",    defaultScene, 256, 256, 3, GL_TRUE,  GL_FALSE, GL_TRUE,  GL_TRUE,  4},
+    {"dof",          defaultScene, 256, 256, 3, GL_FALSE, GL_TRUE,  GL_TRUE,  GL_TRUE,  4},
+    {"dof-denoised", defaultScene, 256, 256, 3, GL_FALSE, GL_TRUE,  GL_TRUE,  GL_TRUE,  2, GL_TRUE},
+};
+
+double elapsedMs(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+double percentile(const double* sorted, int count, double p) {
+    int rank = (int)ceil(p / 100 * count);
+    return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+// Render one benchmark case and print its JSON object
+void runCase(const BenchCase* bc, int frames, const char* separator) {
+    Scene scene;
+    double* times = malloc(sizeof(double) * frames);
+    double total = 0;
+    struct timespec start, end;
+
+    window_width = bc->width;
+    window_height = bc->height;
+    antialias = bc->antialias;
+    depthOfField = bc->depthOfField;
+    reflection = bc->reflection;
+    transparency = bc->transparency;
+    aaSamples = bc->samples;
+    denoise = bc->denoise;
+    // 5 and 3 are the renderer's defaults
+    maxDepth = (bc->depth > 0) ? bc->depth : 5;
+    aaMaxDepth = (bc->depth > 0) ? bc->depth : 3;
+
+    bc->build(&scene);
+    numLights = bc->lights;
+    applyScene(&scene);
+    setImagePlane();
+    allocatePixels();
+
+    // One untimed frame to warm up caches and page in the scene
+    renderFrame();
+    resetRenderStats();
+
+    for (int f=0; f<frames; f++) {
+        // Each frame traces its primary rays like a headless render, rather
+        // than reading back the G-buffer the previous frame filled
+        cameraGeneration++;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        renderFrame();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[f] = elapsedMs(start, end);
+        total += times[f];
+    }
+    qsort(times, frames, sizeof(double), compareDoubles);
+
+    RenderStats rays = totalRenderStats();
+    double seconds = total / 1e3;
+    unsigned long all = rays.primaryRays + rays.shadowRays + rays.reflectionRays + rays.refractionRays;
+
+    fprintf(stderr, "%-14s %8.1f ms/frame %8.2f Mrays/s\n", bc->name, total / frames, all / seconds / 1e6);
+    printf("    {\"name\": \"%s\", \"spheres\": %d, \"width\": %d, \"height\": %d, \"frames\": %d,\n",
+           bc->name, spheres.count, bc->width, bc->height, frames);
+    printf("     \"frameMs\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f},\n",
+           times[0], percentile(times, frames, 50), percentile(times, frames, 90), percentile(times, frames, 99),
+           times[frames-1], total / frames);
+    printf("     \"rays\": {\"primary\": %lu, \"shadow\": %lu, \"reflection\": %lu, \"refraction\": %lu, \"total\": %lu},\n",
+           rays.primaryRays / frames, rays.shadowRays / frames, rays.reflectionRays / frames, rays.refractionRays / frames, all / frames);
+    printf("     \"raysPerSec\": {\"primary\": %.0f, \"shadow\": %.0f, \"reflection\": %.0f, \"refraction\": %.0f, \"total\": %.0f}}%s\n",
+           rays.primaryRays / seconds, rays.shadowRays / seconds, rays.reflectionRays / seconds, rays.refractionRays / seconds,
+           all / seconds, separator);
+
+    free(times);
+}
+
+// Print one microbenchmark result
+void printMicro(const char* name, unsigned long calls, double ms, const char* separator) {
+    fprintf(stderr, "%-18s %8.2f ns/call\n", name, ms * 1e6 / calls);
+    printf("    {\"name\": \"%s\", \"calls\": %lu, \"nsPerCall\": %.3f, \"callsPerSec\": %.0f}%s\n",
+           name, calls, ms * 1e6 / calls, calls / (ms / 1e3), separator);
+}
+
+// Time calcIntersection, shade and computeViewingRay on their own, single
+// threaded, against the 10k sphere field and the default scene
+void runMicrobenchmarks(int rounds) {
+    struct timespec start, end;
+    Scene scene;
+    volatile float sink = 0;
+    int count = 0;
+
+    window_width = window_height = 512;
+    antialias = depthOfField = reflection = transparency = GL_FALSE;
+    field10k(&scene);
+    numLights = 3;
+    applyScene(&scene);
+    setImagePlane();
+
+    // calcIntersection: every sphere against a fan of primary rays
+    Ray rays[64];
+    for (int k=0; k<64; k++) {
+        rays[k] = computeViewingRay((k % 8) * 64, (k / 8) * 64, e);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n=0; n<rounds; n++) {
+        for (int k=0; k<64; k++) {
+            for (int i=0; i<spheres.count; i++) {
+                sink += calcIntersection(&rays[k], &spheres, i);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printMicro("calcIntersection", (unsigned long)rounds * 64 * spheres.count, elapsedMs(start, end), ",");
+
+    // computeViewingRay: one ray per pixel of the image
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n=0; n<rounds; n++) {
+        for (int j=0; j<(int)window_height; j++) {
+            for (int i=0; i<(int)window_width; i++) {
+                sink += computeViewingRay(i, j, e).direction.x;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printMicro("computeViewingRay", (unsigned long)rounds * window_width * window_height, elapsedMs(start, end), ",");
+
+    // shade: direct lighting and shadow rays of precomputed primary hits on
+    // the default scene, without recursion
+    defaultScene(&scene);
+    numLights = 3;
+    applyScene(&scene);
+    selectShadingKernel();
+
+    Hit* hits = malloc(sizeof(Hit) * window_width * window_height);
+    Ray* hitRays = malloc(sizeof(Ray) * window_width * window_height);
+    for (int j=0; j<(int)window_height; j++) {
+        for (int i=0; i<(int)window_width; i++) {
+            Ray ray = computeViewingRay(i, j, e);
+            Hit hit;
+            sceneHit(ray, &hit);
+            if (hit.t > 0.001) {
+                computeHitPoint(&hit, ray);
+                hits[count] = hit;
+                hitRays[count++] = ray;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n=0; n<rounds; n++) {
+        for (int k=0; k<count; k++) {
+            sink += shade(hits[k], hitRays[k], 0).r;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printMicro("shade", (unsigned long)rounds * count, elapsedMs(start, end), "");
+
+    free(hits);
+    free(hitRays);
+}
+
+int main(int argc, char** argv) {
+    int frames = 5;
+    int threads = hardwareThreads();
+    int rounds = 3;
+    int numCases = sizeof(benchCases) / sizeof(benchCases[0]);
+
+    for (int i=1; i<argc; i++) {
+        const char* value = (i+1 < argc) ? argv[i+1] : NULL;
+
+        if (strcmp(argv[i], "--frames") == 0) {
+            frames = parseCount(argv[i], value, 1, 1000);
+            i++;
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) {
+            threads = parseCount(argv[i], value, 1, MAX_THREADS);
+            i++;
+        } else if (strcmp(argv[i], "--rounds") == 0) {
+            rounds = parseCount(argv[i], value, 1, 1000);
+            i++;
+        } else {
+            fprintf(stderr, "Usage: %s [--frames N] [-j N] [--rounds N]\n", argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    selectSphereKernels(NULL);
+    selectDenoiseKernel(sphereKernelName);
+    startPool(threads);
+    progressive = GL_FALSE;
+
+    printf("{\n  \"threads\": %d,\n  \"kernel\": \"%s\",\n  \"sampler\": \"%s\",\n  \"scenes\": [\n",
+           numWorkers, sphereKernelName, samplerNames[samplerType]);
+    for (int i=0; i<numCases; i++) {
+        runCase(&benchCases[i], frames, (i+1 < numCases) ? "," : "");
+    }
+    printf("  ],\n  \"micro\": [\n");
+    runMicrobenchmarks(rounds);
+    printf("  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
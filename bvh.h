@@ -0,0 +1,671 @@
+// Bounding volume hierarchy over the spheres. Nodes are built top-down with
+// a binned surface area heuristic and stored flattened in one 64-byte
+// aligned array: every node is 32 bytes and the two children of a node are
+// always stored next to each other, so a sibling pair shares a cache line.
+// After the build the sphere store is reordered so every leaf refers to a
+// contiguous range of spheres, which the SIMD kernels test directly.
+
+#define BVH_BINS 16
+#define BVH_MAX_DEPTH 96
+#define BVH_STACK_SIZE 128
+
+// Relative costs used by the surface area heuristic. Leaves are tested
+// several spheres per instruction, so a sphere test is cheaper than
+// visiting a node.
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_SPHERE_COST 0.5f
+
+typedef struct {
+    float min[3];
+    float max[3];
+} AABB;
+
+typedef struct {
+    float min[3];
+    int leftFirst;   // left child for inner nodes (the right one follows it), first sphere for leaves
+    float max[3];
+    int count;       // number of spheres in a leaf, 0 for inner nodes
+} BVHNode;
+
+typedef struct {
+    double buildMs;
+    int nodes;
+    int leaves;
+    int maxDepth;
+    int maxLeafSize;
+    double avgLeafSize;
+    double sahCost;
+} BVHBuildStats;
+
+typedef struct {
+    BVHNode* nodes;
+    int nodeCount;
+    int* order;
+    int count;
+    int maxLeafSize;
+    int mapped;
+    BVHBuildStats stats;
+} BVH;
+
+static inline AABB emptyBox() {
+    AABB box;
+    for (int a=0; a<3; a++) {
+        box.min[a] = INFINITY;
+        box.max[a] = -INFINITY;
+    }
+    return box;
+}
+
+static inline void growBox(AABB* box, const AABB* other) {
+    for (int a=0; a<3; a++) {
+        box->min[a] = (other->min[a] < box->min[a]) ? other->min[a] : box->min[a];
+        box->max[a] = (other->max[a] > box->max[a]) ? other->max[a] : box->max[a];
+    }
+}
+
+static inline void growBoxPoint(AABB* box, const float* p) {
+    for (int a=0; a<3; a++) {
+        box->min[a] = (p[a] < box->min[a]) ? p[a] : box->min[a];
+        box->max[a] = (p[a] > box->max[a]) ? p[a] : box->max[a];
+    }
+}
+
+// Half the surface area of a box, which is all the SAH needs
+static inline float boxArea(const AABB* box) {
+    float x = box->max[0] - box->min[0];
+    float y = box->max[1] - box->min[1];
+    float z = box->max[2] - box->min[2];
+    if (x < 0 || y < 0 || z < 0) {
+        return 0;
+    }
+    return x*y + y*z + z*x;
+}
+
+typedef struct {
+    int node;
+    int begin;
+    int end;
+    int depth;
+    AABB box;
+    AABB centroidBox;
+} BVHTask;
+
+// A primitive being sorted into the tree. The build partitions these in
+// place instead of an index list so the passes over a node stay sequential
+// in memory.
+typedef struct {
+    AABB box;
+    float centroid[3];
+    int prim;
+} BVHRef;
+
+typedef struct {
+    BVH* bvh;
+    BVHRef* refs;
+    BVHTask* tasks;
+    int numTasks;
+    int maxTasks;
+    int deferBelow;
+} BVHBuilder;
+
+// Bin a primitive's centroid along an axis
+static inline int centroidBin(const float* centroid, int axis, float lo, float scale, int numBins) {
+    int bin = (int)((centroid[axis] - lo) * scale);
+    return (bin < numBins) ? bin : numBins - 1;
+}
+
+// Make a node a leaf over order[begin, end)
+void makeBVHLeaf(BVHNode* n, int begin, int end) {
+    n->leftFirst = begin;
+    n->count = end - begin;
+}
+
+// Build the subtree for a task over refs[begin, end). The task carries the
+// bounds of its primitives and of their centroids, which the parent gathers
+// while partitioning, so each node only makes two passes over its
+// primitives: one binning them along all three axes and one splitting them. While the
+// top of the tree is built on one thread, smaller subtrees are deferred so
+// they can be built in parallel afterwards.
+void buildBVHNode(BVHBuilder* builder, BVHTask task, int defer) {
+    BVH* bvh = builder->bvh;
+    BVHNode* n = &bvh->nodes[task.node];
+    int begin = task.begin, end = task.end, count = end - begin;
+
+    for (int a=0; a<3; a++) {
+        n->min[a] = task.box.min[a];
+        n->max[a] = task.box.max[a];
+    }
+
+    if (count <= 1 || task.depth >= BVH_MAX_DEPTH) {
+        makeBVHLeaf(n, begin, end);
+        return;
+    }
+
+    // Bin the centroids along every axis with a non-zero extent. Small
+    // nodes get fewer bins, since sweeping them dominates the build cost
+    // near the leaves.
+    int counts[3][BVH_BINS];
+    AABB bins[3][BVH_BINS];
+    float lo[3], scale[3];
+    int numBins = (count < BVH_BINS) ? count : BVH_BINS;
+
+    for (int a=0; a<3; a++) {
+        float extent = task.centroidBox.max[a] - task.centroidBox.min[a];
+        lo[a] = task.centroidBox.min[a];
+        scale[a] = (extent > 0) ? numBins / extent : 0;
+        for (int k=0; k<numBins; k++) {
+            counts[a][k] = 0;
+            bins[a][k] = emptyBox();
+        }
+    }
+    for (int i=begin; i<end; i++) {
+        const BVHRef* ref = &builder->refs[i];
+        for (int a=0; a<3; a++) {
+            int k = centroidBin(ref->centroid, a, lo[a], scale[a], numBins);
+            counts[a][k]++;
+            growBox(&bins[a][k], &ref->box);
+        }
+    }
+
+    // Sweep the bins for the split with the lowest surface area cost
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = INFINITY;
+
+    for (int a=0; a<3; a++) {
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        AABB right = emptyBox(), left = emptyBox();
+        int rightTotal = 0, leftTotal = 0;
+
+        if (scale[a] == 0) {
+            continue;
+        }
+        for (int k=numBins-1; k>0; k--) {
+            growBox(&right, &bins[a][k]);
+            rightTotal += counts[a][k];
+            rightArea[k] = boxArea(&right);
+            rightCount[k] = rightTotal;
+        }
+        for (int k=0; k<numBins-1; k++) {
+            growBox(&left, &bins[a][k]);
+            leftTotal += counts[a][k];
+            if (leftTotal == 0 || rightCount[k+1] == 0) {
+                continue;
+            }
+            float cost = leftTotal * boxArea(&left) + rightCount[k+1] * rightArea[k+1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = a;
+                bestBin = k;
+            }
+        }
+    }
+
+    float area = boxArea(&task.box);
+    float splitCost = BVH_TRAVERSAL_COST + ((area > 0) ? BVH_SPHERE_COST * bestCost / area : 0);
+    int mid;
+
+    if (count <= bvh->maxLeafSize && (bestAxis < 0 || splitCost >= BVH_SPHERE_COST * count)) {
+        makeBVHLeaf(n, begin, end);
+        return;
+    }
+
+    if (bestAxis < 0) {
+        // Every centroid is in the same spot, so just split the list in half
+        mid = begin + count / 2;
+    } else {
+        int i = begin, j = end - 1;
+        while (i <= j) {
+            if (centroidBin(builder->refs[i].centroid, bestAxis, lo[bestAxis], scale[bestAxis], numBins) <= bestBin) {
+                i++;
+            } else {
+                BVHRef swap = builder->refs[i];
+                builder->refs[i] = builder->refs[j];
+                builder->refs[j--] = swap;
+            }
+        }
+        mid = i;
+        if (mid == begin || mid == end) {
+            mid = begin + count / 2;
+        }
+    }
+
+    int children = __atomic_fetch_add(&bvh->nodeCount, 2, __ATOMIC_RELAXED);
+    n->leftFirst = children;
+    n->count = 0;
+
+    BVHTask child[2];
+    for (int c=0; c<2; c++) {
+        child[c].node = children + c;
+        child[c].begin = (c == 0) ? begin : mid;
+        child[c].end = (c == 0) ? mid : end;
+        child[c].depth = task.depth + 1;
+        child[c].box = emptyBox();
+        child[c].centroidBox = emptyBox();
+    }
+    for (int i=begin; i<end; i++) {
+        BVHTask* side = &child[i >= mid];
+        growBox(&side->box, &builder->refs[i].box);
+        growBoxPoint(&side->centroidBox, builder->refs[i].centroid);
+    }
+
+    for (int c=0; c<2; c++) {
+        int size = child[c].end - child[c].begin;
+        if (defer && size < builder->deferBelow && builder->numTasks < builder->maxTasks) {
+            builder->tasks[builder->numTasks++] = child[c];
+        } else {
+            buildBVHNode(builder, child[c], defer);
+        }
+    }
+}
+
+void buildBVHTask(void* context, int job, int worker) {
+    BVHBuilder* builder = context;
+    buildBVHNode(builder, builder->tasks[job], 0);
+}
+
+// Walk the finished tree to gather its shape statistics
+void measureBVHNode(BVH* bvh, int node, int depth, float rootArea) {
+    BVHNode* n = &bvh->nodes[node];
+    AABB box;
+    for (int a=0; a<3; a++) {
+        box.min[a] = n->min[a];
+        box.max[a] = n->max[a];
+    }
+    float relativeArea = (rootArea > 0) ? boxArea(&box) / rootArea : 0;
+
+    bvh->stats.nodes++;
+    if (depth > bvh->stats.maxDepth) {
+        bvh->stats.maxDepth = depth;
+    }
+
+    if (n->count > 0) {
+        bvh->stats.leaves++;
+        bvh->stats.avgLeafSize += n->count;
+        bvh->stats.sahCost += relativeArea * n->count;
+        if (n->count > bvh->stats.maxLeafSize) {
+            bvh->stats.maxLeafSize = n->count;
+        }
+        return;
+    }
+
+    bvh->stats.sahCost += relativeArea;
+    measureBVHNode(bvh, n->leftFirst, depth + 1, rootArea);
+    measureBVHNode(bvh, n->leftFirst + 1, depth + 1, rootArea);
+}
+
+// Fill in the shape statistics of a finished tree. The build time is left
+// at zero, e.g. for trees loaded from a scene file.
+void measureBVH(BVH* bvh) {
+    memset(&bvh->stats, 0, sizeof(bvh->stats));
+    if (bvh->count > 0) {
+        AABB root;
+        for (int a=0; a<3; a++) {
+            root.min[a] = bvh->nodes[0].min[a];
+            root.max[a] = bvh->nodes[0].max[a];
+        }
+        measureBVHNode(bvh, 0, 0, boxArea(&root));
+        bvh->stats.avgLeafSize /= bvh->stats.leaves;
+    }
+}
+
+// Check a tree read from a file before anything traverses it: the
+// children of every node reached from the root must lie after it in the
+// array, leaves must stay inside the count primitives, and no leaf may be
+// deeper than a build puts it, since the traversal stacks are sized for
+// that. Returns 0 for a usable tree.
+int checkBVH(const BVHNode* nodes, int nodeCount, int count) {
+    // Depth of every node reached so far, counting the root as 1
+    unsigned char* depth;
+    int result = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (nodeCount < 1 || (depth = calloc(nodeCount, 1)) == NULL) {
+        return -1;
+    }
+    depth[0] = 1;
+    for (int i=0; i<nodeCount && result == 0; i++) {
+        const BVHNode* n = &nodes[i];
+
+        if (depth[i] == 0) {
+            continue;
+        }
+        if (n->count > 0) {
+            result = (n->leftFirst < 0 || n->leftFirst > count - n->count) ? -1 : 0;
+        } else if (n->count < 0 || n->leftFirst <= i || n->leftFirst >= nodeCount - 1 || depth[i] > BVH_MAX_DEPTH) {
+            result = -1;
+        } else {
+            for (int c=0; c<2; c++) {
+                if (depth[n->leftFirst + c] < depth[i] + 1) {
+                    depth[n->leftFirst + c] = depth[i] + 1;
+                }
+            }
+        }
+    }
+    free(depth);
+    return result;
+}
+
+// Build a BVH over count primitives with the given bounds. bvh->order
+// receives the primitive index for every leaf slot. The root is node 0 and
+// node 1 is left unused so that every sibling pair starts on an even index.
+void buildBVH(BVH* bvh, const AABB* bounds, int count, int maxLeafSize) {
+    struct timespec start, end;
+    BVHBuilder builder;
+    BVHRef* refs = malloc(sizeof(BVHRef) * (count > 0 ? count : 1));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!bvh->mapped) {
+        free(bvh->nodes);
+    }
+    free(bvh->order);
+    bvh->nodes = alignedAlloc(64 * (count + 1));
+    bvh->mapped = 0;
+    bvh->order = malloc(sizeof(int) * (count > 0 ? count : 1));
+    bvh->nodeCount = 2;
+    bvh->count = count;
+    bvh->maxLeafSize = (maxLeafSize > 0) ? maxLeafSize : 1;
+    memset(&bvh->stats, 0, sizeof(bvh->stats));
+    memset(&bvh->nodes[0], 0, 2 * sizeof(BVHNode));
+
+    for (int i=0; i<count; i++) {
+        refs[i].box = bounds[i];
+        refs[i].prim = i;
+        for (int a=0; a<3; a++) {
+            refs[i].centroid[a] = 0.5f * (bounds[i].min[a] + bounds[i].max[a]);
+        }
+    }
+
+    builder.bvh = bvh;
+    builder.refs = refs;
+    builder.maxTasks = 4 * numWorkers;
+    builder.tasks = malloc(sizeof(BVHTask) * builder.maxTasks);
+    builder.numTasks = 0;
+    builder.deferBelow = (numWorkers > 1) ? count / (2 * numWorkers) + 1 : 0;
+
+    if (count > 0) {
+        BVHTask root;
+        root.node = 0;
+        root.begin = 0;
+        root.end = count;
+        root.depth = 0;
+        root.box = emptyBox();
+        root.centroidBox = emptyBox();
+        for (int i=0; i<count; i++) {
+            growBox(&root.box, &refs[i].box);
+            growBoxPoint(&root.centroidBox, refs[i].centroid);
+        }
+        buildBVHNode(&builder, root, numWorkers > 1);
+        parallelFor(builder.numTasks, buildBVHTask, &builder);
+    }
+    for (int i=0; i<count; i++) {
+        bvh->order[i] = refs[i].prim;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    measureBVH(bvh);
+    bvh->stats.buildMs = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    free(builder.tasks);
+    free(refs);
+}
+
+// Build the BVH over a sphere store and reorder the store to match it
+void buildSphereBVH(BVH* bvh, SphereStore* store, int maxLeafSize) {
+    AABB* bounds = malloc(sizeof(AABB) * (store->count > 0 ? store->count : 1));
+
+    for (int i=0; i<store->count; i++) {
+        float r = sqrtf(store->r2[i]);
+        float c[3] = {store->cx[i], store->cy[i], store->cz[i]};
+        for (int a=0; a<3; a++) {
+            bounds[i].min[a] = c[a] - r;
+            bounds[i].max[a] = c[a] + r;
+        }
+    }
+
+    buildBVH(bvh, bounds, store->count, maxLeafSize);
+    permuteSpheres(store, bvh->order);
+
+    free(bounds);
+}
+
+// Branch-free min/max; fminf/fmaxf become library calls unless NaN
+// handling is relaxed, which is far too slow for the slab tests
+static inline float minf(float a, float b) {
+    return (a < b) ? a : b;
+}
+
+static inline float maxf(float a, float b) {
+    return (a > b) ? a : b;
+}
+
+// Distance at which a ray enters a node's box, or INFINITY if it misses the
+// box before tMax. inv holds the reciprocal of the ray direction.
+static inline float boxEntry(const BVHNode* n, const Vector* origin, const float* inv, float tMax) {
+    float tx0 = (n->min[0] - origin->x) * inv[0], tx1 = (n->max[0] - origin->x) * inv[0];
+    float ty0 = (n->min[1] - origin->y) * inv[1], ty1 = (n->max[1] - origin->y) * inv[1];
+    float tz0 = (n->min[2] - origin->z) * inv[2], tz1 = (n->max[2] - origin->z) * inv[2];
+    float tmin = maxf(maxf(minf(tx0, tx1), minf(ty0, ty1)), maxf(minf(tz0, tz1), 0));
+    float tmax = minf(minf(maxf(tx0, tx1), maxf(ty0, ty1)), minf(maxf(tz0, tz1), tMax));
+    return (tmin <= tmax) ? tmin : INFINITY;
+}
+
+// Closest-hit traversal: returns the nearest sphere hit with 0 < t < *tHit
+// and lowers *tHit to it, or -1. Children are visited near to far and
+// subtrees behind the closest hit so far are skipped.
+int bvhNearestSphere(const BVH* bvh, const SphereStore* store, const Ray* ray, float* tHit) {
+    int stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int sp = 0, node = 0, result = -1;
+    float inv[3] = {1 / ray->direction.x, 1 / ray->direction.y, 1 / ray->direction.z};
+
+    STAT_ADD(bvhRays, 1);
+    if (bvh->count == 0 || boxEntry(&bvh->nodes[0], &ray->origin, inv, *tHit) == INFINITY) {
+        return -1;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(nodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(sphereTests, n->count);
+            int hit = nearestSphere(store, n->leftFirst, n->count, ray, tHit);
+            if (hit >= 0) {
+                result = hit;
+            }
+        } else {
+            int near = n->leftFirst, far = n->leftFirst + 1;
+            float dNear = boxEntry(&bvh->nodes[near], &ray->origin, inv, *tHit);
+            float dFar = boxEntry(&bvh->nodes[far], &ray->origin, inv, *tHit);
+
+            if (dFar < dNear) {
+                int swap = near; near = far; far = swap;
+                float swapEntry = dNear; dNear = dFar; dFar = swapEntry;
+            }
+            if (dNear != INFINITY) {
+                if (dFar != INFINITY) {
+                    stack[sp] = far;
+                    stackEntry[sp++] = dFar;
+                }
+                node = near;
+                continue;
+            }
+        }
+
+        do {
+            if (sp == 0) {
+                return result;
+            }
+            node = stack[--sp];
+        } while (stackEntry[sp] >= *tHit);
+    }
+}
+
+// Any-hit traversal: returns a sphere hit with 0 < t < tMax, or -1,
+// stopping at the first one found
+int bvhAnySphere(const BVH* bvh, const SphereStore* store, const Ray* ray, float tMax) {
+    int stack[BVH_STACK_SIZE];
+    int sp = 0, node = 0;
+    float inv[3] = {1 / ray->direction.x, 1 / ray->direction.y, 1 / ray->direction.z};
+
+    STAT_ADD(bvhRays, 1);
+    if (bvh->count == 0 || boxEntry(&bvh->nodes[0], &ray->origin, inv, tMax) == INFINITY) {
+        return -1;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(nodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(sphereTests, n->count);
+            int hit = anySphere(store, n->leftFirst, n->count, ray, tMax);
+            if (hit >= 0) {
+                return hit;
+            }
+        } else {
+            int left = n->leftFirst, right = n->leftFirst + 1;
+            int hitLeft = boxEntry(&bvh->nodes[left], &ray->origin, inv, tMax) != INFINITY;
+            int hitRight = boxEntry(&bvh->nodes[right], &ray->origin, inv, tMax) != INFINITY;
+
+            if (hitLeft || hitRight) {
+                if (hitLeft && hitRight) {
+                    stack[sp++] = right;
+                }
+                node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        if (sp == 0) {
+            return -1;
+        }
+        node = stack[--sp];
+    }
+}
+
+// Smallest entry distance into a node's box over the active rays of a
+// packet, or INFINITY if none of them reach it
+float packetBoxEntry(const BVHNode* n, const RayPacket* packet) {
+    float best = INFINITY;
+
+    for (int k=0; k<PACKET_SIZE; k++) {
+        float tx0 = (n->min[0] - packet->ox[k]) * packet->ix[k], tx1 = (n->max[0] - packet->ox[k]) * packet->ix[k];
+        float ty0 = (n->min[1] - packet->oy[k]) * packet->iy[k], ty1 = (n->max[1] - packet->oy[k]) * packet->iy[k];
+        float tz0 = (n->min[2] - packet->oz[k]) * packet->iz[k], tz1 = (n->max[2] - packet->oz[k]) * packet->iz[k];
+        float tmin = maxf(maxf(minf(tx0, tx1), minf(ty0, ty1)), maxf(minf(tz0, tz1), 0));
+        float tmax = minf(minf(maxf(tx0, tx1), maxf(ty0, ty1)), minf(maxf(tz0, tz1), packet->t[k]));
+        float entry = (packet->active[k] && tmin <= tmax) ? tmin : INFINITY;
+        best = (entry < best) ? entry : best;
+    }
+    return best;
+}
+
+// Closest-hit traversal for a packet of rays sharing an origin. A node is
+// entered if any active ray reaches it; nodes popped off the stack are
+// tested again since the rays may have found closer hits meanwhile.
+void bvhNearestPacket(const BVH* bvh, const SphereStore* store, Vector origin, RayPacket* packet) {
+    int stack[BVH_STACK_SIZE];
+    int sp = 0, node = 0;
+
+    STAT_ADD(packets, 1);
+    if (bvh->count == 0 || packetBoxEntry(&bvh->nodes[0], packet) == INFINITY) {
+        return;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(packetNodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(sphereTests, n->count * PACKET_SIZE);
+            nearestSpheresPacket(store, n->leftFirst, n->count, origin, packet);
+        } else {
+            int near = n->leftFirst, far = n->leftFirst + 1;
+            float dNear = packetBoxEntry(&bvh->nodes[near], packet);
+            float dFar = packetBoxEntry(&bvh->nodes[far], packet);
+
+            if (dFar < dNear) {
+                int swap = near; near = far; far = swap;
+                float swapEntry = dNear; dNear = dFar; dFar = swapEntry;
+            }
+            if (dNear != INFINITY) {
+                if (dFar != INFINITY) {
+                    stack[sp++] = far;
+                }
+                node = near;
+                continue;
+            }
+        }
+
+        do {
+            if (sp == 0) {
+                return;
+            }
+            node = stack[--sp];
+        } while (packetBoxEntry(&bvh->nodes[node], packet) == INFINITY);
+    }
+}
+
+// Any-hit traversal for a packet of rays sharing a direction. Returns how
+// many rays are still unblocked, stopping as soon as all of them are.
+int bvhOccludedPacket(const BVH* bvh, const SphereStore* store, Vector direction, RayPacket* packet) {
+    int stack[BVH_STACK_SIZE];
+    int sp = 0, node = 0, remaining = 0;
+
+    for (int k=0; k<PACKET_SIZE; k++) {
+        remaining += packet->active[k];
+    }
+    if (bvh->count == 0 || remaining == 0) {
+        return remaining;
+    }
+    STAT_ADD(packets, 1);
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(packetNodesVisited, 1);
+
+        if (packetBoxEntry(n, packet) != INFINITY) {
+            if (n->count > 0) {
+                STAT_ADD(sphereTests, n->count * PACKET_SIZE);
+                remaining = occludedSpheresPacket(store, n->leftFirst, n->count, direction, packet);
+                if (remaining == 0) {
+                    return 0;
+                }
+            } else {
+                stack[sp++] = n->leftFirst + 1;
+                node = n->leftFirst;
+                continue;
+            }
+        }
+
+        if (sp == 0) {
+            return remaining;
+        }
+        node = stack[--sp];
+    }
+}
+
+// Build statistics of a tree over the given kind of primitive
+void printBVHStats(FILE* out, const BVH* bvh, const char* primitives) {
+    fprintf(out, "BVH: %d %s, %d nodes, %d leaves, depth %d, leaf size avg %.2f max %d (limit %d), SAH cost %.2f, built in %.2f ms\n",
+            bvh->count, primitives, bvh->stats.nodes, bvh->stats.leaves, bvh->stats.maxDepth, bvh->stats.avgLeafSize,
+            bvh->stats.maxLeafSize, bvh->maxLeafSize, bvh->stats.sahCost, bvh->stats.buildMs);
+}
+
+// Nodes visited per ray and packet so far, summed over every tree
+void printBVHTraversalStats(FILE* out) {
+#ifdef RT_STATS
+    RenderStats total = totalRenderStats();
+    if (total.bvhRays > 0 || total.packets > 0) {
+        fprintf(out, "BVH traversal: %lu single rays visiting %.2f nodes each, %lu packets visiting %.2f nodes each\n",
+                total.bvhRays, total.bvhRays > 0 ? (double)total.nodesVisited / total.bvhRays : 0.0,
+                total.packets, total.packets > 0 ? (double)total.packetNodesVisited / total.packets : 0.0);
+    }
+#endif
+}
@@ -0,0 +1,343 @@
+// Edge-avoiding à-trous denoiser for antialiased and depth of field frames
+// (Dammertz et al., "Edge-Avoiding À-Trous Wavelet Transform for fast
+// Global Illumination Filtering"). Each level blurs the image with a 5x5
+// B3-spline kernel whose taps are spread 2^level pixels apart, so five
+// levels reach 124 pixels across with 25 taps per pixel each. Every tap is
+// weighted down by how much its color, albedo, normal and depth differ from
+// the center pixel's, which keeps the blur from crossing edges. The
+// renderer fills in the feature planes, averaged over each pixel's samples
+// so they are as blurry as the image where depth of field defocuses it.
+// Where the samples hit different surfaces those averages are as noisy as
+// the colors, so a tap between pixels that aren't both trusted compares
+// colors only.
+//
+// The planes are stored one channel after another so the AVX2 kernel can
+// filter eight pixels of a row at once. Both kernels compute every weight
+// with the same arithmetic, including the exponential, and give identical
+// images.
+
+#define DENOISE_LEVELS 5
+// Distances at which a tap's weight has fallen to 1/e. The color sigma
+// halves with every level, as the noise left in the image does.
+#define DENOISE_SIGMA_COLOR 0.4f
+#define DENOISE_SIGMA_ALBEDO 0.1f
+#define DENOISE_SIGMA_NORMAL 0.3f
+#define DENOISE_SIGMA_DEPTH 0.05f       // Relative to the center pixel's depth, per tap spacing
+// Depth of pixels whose samples all missed, far beyond anything in the scene
+#define DENOISE_MISS_DEPTH 1e6f
+// Rows per job
+#define DENOISE_BAND 8
+
+typedef struct {
+    int width;
+    int height;
+    size_t capacity;    // Pixels the planes have room for
+    float* color[3];    // Noisy image, filtered level by level
+    float* scratch[3];
+    float* albedo[3];
+    float* normal[3];
+    float* depth;
+    float* trust;       // How well the features describe the pixel, 0-1
+} DenoiseBuffers;
+
+typedef struct {
+    const DenoiseBuffers* buffers;
+    const float* in[3];
+    float* out[3];
+    int step;
+    float invColor;     // Reciprocals of the squared sigmas at this level
+    float invAlbedo;
+    float invNormal;
+    float invDepth;
+} DenoiseLevel;
+
+const float denoiseKernel[5] = {1/16.0f, 1/4.0f, 3/8.0f, 1/4.0f, 1/16.0f};
+
+void freeDenoiseBuffers(DenoiseBuffers* buffers) {
+    for (int c=0; c<3; c++) {
+        free(buffers->color[c]);
+        free(buffers->scratch[c]);
+        free(buffers->albedo[c]);
+        free(buffers->normal[c]);
+    }
+    free(buffers->depth);
+    free(buffers->trust);
+    memset(buffers, 0, sizeof(DenoiseBuffers));
+}
+
+// Size the planes for an image, keeping them if they are big enough.
+// Returns -1 if they can't be allocated.
+int prepareDenoiseBuffers(DenoiseBuffers* buffers, int width, int height) {
+    size_t pixels = (size_t)width * height;
+
+    if (pixels > buffers->capacity) {
+        int failed = 0;
+
+        freeDenoiseBuffers(buffers);
+        for (int c=0; c<3; c++) {
+            buffers->color[c] = malloc(sizeof(float) * pixels);
+            buffers->scratch[c] = malloc(sizeof(float) * pixels);
+            buffers->albedo[c] = malloc(sizeof(float) * pixels);
+            buffers->normal[c] = malloc(sizeof(float) * pixels);
+            failed = failed || !buffers->color[c] || !buffers->scratch[c] || !buffers->albedo[c] || !buffers->normal[c];
+        }
+        buffers->depth = malloc(sizeof(float) * pixels);
+        buffers->trust = malloc(sizeof(float) * pixels);
+        if (failed || buffers->depth == NULL || buffers->trust == NULL) {
+            freeDenoiseBuffers(buffers);
+            fprintf(stderr, "Unable to allocate %dx%d denoising buffers\n", width, height);
+            return -1;
+        }
+        buffers->capacity = pixels;
+    }
+    buffers->width = width;
+    buffers->height = height;
+    return 0;
+}
+
+// e^x for x <= 0: 2^(x log2 e) split into a power of two, built from its
+// exponent bits, and a degree 5 Taylor polynomial for the fraction. The
+// relative error is below 2e-4, plenty for filter weights.
+static inline float denoiseExp(float x) {
+    union {
+        int i;
+        float f;
+    } scale;
+
+    x = (x > -60.0f) ? x : -60.0f;
+    float t = x * 1.44269504f;
+    float whole = floorf(t);
+    float f = t - whole;
+    float p = 0.00133336f;
+    p = p * f + 0.00961813f;
+    p = p * f + 0.05550411f;
+    p = p * f + 0.24022651f;
+    p = p * f + 0.69314718f;
+    p = p * f + 1.0f;
+    scale.i = ((int)whole + 127) << 23;
+    return p * scale.f;
+}
+
+// Filter pixels [x0, x1) of row y one at a time
+void denoiseSpanScalar(const DenoiseLevel* level, int y, int x0, int x1) {
+    const DenoiseBuffers* b = level->buffers;
+    int width = b->width, height = b->height, step = level->step;
+
+    for (int x=x0; x<x1; x++) {
+        int p = y * width + x;
+        float zp = b->depth[p];
+        float invDepth = level->invDepth / (zp * zp);
+        float trust = b->trust[p];
+        float sum[3] = {0, 0, 0}, total = 0;
+
+        for (int dy=-2; dy<=2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height) {
+                continue;
+            }
+            for (int dx=-2; dx<=2; dx++) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= width) {
+                    continue;
+                }
+                int q = qy * width + qx;
+                float color = 0, albedo = 0, normal = 0;
+                for (int c=0; c<3; c++) {
+                    float d = level->in[c][q] - level->in[c][p];
+                    color += d * d;
+                    d = b->albedo[c][q] - b->albedo[c][p];
+                    albedo += d * d;
+                    d = b->normal[c][q] - b->normal[c][p];
+                    normal += d * d;
+                }
+                float dz = b->depth[q] - zp;
+                float trusted = (b->trust[q] < trust) ? b->trust[q] : trust;
+                float distance = color * level->invColor + trusted * (albedo * level->invAlbedo + normal * level->invNormal + dz * dz * invDepth);
+                float weight = (denoiseKernel[dy+2] * denoiseKernel[dx+2]) * denoiseExp(-distance);
+
+                for (int c=0; c<3; c++) {
+                    sum[c] += weight * level->in[c][q];
+                }
+                total += weight;
+            }
+        }
+        // The center tap always counts, so total is positive
+        for (int c=0; c<3; c++) {
+            level->out[c][p] = sum[c] / total;
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static inline __m256 denoiseExpAVX2(__m256 x) {
+    x = _mm256_max_ps(x, _mm256_set1_ps(-60.0f));
+    __m256 t = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+    __m256 whole = _mm256_floor_ps(t);
+    __m256 f = _mm256_sub_ps(t, whole);
+    __m256 p = _mm256_set1_ps(0.00133336f);
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.00961813f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.05550411f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.24022651f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.69314718f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(whole), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+// Lanes of a tap row whose pixels lie inside the image
+__attribute__((target("avx2")))
+static inline __m256i tapMask(int qx, int width) {
+    __m256i lane = _mm256_add_epi32(_mm256_set1_epi32(qx), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i inside = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), lane),
+                                         _mm256_cmpgt_epi32(_mm256_set1_epi32(width), lane));
+    return inside;
+}
+
+// Eight pixels of a plane from q on, reading only the lanes in mask (and
+// only masking at all when the row runs off the image)
+__attribute__((target("avx2")))
+static inline __m256 loadTap(const float* plane, int q, __m256i mask, int partial) {
+    return partial ? _mm256_maskload_ps(plane + q, mask) : _mm256_loadu_ps(plane + q);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 squaredDifference(__m256 sum, __m256 tap, __m256 center) {
+    __m256 d = _mm256_sub_ps(tap, center);
+    return _mm256_add_ps(sum, _mm256_mul_ps(d, d));
+}
+
+// Filter pixels [x0, x1) of row y eight at a time. Taps off the sides of
+// the image get no weight, which leaves the sums exactly as the scalar
+// kernel's, as it skips them.
+__attribute__((target("avx2")))
+void denoiseSpanAVX2(const DenoiseLevel* level, int y, int x0, int x1) {
+    const DenoiseBuffers* b = level->buffers;
+    int width = b->width, height = b->height, step = level->step;
+    __m256 invColor = _mm256_set1_ps(level->invColor), invAlbedo = _mm256_set1_ps(level->invAlbedo);
+    __m256 invNormal = _mm256_set1_ps(level->invNormal), zero = _mm256_setzero_ps();
+    int x = x0;
+
+    for (; x + 8 <= x1; x += 8) {
+        int p = y * width + x;
+        __m256 in[3], albedo[3], normal[3], sum[3];
+        __m256 zp = _mm256_loadu_ps(b->depth + p);
+        __m256 invDepth = _mm256_div_ps(_mm256_set1_ps(level->invDepth), _mm256_mul_ps(zp, zp));
+        __m256 trust = _mm256_loadu_ps(b->trust + p);
+        __m256 total = zero;
+
+        for (int c=0; c<3; c++) {
+            in[c] = _mm256_loadu_ps(level->in[c] + p);
+            albedo[c] = _mm256_loadu_ps(b->albedo[c] + p);
+            normal[c] = _mm256_loadu_ps(b->normal[c] + p);
+            sum[c] = zero;
+        }
+
+        for (int dy=-2; dy<=2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height) {
+                continue;
+            }
+            for (int dx=-2; dx<=2; dx++) {
+                int qx = x + dx * step;
+                int q = qy * width + qx;
+                int partial = qx < 0 || qx + 8 > width;
+                __m256i mask = tapMask(qx, width);
+                __m256 tap[3], color = zero, albedoDistance = zero, normalDistance = zero;
+
+                for (int c=0; c<3; c++) {
+                    tap[c] = loadTap(level->in[c], q, mask, partial);
+                    color = squaredDifference(color, tap[c], in[c]);
+                    albedoDistance = squaredDifference(albedoDistance, loadTap(b->albedo[c], q, mask, partial), albedo[c]);
+                    normalDistance = squaredDifference(normalDistance, loadTap(b->normal[c], q, mask, partial), normal[c]);
+                }
+                __m256 dz = _mm256_sub_ps(loadTap(b->depth, q, mask, partial), zp);
+                __m256 features = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(albedoDistance, invAlbedo),
+                                                              _mm256_mul_ps(normalDistance, invNormal)),
+                                                _mm256_mul_ps(_mm256_mul_ps(dz, dz), invDepth));
+                __m256 trusted = _mm256_min_ps(loadTap(b->trust, q, mask, partial), trust);
+                __m256 distance = _mm256_add_ps(_mm256_mul_ps(color, invColor), _mm256_mul_ps(trusted, features));
+                __m256 weight = _mm256_mul_ps(_mm256_set1_ps(denoiseKernel[dy+2] * denoiseKernel[dx+2]),
+                                              denoiseExpAVX2(_mm256_sub_ps(zero, distance)));
+                weight = _mm256_and_ps(weight, _mm256_castsi256_ps(mask));
+
+                for (int c=0; c<3; c++) {
+                    sum[c] = _mm256_add_ps(sum[c], _mm256_mul_ps(weight, tap[c]));
+                }
+                total = _mm256_add_ps(total, weight);
+            }
+        }
+        for (int c=0; c<3; c++) {
+            _mm256_storeu_ps(level->out[c] + p, _mm256_div_ps(sum[c], total));
+        }
+    }
+    denoiseSpanScalar(level, y, x, x1);
+}
+#endif
+
+// Kernel picked at startup, see selectDenoiseKernel
+void (*denoiseSpan)(const DenoiseLevel*, int, int, int) = denoiseSpanScalar;
+
+// Use the AVX2 kernel when the sphere kernels are AVX2 ones, so --simd
+// scalar or sse turns it off too
+void selectDenoiseKernel(const char* sphereKernel) {
+    denoiseSpan = denoiseSpanScalar;
+#ifdef HAVE_X86_SIMD
+    if (strcmp(sphereKernel, "avx2") == 0) {
+        denoiseSpan = denoiseSpanAVX2;
+    }
+#endif
+}
+
+void denoiseBand(void* context, int job, int worker) {
+    const DenoiseLevel* level = context;
+    int y0 = job * DENOISE_BAND;
+    int y1 = (y0 + DENOISE_BAND < level->buffers->height) ? y0 + DENOISE_BAND : level->buffers->height;
+
+#ifdef HAVE_X86_SIMD
+    // Flush denormals to zero. Near-identical normals and far-off taps
+    // produce plenty of them, and they would slow the filter down by half.
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+#endif
+    for (int y=y0; y<y1; y++) {
+        denoiseSpan(level, y, 0, level->buffers->width);
+    }
+#ifdef HAVE_X86_SIMD
+    _mm_setcsr(csr);
+#endif
+}
+
+// Run every level of the filter over the color planes on the thread pool.
+// The result ends up back in the color planes.
+void denoiseImage(DenoiseBuffers* buffers) {
+    int bands = (buffers->height + DENOISE_BAND - 1) / DENOISE_BAND;
+    float sigmaColor = DENOISE_SIGMA_COLOR;
+
+    for (int l=0; l<DENOISE_LEVELS; l++) {
+        DenoiseLevel level;
+        // Ping-pong between the planes, ending in color after an odd count
+        float** in = (l % 2 == 0) ? buffers->color : buffers->scratch;
+        float** out = (l % 2 == 0) ? buffers->scratch : buffers->color;
+
+        level.buffers = buffers;
+        for (int c=0; c<3; c++) {
+            level.in[c] = in[c];
+            level.out[c] = out[c];
+        }
+        level.step = 1 << l;
+        level.invColor = 1 / (sigmaColor * sigmaColor);
+        level.invAlbedo = 1 / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+        level.invNormal = 1 / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+        level.invDepth = 1 / (DENOISE_SIGMA_DEPTH * DENOISE_SIGMA_DEPTH * level.step * level.step);
+        parallelFor(bands, denoiseBand, &level);
+        sigmaColor /= 2;
+    }
+#if DENOISE_LEVELS % 2 == 0
+    for (int c=0; c<3; c++) {
+        float* swap = buffers->color[c];
+        buffers->color[c] = buffers->scratch[c];
+        buffers->scratch[c] = swap;
+    }
+#endif
+}
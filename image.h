@@ -0,0 +1,145 @@
+#ifdef USE_LIBPNG
+    #include <png.h>
+#endif
+
+// Image output for headless rendering. The pixel array holds float RGB
+// values in [0,1] with row 0 at the bottom of the image, the way
+// glDrawPixels expects it.
+
+typedef enum {
+    IMAGE_PPM,
+    IMAGE_PFM,
+    IMAGE_PNG
+} ImageFormat;
+
+// Convert a float channel to an 8-bit value, clamping out of range colors
+unsigned char toByte(float value) {
+    if (value <= 0) {
+        return 0;
+    }
+    if (value >= 1) {
+        return 255;
+    }
+    return (unsigned char)(value * 255 + 0.5f);
+}
+
+// Guess the image format from a file name, defaulting to PPM
+ImageFormat formatFromName(const char* name) {
+    const char* ext = strrchr(name, '.');
+    if (ext != NULL) {
+        if (strcmp(ext, ".pfm") == 0) {
+            return IMAGE_PFM;
+        }
+        if (strcmp(ext, ".png") == 0) {
+            return IMAGE_PNG;
+        }
+    }
+    return IMAGE_PPM;
+}
+
+// Binary 8-bit PPM, rows written top to bottom
+int writePPM(FILE* out, const float* pixels, int width, int height) {
+    unsigned char* row = malloc(width * 3);
+
+    fprintf(out, "P6\n%d %d\n255\n", width, height);
+    for (int j=height-1; j>=0; j--) {
+        const float* src = &pixels[(long)j * width * 3];
+        for (int i=0; i<width*3; i++) {
+            row[i] = toByte(src[i]);
+        }
+        fwrite(row, 1, width * 3, out);
+    }
+
+    free(row);
+    return ferror(out) ? -1 : 0;
+}
+
+// Little-endian float PFM, rows written bottom to top as the format expects
+int writePFM(FILE* out, const float* pixels, int width, int height) {
+    fprintf(out, "PF\n%d %d\n-1.0\n", width, height);
+    fwrite(pixels, sizeof(float), (size_t)width * height * 3, out);
+    return ferror(out) ? -1 : 0;
+}
+
+#ifdef USE_LIBPNG
+// 8-bit RGB PNG, rows written top to bottom
+int writePNG(FILE* out, const float* pixels, int width, int height) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    unsigned char* row = malloc(width * 3);
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        free(row);
+        return -1;
+    }
+
+    png_init_io(png, out);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for (int j=height-1; j>=0; j--) {
+        const float* src = &pixels[(long)j * width * 3];
+        for (int i=0; i<width*3; i++) {
+            row[i] = toByte(src[i]);
+        }
+        png_write_row(png, row);
+    }
+    png_write_end(png, NULL);
+
+    png_destroy_write_struct(&png, &info);
+    free(row);
+    return 0;
+}
+#endif
+
+// Returns -1 for a format this build can't write, so callers can reject it
+// before rendering or touching the output file
+int checkImageFormat(ImageFormat format) {
+#ifndef USE_LIBPNG
+    if (format == IMAGE_PNG) {
+        fprintf(stderr, "PNG output requires building with PNG=1\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Write the pixel array to a file, or to stdout when the name is "-"
+int writeImage(const char* name, ImageFormat format, const float* pixels, int width, int height) {
+    if (checkImageFormat(format) != 0) {
+        return -1;
+    }
+
+    FILE* out = (strcmp(name, "-") == 0) ? stdout : fopen(name, "wb");
+    int result;
+
+    if (out == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", name);
+        return -1;
+    }
+
+    switch (format) {
+        case IMAGE_PFM:
+            result = writePFM(out, pixels, width, height);
+            break;
+        case IMAGE_PNG:
+#ifdef USE_LIBPNG
+            result = writePNG(out, pixels, width, height);
+#else
+            result = -1;
+#endif
+            break;
+        default:
+            result = writePPM(out, pixels, width, height);
+            break;
+    }
+
+    if (out == stdout) {
+        fflush(out);
+    } else if (fclose(out) != 0) {
+        result = -1;
+    }
+    return result;
+}
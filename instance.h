@@ -0,0 +1,393 @@
+// Instancing. A prototype is a group of spheres, meshes and instances of
+// earlier prototypes that is stored once and placed in the scene any number
+// of times by instances. An instance only holds an affine transform, its
+// inverse and optionally a material that replaces the materials of
+// everything inside it. Rays are moved into the prototype's space rather
+// than the geometry into the scene's, so every copy shares the prototype's
+// BVHs, and the instances themselves get a BVH over their transformed
+// bounds. Since prototypes can be made of other prototypes the copies
+// multiply: a thousand copies of a prototype made of a thousand copies of
+// a thousand-sphere cluster are a billion spheres in a few hundred
+// kilobytes.
+
+typedef struct {
+    float m[12];            // Prototype to parent space, 3x4 row-major
+    float inv[12];          // Parent to prototype space
+    int prototype;
+    int hasMaterial;
+    Material material;      // Replaces the prototype's materials if hasMaterial
+} Instance;
+
+typedef struct {
+    char name[64];
+    SphereStore spheres;
+    BVH bvh;
+    Mesh* meshes;
+    int meshCount;
+    Instance* instances;
+    int instanceCount;
+    BVH instanceBVH;
+    AABB bounds;            // In prototype space
+} Prototype;
+
+// Nearest surface found inside an instance, in the space of the ray that
+// was traced
+typedef struct {
+    Vector n;               // Not normalized
+    const Material* material;
+} InstanceHit;
+
+static inline Vector transformPoint(const float* m, Vector p) {
+    return newVector(m[0]*p.x + m[1]*p.y + m[2]*p.z + m[3],
+                     m[4]*p.x + m[5]*p.y + m[6]*p.z + m[7],
+                     m[8]*p.x + m[9]*p.y + m[10]*p.z + m[11]);
+}
+
+static inline Vector transformDirection(const float* m, Vector d) {
+    return newVector(m[0]*d.x + m[1]*d.y + m[2]*d.z,
+                     m[4]*d.x + m[5]*d.y + m[6]*d.z,
+                     m[8]*d.x + m[9]*d.y + m[10]*d.z);
+}
+
+// Normals go back to the parent space with the transpose of the inverse,
+// which keeps them perpendicular to the surface under non-uniform scaling
+static inline Vector transformNormal(const float* inv, Vector n) {
+    return newVector(inv[0]*n.x + inv[4]*n.y + inv[8]*n.z,
+                     inv[1]*n.x + inv[5]*n.y + inv[9]*n.z,
+                     inv[2]*n.x + inv[6]*n.y + inv[10]*n.z);
+}
+
+void identityTransform(float* m) {
+    memset(m, 0, sizeof(float) * 12);
+    m[0] = m[5] = m[10] = 1;
+}
+
+// out = a * b, i.e. b applied first. out may be either argument.
+void multiplyTransform(const float* a, const float* b, float* out) {
+    float result[12];
+
+    for (int r=0; r<3; r++) {
+        for (int c=0; c<4; c++) {
+            result[4*r+c] = a[4*r]*b[c] + a[4*r+1]*b[4+c] + a[4*r+2]*b[8+c] + (c == 3 ? a[4*r+3] : 0);
+        }
+    }
+    memcpy(out, result, sizeof(result));
+}
+
+// Invert an affine transform. Returns -1 if it is singular.
+int invertTransform(const float* m, float* inv) {
+    double det = m[0] * ((double)m[5]*m[10] - (double)m[6]*m[9])
+               - m[1] * ((double)m[4]*m[10] - (double)m[6]*m[8])
+               + m[2] * ((double)m[4]*m[9] - (double)m[5]*m[8]);
+
+    if (!(fabs(det) > 1e-12)) {
+        return -1;
+    }
+    inv[0] = (m[5]*m[10] - m[6]*m[9]) / det;
+    inv[1] = (m[2]*m[9] - m[1]*m[10]) / det;
+    inv[2] = (m[1]*m[6] - m[2]*m[5]) / det;
+    inv[4] = (m[6]*m[8] - m[4]*m[10]) / det;
+    inv[5] = (m[0]*m[10] - m[2]*m[8]) / det;
+    inv[6] = (m[2]*m[4] - m[0]*m[6]) / det;
+    inv[8] = (m[4]*m[9] - m[5]*m[8]) / det;
+    inv[9] = (m[1]*m[8] - m[0]*m[9]) / det;
+    inv[10] = (m[0]*m[5] - m[1]*m[4]) / det;
+    for (int r=0; r<3; r++) {
+        inv[4*r+3] = -(inv[4*r]*m[3] + inv[4*r+1]*m[7] + inv[4*r+2]*m[11]);
+    }
+    return 0;
+}
+
+// Rotation by an angle in degrees around an axis through the origin
+int rotationTransform(Vector axis, float degrees, float* m) {
+    float length = mag(axis);
+
+    if (!(length > 0)) {
+        return -1;
+    }
+    axis = scaleVector(1/length, axis);
+    float c = cosf(degrees * (float)M_PI / 180), s = sinf(degrees * (float)M_PI / 180), k = 1 - c;
+    float x = axis.x, y = axis.y, z = axis.z;
+
+    identityTransform(m);
+    m[0] = c + x*x*k;   m[1] = x*y*k - z*s; m[2] = x*z*k + y*s;
+    m[4] = y*x*k + z*s; m[5] = c + y*y*k;   m[6] = y*z*k - x*s;
+    m[8] = z*x*k - y*s; m[9] = z*y*k + x*s; m[10] = c + z*z*k;
+    return 0;
+}
+
+// Box around a box after a transform
+AABB transformBox(const float* m, const AABB* box) {
+    AABB result = emptyBox();
+
+    for (int corner=0; corner<8; corner++) {
+        Vector p = newVector(box->min[0], box->min[1], box->min[2]);
+        p.x = (corner & 1) ? box->max[0] : p.x;
+        p.y = (corner & 2) ? box->max[1] : p.y;
+        p.z = (corner & 4) ? box->max[2] : p.z;
+        p = transformPoint(m, p);
+        growBoxPoint(&result, (const float*)&p);
+    }
+    return result;
+}
+
+// Bounds of the root of a tree, or an empty box
+AABB bvhBounds(const BVH* bvh) {
+    AABB box = emptyBox();
+
+    if (bvh->count > 0) {
+        memcpy(box.min, bvh->nodes[0].min, sizeof(box.min));
+        memcpy(box.max, bvh->nodes[0].max, sizeof(box.max));
+    }
+    return box;
+}
+
+// Build the BVH over a list of instances and reorder them to match it
+void buildInstanceBVH(BVH* bvh, Instance* instances, int count, const Prototype* prototypes, int maxLeafSize) {
+    AABB* bounds = malloc(sizeof(AABB) * (count > 0 ? count : 1));
+    Instance* ordered = malloc(sizeof(Instance) * (count > 0 ? count : 1));
+
+    for (int i=0; i<count; i++) {
+        bounds[i] = transformBox(instances[i].m, &prototypes[instances[i].prototype].bounds);
+    }
+    buildBVH(bvh, bounds, count, maxLeafSize);
+    for (int i=0; i<count; i++) {
+        ordered[i] = instances[bvh->order[i]];
+    }
+    memcpy(instances, ordered, sizeof(Instance) * count);
+
+    free(ordered);
+    free(bounds);
+}
+
+// Build every tree of a prototype and its bounds. The prototypes its
+// instances refer to must be built already.
+void buildPrototype(Prototype* prototype, const Prototype* prototypes, int maxLeafSize) {
+    buildSphereBVH(&prototype->bvh, &prototype->spheres, maxLeafSize);
+    prototype->bounds = bvhBounds(&prototype->bvh);
+
+    for (int i=0; i<prototype->meshCount; i++) {
+        buildMeshBVH(&prototype->meshes[i], maxLeafSize);
+        AABB box = bvhBounds(&prototype->meshes[i].bvh);
+        growBox(&prototype->bounds, &box);
+    }
+
+    buildInstanceBVH(&prototype->instanceBVH, prototype->instances, prototype->instanceCount, prototypes, maxLeafSize);
+    AABB box = bvhBounds(&prototype->instanceBVH);
+    growBox(&prototype->bounds, &box);
+}
+
+// The ray in an instance's prototype space. The direction is not
+// normalized, so distances along it are the same as in the parent space.
+static inline Ray instanceRay(const Instance* instance, const Ray* ray) {
+    Ray local;
+    local.origin = transformPoint(instance->inv, ray->origin);
+    local.direction = transformDirection(instance->inv, ray->direction);
+    return local;
+}
+
+int bvhNearestInstance(const BVH* bvh, const Instance* instances, const Prototype* prototypes,
+                       const Ray* ray, float* tHit, InstanceHit* hit);
+int bvhAnyInstance(const BVH* bvh, const Instance* instances, const Prototype* prototypes, const Ray* ray, float tMax);
+
+// Nearest surface of a prototype with 0 < t < *tHit along a ray in its
+// space. Lowers *tHit and fills in the hit if one is found.
+int prototypeNearest(const Prototype* prototype, const Prototype* prototypes, const Ray* ray, float* tHit, InstanceHit* hit) {
+    int found = 0;
+
+    if (prototype->spheres.count > 0) {
+        int sphere = bvhNearestSphere(&prototype->bvh, &prototype->spheres, ray, tHit);
+        if (sphere >= 0) {
+            Vector p = addVector(ray->origin, scaleVector(*tHit, ray->direction));
+            hit->n = minusVector(sphereCenter(&prototype->spheres, sphere), p);
+            hit->material = &prototype->spheres.materials[sphere];
+            found = 1;
+        }
+    }
+    if (prototype->meshCount > 0) {
+        TriangleRay tr = triangleRay(ray);
+        for (int m=0; m<prototype->meshCount; m++) {
+            int triangle = bvhNearestTriangle(&prototype->meshes[m], &tr, ray, tHit);
+            if (triangle >= 0) {
+                hit->n = triangleNormal(&prototype->meshes[m], triangle, ray);
+                hit->material = &prototype->meshes[m].material;
+                found = 1;
+            }
+        }
+    }
+    if (prototype->instanceCount > 0 &&
+        bvhNearestInstance(&prototype->instanceBVH, prototype->instances, prototypes, ray, tHit, hit) >= 0) {
+        found = 1;
+    }
+    return found;
+}
+
+// Whether anything in a prototype is hit with 0 < t < tMax
+int prototypeAny(const Prototype* prototype, const Prototype* prototypes, const Ray* ray, float tMax) {
+    if (prototype->spheres.count > 0 && bvhAnySphere(&prototype->bvh, &prototype->spheres, ray, tMax) >= 0) {
+        return 1;
+    }
+    if (prototype->meshCount > 0) {
+        TriangleRay tr = triangleRay(ray);
+        for (int m=0; m<prototype->meshCount; m++) {
+            if (bvhAnyTriangle(&prototype->meshes[m], &tr, ray, tMax)) {
+                return 1;
+            }
+        }
+    }
+    return prototype->instanceCount > 0 &&
+           bvhAnyInstance(&prototype->instanceBVH, prototype->instances, prototypes, ray, tMax) >= 0;
+}
+
+// Closest-hit traversal of an instance tree: returns the instance holding
+// the nearest hit with 0 < t < *tHit and lowers *tHit to it, or -1. The
+// hit's normal is in the space of the ray, and the outermost material
+// override wins.
+int bvhNearestInstance(const BVH* bvh, const Instance* instances, const Prototype* prototypes,
+                       const Ray* ray, float* tHit, InstanceHit* hit) {
+    int stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int sp = 0, node = 0, result = -1;
+    float inv[3] = {1 / ray->direction.x, 1 / ray->direction.y, 1 / ray->direction.z};
+
+    STAT_ADD(bvhRays, 1);
+    if (bvh->count == 0 || boxEntry(&bvh->nodes[0], &ray->origin, inv, *tHit) == INFINITY) {
+        return -1;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(nodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(instanceTests, n->count);
+            for (int i=n->leftFirst; i<n->leftFirst+n->count; i++) {
+                const Instance* instance = &instances[i];
+                Ray local = instanceRay(instance, ray);
+                InstanceHit inner;
+
+                if (prototypeNearest(&prototypes[instance->prototype], prototypes, &local, tHit, &inner)) {
+                    hit->n = transformNormal(instance->inv, inner.n);
+                    hit->material = instance->hasMaterial ? &instance->material : inner.material;
+                    result = i;
+                }
+            }
+        } else {
+            int near = n->leftFirst, far = n->leftFirst + 1;
+            float dNear = boxEntry(&bvh->nodes[near], &ray->origin, inv, *tHit);
+            float dFar = boxEntry(&bvh->nodes[far], &ray->origin, inv, *tHit);
+
+            if (dFar < dNear) {
+                int swap = near; near = far; far = swap;
+                float swapEntry = dNear; dNear = dFar; dFar = swapEntry;
+            }
+            if (dNear != INFINITY) {
+                if (dFar != INFINITY) {
+                    stack[sp] = far;
+                    stackEntry[sp++] = dFar;
+                }
+                node = near;
+                continue;
+            }
+        }
+
+        do {
+            if (sp == 0) {
+                return result;
+            }
+            node = stack[--sp];
+        } while (stackEntry[sp] >= *tHit);
+    }
+}
+
+// Any-hit traversal of an instance tree: returns an instance with
+// something in it hit with 0 < t < tMax, or -1
+int bvhAnyInstance(const BVH* bvh, const Instance* instances, const Prototype* prototypes, const Ray* ray, float tMax) {
+    int stack[BVH_STACK_SIZE];
+    int sp = 0, node = 0;
+    float inv[3] = {1 / ray->direction.x, 1 / ray->direction.y, 1 / ray->direction.z};
+
+    STAT_ADD(bvhRays, 1);
+    if (bvh->count == 0 || boxEntry(&bvh->nodes[0], &ray->origin, inv, tMax) == INFINITY) {
+        return -1;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(nodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(instanceTests, n->count);
+            for (int i=n->leftFirst; i<n->leftFirst+n->count; i++) {
+                Ray local = instanceRay(&instances[i], ray);
+                if (prototypeAny(&prototypes[instances[i].prototype], prototypes, &local, tMax)) {
+                    return i;
+                }
+            }
+        } else {
+            int left = n->leftFirst, right = n->leftFirst + 1;
+            int hitLeft = boxEntry(&bvh->nodes[left], &ray->origin, inv, tMax) != INFINITY;
+            int hitRight = boxEntry(&bvh->nodes[right], &ray->origin, inv, tMax) != INFINITY;
+
+            if (hitLeft || hitRight) {
+                if (hitLeft && hitRight) {
+                    stack[sp++] = right;
+                }
+                node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        if (sp == 0) {
+            return -1;
+        }
+        node = stack[--sp];
+    }
+}
+
+// Bytes a prototype takes itself, without the prototypes it places
+size_t prototypeBytes(const Prototype* prototype) {
+    size_t bytes = sizeof(Prototype);
+    size_t vertexBytes, normalBytes, indexBytes, nodeBytes;
+
+    bytes += (sizeof(float) * 4 + sizeof(Material)) * prototype->spheres.count;
+    bytes += sizeof(BVHNode) * (prototype->bvh.nodeCount + prototype->instanceBVH.nodeCount);
+    bytes += sizeof(Instance) * prototype->instanceCount;
+    for (int i=0; i<prototype->meshCount; i++) {
+        bytes += meshBytes(&prototype->meshes[i], &vertexBytes, &normalBytes, &indexBytes, &nodeBytes);
+    }
+    return bytes;
+}
+
+// What the instances of a scene place, and the memory that takes. Every
+// prototype only places earlier ones, so their totals are summed in order.
+void printInstanceStats(FILE* out, const Prototype* prototypes, int prototypeCount, const Instance* instances, int instanceCount) {
+    double* spheres = calloc(prototypeCount + 1, sizeof(double));
+    double* triangles = calloc(prototypeCount + 1, sizeof(double));
+    size_t bytes = sizeof(Instance) * instanceCount;
+    int total = instanceCount;
+
+    // The last slot sums the scene's own instances
+    for (int p=0; p<=prototypeCount; p++) {
+        const Instance* list = (p < prototypeCount) ? prototypes[p].instances : instances;
+        int count = (p < prototypeCount) ? prototypes[p].instanceCount : instanceCount;
+
+        if (p < prototypeCount) {
+            spheres[p] = prototypes[p].spheres.count;
+            for (int i=0; i<prototypes[p].meshCount; i++) {
+                triangles[p] += prototypes[p].meshes[i].triangleCount;
+            }
+            bytes += prototypeBytes(&prototypes[p]);
+            total += count;
+        }
+        for (int i=0; i<count; i++) {
+            spheres[p] += spheres[list[i].prototype];
+            triangles[p] += triangles[list[i].prototype];
+        }
+    }
+    fprintf(out, "Instancing: %d prototypes and %d instances in %.2f MB place %.0f spheres and %.0f triangles\n",
+            prototypeCount, total, bytes / 1e6, spheres[prototypeCount], triangles[prototypeCount]);
+
+    free(spheres);
+    free(triangles);
+}
@@ -1,23 +1,59 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
 
-#include "raytrace.h"
-
-#if defined(__APPLE_CC__)
+// Building with NO_GLUT leaves out the window entirely, for render servers
+// that only run headless and don't have OpenGL installed
+#if defined(NO_GLUT)
+    typedef unsigned char GLboolean;
+    #define GL_TRUE 1
+    #define GL_FALSE 0
+#elif defined(__APPLE_CC__)
     #include <GLUT/glut.h>
 #else
+    // Pixel buffer objects are OpenGL 2.1, which Linux headers only
+    // declare on request
+    #define GL_GLEXT_PROTOTYPES
     #include <GL/glut.h>
 #endif
 
+#include "raytrace.h"
+#include "pool.h"
+#include "stats.h"
+#include "spheres.h"
+#include "packet.h"
+#include "bvh.h"
+#include "shadowgrid.h"
+#include "mesh.h"
+#include "instance.h"
+#include "scene.h"
+#include "sampler.h"
+#include "denoise.h"
+#include "image.h"
+#include "net.h"
+#include "animation.h"
+#include "video.h"
+
 // GLOBAL VARIABLES
 unsigned int window_width = 512, window_height = 512;
-float pixels[512*512*3];
+float* pixels = NULL;
 
 // Scene information
-unsigned int numSpheres = 5;
-Sphere spheres[5];
+const char* sceneFile = NULL;
+SphereStore spheres;
+BVH sceneBVH;
+Mesh* meshes = NULL;
+int meshCount = 0;
+Prototype* prototypes = NULL;
+int prototypeCount = 0;
+Instance* instances = NULL;
+int instanceCount = 0;
+BVH instanceBVH;
+int bvhLeafSize = 4;
+GLboolean leafSizeSet = GL_FALSE;
+GLboolean showBVHStats = GL_FALSE;
 
 // Viewpoint information
 Vector e;
@@ -33,144 +69,461 @@ float l = -4, r = 4;
 float b = -4, t = 4;
 
 // Global light information
-Vector light[3];
+Vector light[MAX_LIGHTS];
 float lightI = .7;
 int numLights = 1;
+int lightCount = 0;
 
 // Default background color
 RGBf bgColor;
 
+// Rendering is split into square tiles handed out to the thread pool
+#define TILE_SIZE 32
+int numThreads = 0;
+
+// Seed for the antialiasing and depth of field samples. Renders with the
+// same seed and sampler are bit-identical.
+unsigned int frameSeed = 0;
+SamplerType samplerType = SAMPLER_SOBOL;
+
+// Samples per axis when antialiasing (samples*samples rays per pixel) and
+// recursion depth for reflection/refraction rays
+int aaSamples = 5;
+int maxDepth = 5;
+int aaMaxDepth = 3;
+
+// Reflection and refraction rays whose weight in their sample (the product
+// of the 0.25, r1 and 1-r1 factors above them) falls below
+// rouletteThreshold survive with probability weight/threshold and are
+// scaled up to match, so the average stays the same. Rays below
+// ROULETTE_CUTOFF, half an 8-bit step, are dropped outright. 0 traces every
+// ray down to the depth limit.
+#define ROULETTE_CUTOFF (1/512.0f)
+float rouletteThreshold = 0.004f;
+
 // Control variables for the different features
 GLboolean antialias = GL_FALSE;
 GLboolean reflection = GL_FALSE;
 GLboolean transparency = GL_FALSE;
 GLboolean depthOfField = GL_FALSE;
 
-
-void init() {
-    // Set backgroud color
-    bgColor = newRGB(0, 0, 0);
-
-    // Set the viewpoint
-    e = newVector(5, 0, 0);
+// Trace primary and shadow rays in 8x8 packets when not antialiasing
+GLboolean packetTracing = GL_TRUE;
+
+// Answer shadow rays against the spheres from a grid per light instead of
+// the BVH (--no-shadow-grid turns it off)
+GLboolean shadowGridsOn = GL_TRUE;
+ShadowGrid shadowGrids[MAX_LIGHTS];
+
+// Keep the primary hits between frames (see prepareGBuffer). The window
+// turns it on unless --no-gbuffer is given; headless renders trace each
+// view once and only use it to denoise.
+GLboolean gbufferOn = GL_FALSE;
+
+// Progressive rendering: with antialiasing or depth of field on, the window
+// adds one sample per pixel per frame to the accumulation buffer and shows
+// the running average, until all samples*samples samples are in. The buffer
+// starts over when a setting or the camera changes.
+GLboolean progressive = GL_TRUE;
+float* accumulation = NULL;
+int accumSamples = 0;
+unsigned long accumCamera = 0;
+
+// Adaptive antialiasing: every pixel first gets aaMinSamples samples, then
+// more only where the noise of its samples or the contrast with its
+// neighbours exceeds aaThreshold, up to samples*samples
+GLboolean adaptiveAA = GL_FALSE;
+
+// Filter antialiased and depth of field frames with the edge-avoiding
+// à-trous denoiser once their samples are in, so a few samples per pixel
+// pass for many
+GLboolean denoise = GL_FALSE;
+DenoiseBuffers denoiseBuffers;
+float aaThreshold = 0.03;
+int aaMinSamples = 4;
+
+// Dynamic resolution: with a frame budget in milliseconds (--frame-budget),
+// the window traces only as many pixels as fit in the budget while the
+// image is changing and scales them up for display, then renders the full
+// window size once the view is still. 0 always renders the full size.
+float frameBudget = 0;
+
+// Per-pixel sample statistics for adaptive antialiasing. Luminance is
+// kept on a 0-1 scale so the threshold doesn't depend on the color range.
+typedef struct {
+    RGBf sum;
+    float lum;
+    float lum2;
+    float contrast;
+    int samples;
+} AdaptivePixel;
+
+AdaptivePixel* adaptivePixels = NULL;
+
+// Bumped whenever the camera moves or a scene is loaded
+unsigned long cameraGeneration = 0;
+unsigned long sceneGeneration = 0;
+
+// Everything the rendered image depends on. The window only traces a new
+// frame when this changes; otherwise it redraws the pixels it already has.
+typedef struct {
+    GLboolean antialias;
+    GLboolean reflection;
+    GLboolean transparency;
+    GLboolean depthOfField;
+    int numLights;
+    int aaSamples;
+    int maxDepth;
+    int aaMaxDepth;
+    float roulette;
+    GLboolean adaptiveAA;
+    float aaThreshold;
+    int aaMinSamples;
+    GLboolean denoise;
+    int sampler;
+    unsigned int seed;
+    unsigned int width;
+    unsigned int height;
+    unsigned long camera;
+    unsigned long scene;
+} RenderState;
+
+// The last few finished frames, so switching a setting back and forth
+// doesn't re-trace anything. Least recently used frames are evicted first.
+#define FRAME_CACHE_SIZE 4
+
+typedef struct {
+    RenderState key;
+    float* pixels;
+    unsigned long lastUsed;
+} CachedFrame;
+
+CachedFrame frameCache[FRAME_CACHE_SIZE];
+unsigned long frameClock = 0;
+
+// State of the image in the pixel array, and whether it is finished
+RenderState shownState;
+GLboolean shownValid = GL_FALSE;
+GLboolean shownComplete = GL_FALSE;
+
+// Counters of the last traced frame, which frame that was, and the file
+// that gets one JSON line per frame (--stats-json)
+RenderStats frameStats;
+unsigned long statsFrame = 0;
+FILE* statsJson = NULL;
+GLboolean frameTraced = GL_FALSE;
+
+// Set by the window to abandon the frame in flight. Tile jobs check it
+// before they start, so a cancelled frame stops within one tile.
+int cancelRequested = 0;
+
+// 8-bit RGBA copy of the pixel array that the window presents, or NULL
+// when rendering headless
+unsigned char* presentPixels = NULL;
+
+
+// Point the camera from eye along viewDirection, with up roughly upwards
+void setCamera(Vector eye, Vector viewDirection, Vector up) {
+    e = eye;
 
     // Calculate basis vectors
-    Vector up = newVector(0, 0, 1);
-    Vector viewDirection = newVector(-1, 0, 0);
     w = scaleVector(-1/mag(viewDirection), viewDirection);
     Vector upCrossW = cross(up, w);
     u = scaleVector(1/mag(upCrossW), upCrossW);
     v = cross(w, u);
 
-    // Initialize lights in the scene
-    light[0] = newVector(0,-1,-1);
-    light[0] = scaleVector(1/mag(light[0]),light[0]);
+    cameraGeneration++;
+}
 
-    light[1] = newVector(0,-1,1);
-    light[1] = scaleVector(1/mag(light[1]),light[1]);
+// The scene rendered when no scene file is given
+void defaultScene(Scene* scene) {
+    initScene(scene);
 
-    light[2] = newVector(-1,1,1);
-    light[2] = scaleVector(1/mag(light[2]),light[2]);
+    // Initialize lights in the scene
+    scene->lights[0] = newVector(0,-1,-1);
+    scene->lights[1] = newVector(0,-1,1);
+    scene->lights[2] = newVector(-1,1,1);
+    scene->lightCount = 3;
 
     // Create spheres in scene
-    spheres[0].r = 1;
-    spheres[0].c = newVector(-2, -1, 1);
-    spheres[0].color = newRGB(255,255,0);
-    spheres[0].id = 3;
-    spheres[0].ri = 1;
-    spheres[0].reflective = 1;
-
-    spheres[1].r = 1;
-    spheres[1].c = newVector(2, -1, -1);
-    spheres[1].color = newRGB(0,0,255);
-    spheres[1].id = 1;
-    spheres[1].ri = 1;
-    spheres[1].reflective = 1;
-
-    spheres[2].r = 1;
-    spheres[2].c = newVector(0, -1, 1);
-    spheres[2].color = newRGB(0,255,0);
-    spheres[2].id = 2;
-    spheres[2].ri = 1.2;
-    spheres[2].reflective = 0;
-
-    spheres[3].r = 1;
-    spheres[3].c = newVector(1, 1, -1);
-    spheres[3].color = newRGB(180,180,180);
-    spheres[3].id = 3;
-    spheres[3].ri = 1;
-    spheres[3].reflective = 1;
-
-    spheres[4].r = 1;
-    spheres[4].c = newVector(-0, 1, 1);
-    spheres[4].color = newRGB(255,0,0);
-    spheres[4].id = 0;
-    spheres[4].ri = 1;
-    spheres[4].reflective = 1;
-}
-
-float calcIntersection(Ray ray, Sphere sphere) {
-    // Compute discriminate
-    // (d . (e - c))^2 - (d.d) * ((e-c).(e-c) - r^2)
-    Vector eMinusC = minusVector(ray.origin, sphere.c);
-    float d2 = dot(ray.direction, ray.direction);
-    float discriminate = dot(ray.direction, eMinusC);
-    discriminate *= discriminate;
-    discriminate -= (d2 * (dot(eMinusC, eMinusC) - pow(sphere.r, 2.0)));
-
-    if (discriminate >= 0) {
-        // Solve quadratic for t
-        // t = -d . (e-c) +- discriminate / d.d
-        float t = dot(scaleVector(-1, ray.direction), eMinusC);
-        float t1 = (t + sqrt(discriminate)) / d2;
-        float t2 = (t - sqrt(discriminate)) / d2;
-
-        if (t1 > 0 && t2 > 0) {
-            if (t1 < t2) {
-                return t1;
-            } else {
-                return t2;
-            }
-        } else if (t1 > 0) {
-            return t1;
-        } else if (t2 > 0) {
-            return t2;
-        } else {
-            return -1;
+    Sphere sphere;
+
+    sphere.r = 1;
+    sphere.c = newVector(-2, -1, 1);
+    sphere.color = newRGB(255,255,0);
+    sphere.id = 3;
+    sphere.ri = 1;
+    sphere.reflective = 1;
+    addSphere(&scene->spheres, sphere);
+
+    sphere.r = 1;
+    sphere.c = newVector(2, -1, -1);
+    sphere.color = newRGB(0,0,255);
+    sphere.id = 1;
+    sphere.ri = 1;
+    sphere.reflective = 1;
+    addSphere(&scene->spheres, sphere);
+
+    sphere.r = 1;
+    sphere.c = newVector(0, -1, 1);
+    sphere.color = newRGB(0,255,0);
+    sphere.id = 2;
+    sphere.ri = 1.2;
+    sphere.reflective = 0;
+    addSphere(&scene->spheres, sphere);
+
+    sphere.r = 1;
+    sphere.c = newVector(1, 1, -1);
+    sphere.color = newRGB(180,180,180);
+    sphere.id = 3;
+    sphere.ri = 1;
+    sphere.reflective = 1;
+    addSphere(&scene->spheres, sphere);
+
+    sphere.r = 1;
+    sphere.c = newVector(-0, 1, 1);
+    sphere.color = newRGB(255,0,0);
+    sphere.id = 0;
+    sphere.ri = 1;
+    sphere.reflective = 1;
+    addSphere(&scene->spheres, sphere);
+}
+
+// Build the occluder grid of one light, for the shadow rays along -light
+void buildShadowGridTask(void* context, int job, int worker) {
+    buildShadowGrid(&shadowGrids[job], &spheres, scaleVector(-1, light[job]));
+}
+
+// Make a scene the one being rendered. A BVH stored in a binary scene is
+// used as is unless a leaf size was asked for.
+void applyScene(Scene* scene) {
+    bgColor = scene->background;
+    setCamera(scene->eye, scene->view, scene->up);
+
+    lightI = scene->lightIntensity;
+    lightCount = scene->lightCount;
+    for (int i=0; i<lightCount; i++) {
+        light[i] = scaleVector(1/mag(scene->lights[i]), scene->lights[i]);
+    }
+    if (numLights > lightCount) {
+        numLights = lightCount;
+    }
+
+    spheres = scene->spheres;
+    sceneBVH = scene->bvh;
+    sceneGeneration++;
+    if (sceneBVH.nodes == NULL || leafSizeSet) {
+        buildSphereBVH(&sceneBVH, &spheres, bvhLeafSize);
+    } else if (showBVHStats) {
+        measureBVH(&sceneBVH);
+    }
+    // After the BVH build, which reorders the spheres
+    if (shadowGridsOn) {
+        parallelFor(lightCount, buildShadowGridTask, NULL);
+    }
+
+    meshes = scene->meshes;
+    meshCount = scene->meshCount;
+    for (int i=0; i<meshCount; i++) {
+        if (meshes[i].bvh.nodes == NULL || leafSizeSet) {
+            buildMeshBVH(&meshes[i], bvhLeafSize);
+        } else if (showBVHStats) {
+            measureBVH(&meshes[i].bvh);
+        }
+    }
+
+    // Prototypes only come from text scenes, so their trees are always built
+    prototypes = scene->prototypes;
+    prototypeCount = scene->prototypeCount;
+    instances = scene->instances;
+    instanceCount = scene->instanceCount;
+    for (int i=0; i<prototypeCount; i++) {
+        buildPrototype(&prototypes[i], prototypes, bvhLeafSize);
+    }
+    buildInstanceBVH(&instanceBVH, instances, instanceCount, prototypes, bvhLeafSize);
+}
+
+// BVH statistics of the spheres and every mesh, with the memory each mesh
+// takes per triangle
+void printSceneStats(FILE* out) {
+    printBVHStats(out, &sceneBVH, "spheres");
+    for (int i=0; i<lightCount && shadowGridsOn; i++) {
+        printShadowGridStats(out, &shadowGrids[i], i);
+    }
+    for (int i=0; i<meshCount; i++) {
+        printMeshStats(out, &meshes[i]);
+        printBVHStats(out, &meshes[i].bvh, "triangles");
+    }
+    if (instanceCount > 0) {
+        printInstanceStats(out, prototypes, prototypeCount, instances, instanceCount);
+        printBVHStats(out, &instanceBVH, "instances");
+    }
+    printBVHTraversalStats(out);
+}
+
+// Load the scene file given on the command line, or the default scene
+void init() {
+    Scene scene;
+
+    if (sceneFile != NULL) {
+        if (loadScene(sceneFile, &scene) != 0) {
+            exit(EXIT_FAILURE);
         }
     } else {
-        return -1;
+        defaultScene(&scene);
+    }
+    applyScene(&scene);
+}
+
+// Keep the vertical extent of the image plane fixed and widen or narrow the
+// horizontal extent so non-square images aren't stretched
+void setImagePlane() {
+    float aspect = (float)window_width / window_height;
+    b = -4;
+    t = 4;
+    l = -4 * aspect;
+    r = 4 * aspect;
+}
+
+// (Re)allocate the pixel array for the current image size
+void allocatePixels() {
+    free(pixels);
+    pixels = calloc((size_t)window_width * window_height * 3, sizeof(float));
+    if (pixels == NULL) {
+        fprintf(stderr, "Unable to allocate a %ux%u framebuffer\n", window_width, window_height);
+        exit(EXIT_FAILURE);
+    }
+
+    // The accumulation buffer is only allocated once progressive rendering is used
+    free(accumulation);
+    accumulation = NULL;
+    accumSamples = 0;
+    free(adaptivePixels);
+    adaptivePixels = NULL;
+}
+
+GLboolean showShadowStats = GL_FALSE;
+GLboolean showStats = GL_FALSE;
+
+// The sphere that last blocked a shadow ray toward each light on this
+// thread, plus one so the zeroed cache starts out empty. Neighbouring
+// pixels are nearly always shadowed by the same sphere, so it is tested
+// before the BVH is traversed.
+__thread int lastOccluder[MAX_LIGHTS];
+
+// Cached occluder for a light, or -1. The bounds check keeps stale entries
+// harmless after a different scene is loaded.
+int cachedOccluder(int lightNum) {
+    int sphere = lastOccluder[lightNum] - 1;
+    return (sphere < spheres.count) ? sphere : -1;
+}
+
+GLboolean meshesOccluded(const Ray* ray, float tMax);
+GLboolean instancesOccluded(const Ray* ray, float tMax);
+
+// Whether anything blocks a shadow ray toward a light before tMax. Returns
+// on the first blocker found rather than the nearest one.
+GLboolean inShadow(Ray ray, int lightNum, float tMax) {
+    int cached = cachedOccluder(lightNum);
+
+    STAT_ADD(shadowRays, 1);
+    if (cached >= 0) {
+        // With the grids on, the cached sphere must pass the grid's own test
+        GLboolean blocked;
+        if (shadowGridsOn) {
+            blocked = gridCachedBlocks(&shadowGrids[lightNum], &spheres, &ray, cached, tMax);
+        } else {
+            float t = calcIntersection(&ray, &spheres, cached);
+            blocked = t > 0 && t < tMax;
+        }
+        STAT_ADD(sphereTests, 1);
+        if (blocked) {
+            STAT_ADD(shadowCacheHits, 1);
+            return GL_TRUE;
+        }
+    }
+
+    int blocker = shadowGridsOn ? gridAnySphere(&shadowGrids[lightNum], &spheres, &ray, tMax)
+                                : bvhAnySphere(&sceneBVH, &spheres, &ray, tMax);
+    if (blocker >= 0) {
+        lastOccluder[lightNum] = blocker + 1;
+        return GL_TRUE;
     }
+    return (meshCount > 0 && meshesOccluded(&ray, tMax)) || (instanceCount > 0 && instancesOccluded(&ray, tMax));
 }
 
-GLboolean inShadow(Ray ray) {
-    for (int i=0; i<numSpheres; i++) {
-        if (calcIntersection(ray,spheres[i]) > 0) {
+// Whether any mesh triangle blocks a ray before tMax
+GLboolean meshesOccluded(const Ray* ray, float tMax) {
+    TriangleRay tr = triangleRay(ray);
+
+    for (int m=0; m<meshCount; m++) {
+        if (bvhAnyTriangle(&meshes[m], &tr, ray, tMax)) {
             return GL_TRUE;
         }
     }
     return GL_FALSE;
 }
 
-float sceneHit(Ray ray, Hit* hit) {
-    float t = 0;
-    float lastT = 9999;
-    float result = -1;
-
-    for (int i=0; i<numSpheres; i++) {
-        t = calcIntersection(ray, spheres[i]);
-        if (t > 0 && t < lastT) {
-            result = t;
-            hit->sphere = &spheres[i];
+// Look for a mesh triangle closer than the hit found so far (t <= 0 for
+// none) and make it the hit
+void nearestMeshHit(const Ray* ray, Hit* hit) {
+    TriangleRay tr = triangleRay(ray);
+    float t = (hit->t > 0) ? hit->t : INFINITY;
+
+    for (int m=0; m<meshCount; m++) {
+        int triangle = bvhNearestTriangle(&meshes[m], &tr, ray, &t);
+        if (triangle >= 0) {
+            hit->sphere = -1;
+            hit->mesh = m;
+            hit->triangle = triangle;
+            hit->material = &meshes[m].material;
+            hit->t = t;
         }
     }
+}
+
+// Whether anything placed by an instance blocks a ray before tMax
+GLboolean instancesOccluded(const Ray* ray, float tMax) {
+    return bvhAnyInstance(&instanceBVH, instances, prototypes, ray, tMax) >= 0;
+}
+
+// Look for an instanced surface closer than the hit found so far and make
+// it the hit, with its normal already in world space
+void nearestInstanceHit(const Ray* ray, Hit* hit) {
+    InstanceHit found;
+    float t = (hit->t > 0) ? hit->t : INFINITY;
+    int instance = bvhNearestInstance(&instanceBVH, instances, prototypes, ray, &t, &found);
+
+    if (instance >= 0) {
+        hit->sphere = hit->mesh = hit->triangle = -1;
+        hit->instance = instance;
+        hit->material = found.material;
+        hit->n = found.n;
+        hit->t = t;
+    }
+}
 
-    hit->t = result;
+void sceneHit(Ray ray, Hit* hit) {
+    float t = INFINITY;
+
+    hit->sphere = bvhNearestSphere(&sceneBVH, &spheres, &ray, &t);
+    hit->mesh = hit->triangle = hit->instance = -1;
+    hit->material = (hit->sphere >= 0) ? &spheres.materials[hit->sphere] : NULL;
+    hit->t = (hit->sphere >= 0) ? t : -1;
+    if (meshCount > 0) {
+        nearestMeshHit(&ray, hit);
+    }
+    if (instanceCount > 0) {
+        nearestInstanceHit(&ray, hit);
+    }
 }
 
 Ray computeViewingRay(float i, float j, Vector origin) {
     Ray viewingRay;
 
+    STAT_ADD(primaryRays, 1);
+    STAT_DEPTH(0, 1);
+
     float us = l + (r-l) * (i+0.5) / window_width;
     float vs = b + (t-b) * (j+0.5) / window_height;
 
@@ -225,18 +578,19 @@ RGBf ambient(RGBf color) {
     return scaleRGB(color, intensity);
 }
 
-RGBf castRay(Ray ray, int recur) {
-    Hit hit;
-    sceneHit(ray, &hit);
-
-    if (hit.t > 0.001) {
-        hit.p = addVector(ray.origin, scaleVector(hit.t-0.0001, ray.direction));
-        hit.n = scaleVector(-1/hit.sphere->r, minusVector(hit.p, hit.sphere->c));
-        hit.n = scaleVector(1/mag(hit.n), hit.n);
-        return shade(hit, ray, recur);
+// Fill in the surface point and normal of a hit found along a ray
+void computeHitPoint(Hit* hit, Ray ray) {
+    hit->p = addVector(ray.origin, scaleVector(hit->t-0.0001, ray.direction));
+    if (hit->instance >= 0) {
+        hit->n = scaleVector(1/mag(hit->n), hit->n);
+        return;
     }
-
-    return bgColor;
+    if (hit->triangle >= 0) {
+        hit->n = triangleNormal(&meshes[hit->mesh], hit->triangle, &ray);
+        return;
+    }
+    hit->n = minusVector(sphereCenter(&spheres, hit->sphere), hit->p);
+    hit->n = scaleVector(1/mag(hit->n), hit->n);
 }
 
 Ray calcShadowRay(Vector p, Vector lightSource) {
@@ -274,183 +628,2722 @@ RGBf attenuate(float kr, float kg, float kb, RGBf color) {
     return result;
 }
 
-RGBf shade(Hit hit, Ray ray, int recur) {
+// G-buffer: the nearest hit of every primary ray, one per antialiasing
+// sample when sampling, kept while the camera, the geometry, the image
+// size and the sampling pattern stay the same. A frame that only changes
+// the lights, reflection or transparency then reshades the stored hits and
+// traces nothing but shadow and secondary rays. Only what shading reads is
+// stored; the hit point is recomputed from t exactly as computeHitPoint
+// computes it, so the image matches a fresh trace.
+#define GBUFFER_MAX_BYTES (256UL << 20)
+
+typedef struct {
+    Vector n;
+    float t;                    // -1 for a miss
+    const Material* material;
+} GBufferHit;
+
+// What the stored hits depend on. Cleared first so padding doesn't affect
+// comparisons.
+typedef struct {
+    unsigned long camera;
+    unsigned long scene;
+    unsigned int width;
+    unsigned int height;
+    int samples;                // Slots per pixel
+    int depthOfField;
+    int sampler;
+    unsigned int seed;
+} GBufferKey;
+
+GBufferHit* gbuffer = NULL;
+unsigned char* gbufferValid = NULL;     // Whether each slot has been traced
+size_t gbufferCapacity = 0;
+GBufferKey gbufferKey;
+GLboolean gbufferActive = GL_FALSE;
+
+// Set up the G-buffer for the frame about to be rendered, keeping the
+// stored hits if they still apply. A denoised frame always gets one, as
+// the denoiser takes its features from the samples' hits. Left inactive
+// if it is turned off or the frame's samples don't fit in
+// GBUFFER_MAX_BYTES.
+void prepareGBuffer() {
+    GBufferKey key;
+    GLboolean sampled = antialias || depthOfField;
+
+    memset(&key, 0, sizeof(GBufferKey));
+    key.camera = cameraGeneration;
+    key.scene = sceneGeneration;
+    key.width = window_width;
+    key.height = window_height;
+    key.samples = sampled ? aaSamples * aaSamples : 1;
+    key.depthOfField = depthOfField;
+    key.sampler = sampled ? samplerType : 0;
+    key.seed = sampled ? frameSeed : 0;
+
+    if (!gbufferOn && !(sampled && denoise)) {
+        gbufferActive = GL_FALSE;
+        return;
+    }
+    if (gbufferActive && memcmp(&key, &gbufferKey, sizeof(GBufferKey)) == 0) {
+        return;
+    }
+
+    size_t slots = (size_t)window_width * window_height * key.samples;
+    gbufferActive = GL_FALSE;
+    if (slots * (sizeof(GBufferHit) + 1) > GBUFFER_MAX_BYTES) {
+        return;
+    }
+    if (slots > gbufferCapacity) {
+        free(gbuffer);
+        free(gbufferValid);
+        gbuffer = malloc(sizeof(GBufferHit) * slots);
+        gbufferValid = malloc(slots);
+        gbufferCapacity = (gbuffer != NULL && gbufferValid != NULL) ? slots : 0;
+        if (gbufferCapacity == 0) {
+            return;
+        }
+    }
+    memset(gbufferValid, 0, slots);
+    gbufferKey = key;
+    gbufferActive = GL_TRUE;
+}
+
+// Slot of sample s of pixel (i, j), or -1 without a G-buffer
+static inline long gbufferSlot(int i, int j, int s) {
+    if (!gbufferActive) {
+        return -1;
+    }
+    return ((long)j * window_width + i) * gbufferKey.samples + s;
+}
+
+void storeGBufferHit(long slot, const Hit* hit) {
+    GBufferHit* stored = &gbuffer[slot];
+
+    stored->n = hit->n;
+    stored->t = hit->t;
+    stored->material = hit->material;
+    gbufferValid[slot] = 1;
+}
+
+// Nearest hit of a primary ray with its hit point and normal, read from
+// G-buffer slot if it has been traced and stored there otherwise. Slot -1
+// just traces the ray. Hits read back don't know which primitive they
+// are on, which shading doesn't need.
+void primaryHit(long slot, Ray ray, Hit* hit) {
+    if (slot >= 0 && gbufferValid[slot]) {
+        const GBufferHit* stored = &gbuffer[slot];
+
+        hit->sphere = hit->mesh = hit->triangle = hit->instance = -1;
+        hit->n = stored->n;
+        hit->t = stored->t;
+        hit->material = stored->material;
+        if (hit->t > 0.001) {
+            hit->p = addVector(ray.origin, scaleVector(hit->t-0.0001, ray.direction));
+        }
+        STAT_ADD(gbufferHits, 1);
+        return;
+    }
+
+    sceneHit(ray, hit);
+    if (hit->t > 0.001) {
+        computeHitPoint(hit, ray);
+    }
+    if (slot >= 0) {
+        storeGBufferHit(slot, hit);
+    }
+}
+
+// Shading kernels. The toggles and the light count would otherwise be
+// tested over and over in the innermost per-ray code, so the shading and
+// pixel loops are written once as inline functions taking them as
+// parameters and instantiated for every combination further down. With
+// the parameters constant the compiler drops the disabled features and
+// unrolls the light loop. selectShadingKernel() picks one per frame.
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// Bit mask of the lights that are not blocked from a point
+KERNEL_INLINE unsigned int visibleLightsFor(Vector p, int lights) {
+    unsigned int visible = 0;
+
+    for (int i=0; i<lights; i++) {
+        Ray shadowRay = calcShadowRay(p,light[i]);
+        if (!inShadow(shadowRay, i, INFINITY)) {
+            visible |= 1u << i;
+        }
+    }
+    return visible;
+}
+
+// Direct lighting of a hit (ambient plus the lights that reach it)
+KERNEL_INLINE RGBf localColorFor(Hit hit, Ray ray, unsigned int visible, int lights) {
     RGBf pixelColor = newRGB(0,0,0);
 
-    pixelColor = ambient(hit.sphere->color);
+    pixelColor = ambient(hit.material->color);
 
-    for (int i=0; i<numLights; i++) {
-        Ray shadowRay = calcShadowRay(hit.p,light[i]);
-        if (!inShadow(shadowRay)) {
-            pixelColor = addRGB(pixelColor, diffuse(hit.n, hit.sphere->color, i));
+    for (int i=0; i<lights; i++) {
+        if (visible & (1u << i)) {
+            pixelColor = addRGB(pixelColor, diffuse(hit.n, hit.material->color, i));
             pixelColor = addRGB(pixelColor, specular(ray, hit.n, i));
         }
     }
 
-    if (reflection && hit.sphere->reflective && recur > 0) {
-        Ray reflectRay;
-        reflectRay.origin = hit.p;
-        reflectRay.direction = reflect(ray.direction, hit.n);
-        pixelColor = addRGB(pixelColor, scaleRGB(castRay(reflectRay, recur-1), 0.25));
+    return pixelColor;
+}
+
+// Rays spawned by a hit: an optional mirror reflection (weighted 0.25) and
+// either nothing, one totally internally reflected ray, or a Fresnel
+// weighted reflection/transmission pair for transparent spheres
+typedef struct {
+    GLboolean reflect;
+    Ray reflectRay;
+    int refract;
+    Ray refractRays[2];
+    float r1;
+    // For the reflection ray and the two refraction rays: the weight of
+    // their color in the hit's, 0 for rays that aren't spawned or are cut
+    // by roulette, and their weight in the sample
+    float weight[3];
+    float throughput[3];
+} SecondaryRays;
+
+#define REFRACT_NONE 0
+#define REFRACT_TOTAL 1
+#define REFRACT_SPLIT 2
+
+static inline int refractedRays(int refract) {
+    return (refract == REFRACT_SPLIT) ? 2 : (refract == REFRACT_TOTAL) ? 1 : 0;
+}
+
+// Weight of a secondary ray's color after termination: 0 if it isn't
+// traced, otherwise 1 or the Russian roulette factor of a survivor. The
+// roulette draw hashes the ray, so renders stay reproducible and the
+// wavefront and recursive renderers make the same choices.
+static inline float rouletteFactor(Ray ray, int index, float throughput) {
+    if (throughput >= rouletteThreshold) {
+        return 1;
+    }
+    if (throughput < ROULETTE_CUTOFF) {
+        return 0;
+    }
+
+    uint32_t bits[6];
+    memcpy(&bits[0], &ray.origin, sizeof(Vector));
+    memcpy(&bits[3], &ray.direction, sizeof(Vector));
+    uint32_t hash = hashCombine(frameSeed, (uint32_t)index);
+    for (int k=0; k<6; k++) {
+        hash = hashCombine(hash, bits[k]);
+    }
+
+    float survive = throughput / rouletteThreshold;
+    return (bitsToFloat(hash) < survive) ? 1 / survive : 0;
+}
+
+// Decide whether secondary ray index with weight w in its hit's color is
+// traced, and count it if it is
+static inline void terminateSecondaryRay(SecondaryRays* next, int index, Ray ray, float w, float throughput, int depth) {
+    float f = rouletteFactor(ray, index, throughput * w);
+
+    next->weight[index] = w * f;
+    next->throughput[index] = throughput * w * f;
+    if (f > 0) {
+        STAT_DEPTH(depth, 1);
+        if (index == 0) {
+            STAT_ADD(reflectionRays, 1);
+        } else {
+            STAT_ADD(refractionRays, 1);
+        }
+    } else {
+        STAT_ADD(terminatedRays, 1);
+    }
+}
+
+// Reflection and refraction rays leaving a hit with weight throughput in
+// its sample. recur is the number of bounces left, which only matters for
+// the depth histogram.
+KERNEL_INLINE void secondaryRaysFor(Hit hit, Ray ray, int recur, float throughput, SecondaryRays* next,
+                                    GLboolean reflectOn, GLboolean refractOn) {
+    int depth = ((antialias || depthOfField) ? aaMaxDepth : maxDepth) - recur + 1;
+
+    next->reflect = reflectOn && hit.material->reflective;
+    next->refract = REFRACT_NONE;
+    next->r1 = 0;
+    for (int k=0; k<3; k++) {
+        next->weight[k] = 0;
+        next->throughput[k] = 0;
+    }
+
+    if (next->reflect) {
+        next->reflectRay.origin = hit.p;
+        next->reflectRay.direction = reflect(ray.direction, hit.n);
+        terminateSecondaryRay(next, 0, next->reflectRay, 0.25f, throughput, depth);
     }
 
-    if (transparency && hit.sphere->ri != 1 && recur > 0) {
+    if (refractOn && hit.material->ri != 1) {
         Vector r = reflect(ray.direction, hit.n);
-        float kr, kg, kb;
-        Ray ray1, ray2;
         Vector t;
         float c;
 
-
         if (dot(ray.direction, hit.n) < 0) {
-            refract(ray.direction, hit.n, hit.sphere->ri, &t);
+            refract(ray.direction, hit.n, hit.material->ri, &t);
             c = dot(scaleVector(-1, ray.direction), hit.n);
         } else {
-            if (refract(ray.direction, scaleVector(-1,hit.n), 1/hit.sphere->ri, &t)) {
+            if (refract(ray.direction, scaleVector(-1,hit.n), 1/hit.material->ri, &t)) {
                 c = dot(t, hit.n);
             } else {
-                ray1.origin = hit.p;
-                ray1.direction = r;
-                return addRGB(pixelColor, castRay(ray1, recur-1));
+                next->refract = REFRACT_TOTAL;
+                next->refractRays[0].origin = hit.p;
+                next->refractRays[0].direction = r;
+                terminateSecondaryRay(next, 1, next->refractRays[0], 1, throughput, depth);
+                return;
             }
         }
 
-        float r0 = pow(hit.sphere->ri-1, 2.0) / pow(hit.sphere->ri+1, 2.0);
-        float r1 = r0 + (1-r0) * pow(1-c, 5.0);
+        float r0 = pow(hit.material->ri-1, 2.0) / pow(hit.material->ri+1, 2.0);
+        next->r1 = r0 + (1-r0) * pow(1-c, 5.0);
+        next->refract = REFRACT_SPLIT;
 
-        ray1.origin = hit.p;
-        ray1.direction = r;
+        next->refractRays[0].origin = hit.p;
+        next->refractRays[0].direction = r;
 
-        ray2.origin = hit.p;
-        ray2.direction = t;
+        next->refractRays[1].origin = hit.p;
+        next->refractRays[1].direction = t;
 
-        return addRGB(pixelColor,addRGB(scaleRGB(castRay(ray1, recur-1), r1), scaleRGB(castRay(ray2, recur-1), (1-r1))));
+        terminateSecondaryRay(next, 1, next->refractRays[0], next->r1, throughput, depth);
+        terminateSecondaryRay(next, 2, next->refractRays[1], 1-next->r1, throughput, depth);
     }
+}
 
-    return pixelColor;
+// Add the colors traced for the secondary rays of a hit, indexed like
+// their weights, to its local color
+static inline RGBf addSecondaryColors(RGBf color, GLboolean reflect, int refract, const float* weight, const RGBf* traced) {
+    if (reflect) {
+        color = addRGB(color, scaleRGB(traced[0], weight[0]));
+    }
+    if (refract == REFRACT_TOTAL) {
+        return addRGB(color, scaleRGB(traced[1], weight[1]));
+    }
+    if (refract == REFRACT_SPLIT) {
+        return addRGB(color, addRGB(scaleRGB(traced[1], weight[1]), scaleRGB(traced[2], weight[2])));
+    }
+    return color;
 }
 
-RGBf antialiasPixel(int i, int j) {
-    float samples = 5;
-    RGBf pixelColor = newRGB(0,0,0);
-    float x,y;
-    float r;
+// Shade a hit given which lights reach it, so shadow rays can be traced
+// separately (e.g. as packets) from the rest of the shading. cast traces
+// the reflection and refraction rays.
+KERNEL_INLINE RGBf shadeVisibleFor(Hit hit, Ray ray, int recur, float throughput, unsigned int visible, int lights,
+                                   GLboolean reflectOn, GLboolean refractOn, RGBf (*cast)(Ray, int, float)) {
+    RGBf pixelColor = localColorFor(hit, ray, visible, lights);
+    SecondaryRays next;
+    RGBf traced[3];
+
+    if (recur <= 0) {
+        return pixelColor;
+    }
+    secondaryRaysFor(hit, ray, recur, throughput, &next, reflectOn, refractOn);
 
-    for (int p=0; p<samples; p++) {
-        for (int q=0; q<samples; q++) {
-            r = (rand() % 100)/100.0f;
+    traced[0] = traced[1] = traced[2] = newRGB(0,0,0);
+    if (next.reflect && next.weight[0] > 0) {
+        traced[0] = cast(next.reflectRay, recur-1, next.throughput[0]);
+    }
+    for (int k=0; k<refractedRays(next.refract); k++) {
+        if (next.weight[k+1] > 0) {
+            traced[k+1] = cast(next.refractRays[k], recur-1, next.throughput[k+1]);
+        }
+    }
 
-            x = (float)i + ((float)p+r) / samples;
-            y = (float)j + ((float)q+r) / samples;
+    return addSecondaryColors(pixelColor, next.reflect, next.refract, next.weight, traced);
+}
 
-            Vector origin = e;
+KERNEL_INLINE RGBf castRayFor(Ray ray, int recur, float throughput, int lights, GLboolean reflectOn, GLboolean refractOn,
+                              RGBf (*cast)(Ray, int, float)) {
+    Hit hit;
+    sceneHit(ray, &hit);
 
-            if (depthOfField) {
-                origin.y += ((float)q+r) / samples;
-                origin.z += ((float)p+r) / samples;
-            }
+    if (hit.t > 0.001) {
+        computeHitPoint(&hit, ray);
+        return shadeVisibleFor(hit, ray, recur, throughput, visibleLightsFor(hit.p, lights), lights, reflectOn, refractOn, cast);
+    }
 
-            // Compute viewing ray
-            Ray viewingRay = computeViewingRay(x,y,origin);
+    return bgColor;
+}
 
-            pixelColor = addRGB(pixelColor, castRay(viewingRay,3));
-        }
+// castRayFor for a primary ray, whose hit may come from G-buffer slot
+KERNEL_INLINE RGBf castPrimaryFor(long slot, Ray ray, int recur, int lights, GLboolean reflectOn, GLboolean refractOn,
+                                  RGBf (*cast)(Ray, int, float)) {
+    Hit hit;
+    primaryHit(slot, ray, &hit);
+
+    if (hit.t > 0.001) {
+        return shadeVisibleFor(hit, ray, recur, 1, visibleLightsFor(hit.p, lights), lights, reflectOn, refractOn, cast);
     }
-    
-    return scaleRGB(pixelColor, 1/pow(samples,2.0));
+
+    return bgColor;
 }
 
-// Display method generates the image
-void display(void) {
-    // Reset drawing window
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// Viewing ray of antialiasing sample s of a pixel. The film and lens
+// positions come from the sampler and depend only on the seed, the pixel
+// and the sample number, so samples can be taken in any order or spread
+// across frames.
+KERNEL_INLINE Ray antialiasRayFor(int i, int j, int s, GLboolean dof) {
+    uint32_t pixel = pixelKey(i, j);
+    float u, v;
+
+    sample2D(samplerType, pixel, s, 0, frameSeed, aaSamples, &u, &v);
+
+    float x = (float)i + u;
+    float y = (float)j + v;
+
+    Vector origin = e;
 
-    srand(time(NULL));
+    if (dof) {
+        sample2D(samplerType, pixel, s, 2, frameSeed, aaSamples, &u, &v);
+        origin.y += u;
+        origin.z += v;
+    }
+
+    // Compute viewing ray
+    return computeViewingRay(x,y,origin);
+}
+
+// How the pixel loops take their rays
+#define PIXEL_PLAIN 0   // one primary ray per pixel
+#define PIXEL_AA 1      // aaSamples*aaSamples antialiasing samples
+#define PIXEL_DOF 2     // antialiasing samples from jittered lens positions
 
-    // Ray-tracing loop, for each pixel
-    for (int i=0; i<window_height; i++) {
-        for (int j=0; j<window_width; j++) {
-            RGBf pixelColor;
+// Compute the final color of every pixel in a rectangle
+KERNEL_INLINE void renderPixelsFor(int x0, int y0, int x1, int y1, int mode, int lights,
+                                   GLboolean reflectOn, GLboolean refractOn, RGBf (*cast)(Ray, int, float)) {
+    float samples = aaSamples;
 
-            if (antialias || depthOfField) {
-                pixelColor = antialiasPixel(i,j);
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            RGBf pixelColor = newRGB(0,0,0);
+
+            if (mode == PIXEL_PLAIN) {
+                pixelColor = castPrimaryFor(gbufferSlot(i,j,0), computeViewingRay(i,j,e), maxDepth, lights, reflectOn, refractOn, cast);
             } else {
-                pixelColor = castRay(computeViewingRay(i,j,e), 5);
+                for (int s=0; s<aaSamples*aaSamples; s++) {
+                    RGBf sample = castPrimaryFor(gbufferSlot(i,j,s), antialiasRayFor(i,j,s, mode == PIXEL_DOF), aaMaxDepth,
+                                                 lights, reflectOn, refractOn, cast);
+                    pixelColor = addRGB(pixelColor, sample);
+                }
+                pixelColor = scaleRGB(pixelColor, 1/pow(samples,2.0));
             }
 
             // Update pixel color to result from ray
-            setPixelColor(pixelColor, &pixels[(j*window_width*3) + (i*3)]);
+            setPixelColor(pixelColor, (RGBf*)&pixels[(j*window_width*3) + (i*3)]);
         }
     }
+}
 
-    // Draw the pixel array
-    glDrawPixels(window_width, window_height, GL_RGB, GL_FLOAT, pixels);
+typedef struct {
+    RGBf (*castRay)(Ray ray, int recur, float throughput);
+    RGBf (*shadeVisible)(Hit hit, Ray ray, int recur, float throughput, unsigned int visible);
+    void (*renderPixels)(int x0, int y0, int x1, int y1);
+    RGBf (*sample)(int i, int j, int s);
+} ShadingKernel;
+
+// The variants for L lights with reflection R and transparency T (0 or 1)
+#define SHADING_KERNEL(L, R, T) \
+    RGBf castRay##L##R##T(Ray ray, int recur, float throughput) { \
+        return castRayFor(ray, recur, throughput, L, R, T, castRay##L##R##T); \
+    } \
+    RGBf shadeVisible##L##R##T(Hit hit, Ray ray, int recur, float throughput, unsigned int visible) { \
+        return shadeVisibleFor(hit, ray, recur, throughput, visible, L, R, T, castRay##L##R##T); \
+    } \
+    PIXEL_KERNEL(L, R, T, PIXEL_PLAIN, 0) \
+    PIXEL_KERNEL(L, R, T, PIXEL_AA, 1) \
+    PIXEL_KERNEL(L, R, T, PIXEL_DOF, 2)
+
+#define PIXEL_KERNEL(L, R, T, MODE, M) \
+    void renderPixels##L##R##T##M(int x0, int y0, int x1, int y1) { \
+        renderPixelsFor(x0, y0, x1, y1, MODE, L, R, T, castRay##L##R##T); \
+    } \
+    RGBf sample##L##R##T##M(int i, int j, int s) { \
+        Ray ray = antialiasRayFor(i,j,s, MODE == PIXEL_DOF); \
+        return castPrimaryFor(gbufferSlot(i,j,s), ray, aaMaxDepth, L, R, T, castRay##L##R##T); \
+    }
 
-    // Reset buffer for next frame
-    glutSwapBuffers();
+#define SHADING_KERNELS(L) \
+    SHADING_KERNEL(L, 0, 0) SHADING_KERNEL(L, 0, 1) SHADING_KERNEL(L, 1, 0) SHADING_KERNEL(L, 1, 1)
+
+#define KERNEL_ENTRY(L, R, T, M) {castRay##L##R##T, shadeVisible##L##R##T, renderPixels##L##R##T##M, sample##L##R##T##M}
+#define KERNEL_MODES(L, R, T) {KERNEL_ENTRY(L, R, T, 0), KERNEL_ENTRY(L, R, T, 1), KERNEL_ENTRY(L, R, T, 2)}
+#define KERNEL_TOGGLES(L) {{KERNEL_MODES(L, 0, 0), KERNEL_MODES(L, 0, 1)}, {KERNEL_MODES(L, 1, 0), KERNEL_MODES(L, 1, 1)}}
+
+#if MAX_LIGHTS != 3
+    #error "Instantiate the shading kernels for every light count up to MAX_LIGHTS"
+#endif
+SHADING_KERNELS(0)
+SHADING_KERNELS(1)
+SHADING_KERNELS(2)
+SHADING_KERNELS(3)
+
+// Indexed by light count, reflection, transparency and pixel mode
+ShadingKernel shadingKernels[MAX_LIGHTS+1][2][2][3] = {
+    KERNEL_TOGGLES(0), KERNEL_TOGGLES(1), KERNEL_TOGGLES(2), KERNEL_TOGGLES(3)
+};
+
+ShadingKernel* shadingKernel = &shadingKernels[1][0][0][PIXEL_PLAIN];
+
+// Pick the kernel matching the current toggles. Called before every frame.
+void selectShadingKernel() {
+    int mode = depthOfField ? PIXEL_DOF : (antialias ? PIXEL_AA : PIXEL_PLAIN);
+    shadingKernel = &shadingKernels[numLights][reflection != 0][transparency != 0][mode];
 }
 
-void reshape(int width, int height) {
-    glViewport(0, 0, width, height);
+// Entry points for code that isn't specialized: the packet and wavefront
+// renderers, which batch their own shadow rays, and the benchmarks
+RGBf castRay(Ray ray, int recur, float throughput) {
+    return shadingKernel->castRay(ray, recur, throughput);
 }
 
-void idle(void) {
-    glutPostRedisplay();
+RGBf shadeVisible(Hit hit, Ray ray, int recur, float throughput, unsigned int visible) {
+    return shadingKernel->shadeVisible(hit, ray, recur, throughput, visible);
 }
 
-void toggle(GLboolean* toggle) {
-    *toggle = !(*toggle);
+RGBf shade(Hit hit, Ray ray, int recur) {
+    return shadeVisible(hit, ray, recur, 1, visibleLightsFor(hit.p, numLights));
 }
 
-void keyboard(unsigned char key, int x, int y) {    
-    switch (key) {
-        case 'h':
-            printf("HELP\n");
-            printf("----\n");
-            printf("a - toggle antialiasing\n");
-            printf("d - toggle depth of field\n");
-            printf("r - toggle reflections\n");
-            printf("t - toggle transparency\n");
-            printf("l - increase number of lights (max: 3)\n");
-            printf("k - decrease number of lights (min: 1)\n");
-            break;
-        case 'a':
-            toggle(&antialias);
-            break;
-        case 'd':
-            toggle(&depthOfField);
-            break;
-        case 'r':
-            toggle(&reflection);
-            break;
-        case 't':
-            toggle(&transparency);
-            break;
-        case 'l':
-            numLights += (numLights < 3) ? 1 : 0;
-            break;
-        case 'k':
-            numLights -= (numLights > 1) ? 1 : 0;
-            break;
-    }
-    
-    glutPostRedisplay();
+RGBf localColor(Hit hit, Ray ray, unsigned int visible) {
+    return localColorFor(hit, ray, visible, numLights);
 }
 
-int main(int argc, char** argv) {
-    glutInit(&argc, argv);
-    init();
+void secondaryRays(Hit hit, Ray ray, int recur, float throughput, SecondaryRays* next) {
+    secondaryRaysFor(hit, ray, recur, throughput, next, reflection, transparency);
+}
 
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-    glutInitWindowSize(window_width, window_height);
+Ray antialiasRay(int i, int j, int s) {
+    return antialiasRayFor(i, j, s, depthOfField);
+}
 
-    glutCreateWindow("CAP 4730 | Final Project | Advanced Ray-Tracer");
-    glutDisplayFunc(display);
-    glutKeyboardFunc(keyboard);
-    glutReshapeFunc(reshape);
-    glutIdleFunc(idle);
+RGBf antialiasSample(int i, int j, int s) {
+    return shadingKernel->sample(i, j, s);
+}
 
-    glutMainLoop();
+// Trace a block of primary rays as one packet and their shadow rays as one
+// packet per light. Reflection and refraction rays diverge, so those fall
+// back to single rays through shadeVisible.
+void tracePacketBlock(int x0, int y0, int x1, int y1) {
+    RayPacket primary, shadow;
+    Ray rays[PACKET_SIZE];
+    Hit hits[PACKET_SIZE];
+    unsigned int visible[PACKET_SIZE];
+    long slots[PACKET_SIZE];
+    GLboolean stored = gbufferActive;
+
+    for (int k=0; k<PACKET_SIZE; k++) {
+        int i = x0 + k % PACKET_WIDTH;
+        int j = y0 + k / PACKET_WIDTH;
+
+        // Rays past the edge of the image stay inactive, but still get a
+        // valid direction so they don't produce NaNs in the packet loops
+        primary.active[k] = (i < x1 && j < y1);
+        rays[k] = primary.active[k] ? computeViewingRay(i,j,e) : rays[0];
+        setPacketRay(&primary, k, rays[k]);
+        primary.t[k] = INFINITY;
+        primary.sphere[k] = -1;
+        slots[k] = primary.active[k] ? gbufferSlot(i,j,0) : -1;
+        stored = stored && (slots[k] < 0 || gbufferValid[slots[k]]);
+    }
 
-    return EXIT_SUCCESS;
+    // The packet is only traced if the G-buffer is missing any of its hits
+    if (!stored) {
+        bvhNearestPacket(&sceneBVH, &spheres, e, &primary);
+    }
+
+    for (int k=0; k<PACKET_SIZE; k++) {
+        visible[k] = 0;
+        if (stored) {
+            hits[k].t = -1;
+            if (primary.active[k]) {
+                primaryHit(slots[k], rays[k], &hits[k]);
+            }
+        } else {
+            hits[k].sphere = primary.sphere[k];
+            hits[k].mesh = hits[k].triangle = hits[k].instance = -1;
+            hits[k].material = (hits[k].sphere >= 0) ? &spheres.materials[hits[k].sphere] : NULL;
+            hits[k].t = (hits[k].sphere >= 0) ? primary.t[k] : -1;
+
+            // Meshes and instances are traced one ray at a time, limited to
+            // the sphere hits
+            if (meshCount > 0 && primary.active[k]) {
+                nearestMeshHit(&rays[k], &hits[k]);
+            }
+            if (instanceCount > 0 && primary.active[k]) {
+                nearestInstanceHit(&rays[k], &hits[k]);
+            }
+            if (primary.active[k] && hits[k].t > 0.001) {
+                computeHitPoint(&hits[k], rays[k]);
+            }
+            if (slots[k] >= 0) {
+                storeGBufferHit(slots[k], &hits[k]);
+            }
+        }
+
+        shadow.active[k] = primary.active[k] && hits[k].t > 0.001;
+        if (!shadow.active[k]) {
+            hits[k].p = e;
+        }
+    }
+
+    for (int i=0; i<numLights; i++) {
+        Vector direction = scaleVector(-1, light[i]);
+        int cached = cachedOccluder(i);
+        int lit[PACKET_SIZE];
+        int rays = 0;
+
+        for (int k=0; k<PACKET_SIZE; k++) {
+            lit[k] = primary.active[k] && hits[k].t > 0.001;
+            shadow.active[k] = lit[k];
+            setPacketRay(&shadow, k, calcShadowRay(hits[k].p, light[i]));
+            shadow.t[k] = INFINITY;
+            shadow.sphere[k] = -1;
+            rays += lit[k];
+        }
+
+        // Rays blocked by the cached occluder drop out before the traversal.
+        // The grid has its own test, which the cache has to agree with.
+        int remaining = rays;
+        if (cached >= 0 && rays > 0 && shadowGridsOn) {
+            for (int k=0; k<PACKET_SIZE; k++) {
+                if (shadow.active[k] && gridCachedBlocks(&shadowGrids[i], &spheres, &(Ray){direction, hits[k].p}, cached, INFINITY)) {
+                    shadow.active[k] = 0;
+                    shadow.sphere[k] = cached;
+                    remaining--;
+                }
+            }
+        } else if (cached >= 0 && rays > 0) {
+            remaining = occludedSpheresPacket(&spheres, cached, 1, direction, &shadow);
+        }
+        STAT_ADD(shadowRays, rays);
+        STAT_ADD(shadowCacheHits, rays - remaining);
+        STAT_ADD(sphereTests, cached >= 0 ? PACKET_SIZE : 0);
+
+        // The grid answers each ray from one cell, which beats a packet
+        // traversal that tests every sphere of a leaf against 64 rays
+        if (shadowGridsOn) {
+            for (int k=0; k<PACKET_SIZE; k++) {
+                int blocker = shadow.active[k] ? gridAnySphere(&shadowGrids[i], &spheres, &(Ray){direction, hits[k].p}, INFINITY) : -1;
+                if (blocker >= 0) {
+                    shadow.active[k] = 0;
+                    shadow.sphere[k] = blocker;
+                }
+            }
+        } else {
+            bvhOccludedPacket(&sceneBVH, &spheres, direction, &shadow);
+        }
+
+        for (int k=0; k<PACKET_SIZE; k++) {
+            // Rays no sphere blocks may still be blocked by a mesh or an
+            // instance, which leaves the cached occluder as it is
+            if (shadow.active[k] && ((meshCount > 0 && meshesOccluded(&(Ray){direction, hits[k].p}, INFINITY)) ||
+                                     (instanceCount > 0 && instancesOccluded(&(Ray){direction, hits[k].p}, INFINITY)))) {
+                shadow.active[k] = 0;
+                shadow.sphere[k] = cached;
+            }
+            if (lit[k] && shadow.active[k]) {
+                visible[k] |= 1u << i;
+            } else if (lit[k] && shadow.sphere[k] != cached) {
+                lastOccluder[i] = shadow.sphere[k] + 1;
+            }
+        }
+    }
+
+    for (int k=0; k<PACKET_SIZE; k++) {
+        int i = x0 + k % PACKET_WIDTH;
+        int j = y0 + k / PACKET_WIDTH;
+        RGBf pixelColor;
+
+        if (!primary.active[k]) {
+            continue;
+        }
+        if (hits[k].t > 0.001) {
+            pixelColor = shadeVisible(hits[k], rays[k], maxDepth, 1, visible[k]);
+        } else {
+            pixelColor = bgColor;
+        }
+        setPixelColor(pixelColor, (RGBf*)&pixels[(j*window_width*3) + (i*3)]);
+    }
+}
+
+// Wavefront rendering. Instead of recursing through castRay and shade for
+// every pixel, all primary rays of a tile are put in a queue and processed
+// stage by stage: intersect the whole queue, trace its shadow rays light by
+// light, shade it, and append the reflection and refraction rays it spawns
+// as the next queue. Each stage is a tight loop over many rays, which keeps
+// the instruction cache warm and the branches predictable.
+//
+// Every path ray remembers its spawned rays and their weights, carrying its
+// own weight in the sample to decide which of them are worth tracing. Once
+// the last queue is done the colors are combined from the back of the array to
+// the front, with exactly the arithmetic shadeVisible uses, so the images
+// are identical to the recursive renderer.
+
+typedef struct {
+    Ray ray;
+    Hit hit;
+    RGBf color;         // Direct lighting, then the final color once combined
+    float throughput;   // Weight of this ray in its sample
+    float weight[3];    // Weights of the spawned rays, as in SecondaryRays
+    int depth;          // Bounces left, like recur in shade()
+    int firstChild;     // Spawned rays are stored consecutively from here
+    long slot;          // G-buffer slot of a primary ray, or -1
+    GLboolean reflect;
+    int refract;
+    unsigned int visible;
+} PathRay;
+
+typedef struct {
+    PathRay* rays;
+    int count;
+    int capacity;
+} Wavefront;
+
+// Path ray storage for each worker, reused from tile to tile
+Wavefront wavefronts[MAX_THREADS];
+
+GLboolean wavefrontRendering = GL_FALSE;
+
+// Append a ray to the queue, returning its index
+int pushPathRay(Wavefront* wf, Ray ray, int depth, float throughput) {
+    if (wf->count == wf->capacity) {
+        wf->capacity = (wf->capacity > 0) ? wf->capacity * 2 : 4096;
+        wf->rays = realloc(wf->rays, sizeof(PathRay) * wf->capacity);
+        if (wf->rays == NULL) {
+            fprintf(stderr, "Out of memory growing the wavefront queue\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    PathRay* pr = &wf->rays[wf->count];
+    pr->ray = ray;
+    pr->depth = depth;
+    pr->throughput = throughput;
+    pr->firstChild = -1;
+    pr->slot = -1;
+    pr->reflect = GL_FALSE;
+    pr->refract = REFRACT_NONE;
+    pr->visible = 0;
+    return wf->count++;
 }
+
+// Trace every ray in the queue and everything it spawns. On return the
+// color of each ray that was in the queue is final.
+void traceWavefront(Wavefront* wf) {
+    int begin = 0;
+    STAT_TIMER(timer);
+
+    while (begin < wf->count) {
+        int end = wf->count;
+
+        // Intersection stage
+        for (int k=begin; k<end; k++) {
+            PathRay* pr = &wf->rays[k];
+            primaryHit(pr->slot, pr->ray, &pr->hit);
+        }
+        STAT_PHASE(PHASE_INTERSECT, timer);
+
+        // Shadow stage, one light at a time so the occluder cache stays hot
+        for (int i=0; i<numLights; i++) {
+            for (int k=begin; k<end; k++) {
+                PathRay* pr = &wf->rays[k];
+                if (pr->hit.t > 0.001 && !inShadow(calcShadowRay(pr->hit.p, light[i]), i, INFINITY)) {
+                    pr->visible |= 1u << i;
+                }
+            }
+        }
+        STAT_PHASE(PHASE_SHADOW, timer);
+
+        // Shading stage, which fills the next queue
+        for (int k=begin; k<end; k++) {
+            PathRay* pr = &wf->rays[k];
+            SecondaryRays next;
+
+            if (pr->hit.t <= 0.001) {
+                pr->color = bgColor;
+                continue;
+            }
+            pr->color = localColor(pr->hit, pr->ray, pr->visible);
+            if (pr->depth <= 0) {
+                continue;
+            }
+
+            secondaryRays(pr->hit, pr->ray, pr->depth, pr->throughput, &next);
+            pr->reflect = next.reflect;
+            pr->refract = next.refract;
+            memcpy(pr->weight, next.weight, sizeof(next.weight));
+
+            // pushPathRay may move the array, so only indices are kept
+            int depth = pr->depth - 1;
+            int first = wf->count;
+
+            if (next.reflect && next.weight[0] > 0) {
+                pushPathRay(wf, next.reflectRay, depth, next.throughput[0]);
+            }
+            for (int r=0; r<refractedRays(next.refract); r++) {
+                if (next.weight[r+1] > 0) {
+                    pushPathRay(wf, next.refractRays[r], depth, next.throughput[r+1]);
+                }
+            }
+            wf->rays[k].firstChild = (wf->count > first) ? first : -1;
+        }
+        STAT_PHASE(PHASE_SHADE, timer);
+
+        begin = end;
+    }
+
+    // Spawned rays always come after the ray that spawned them
+    for (int k=wf->count-1; k>=0; k--) {
+        PathRay* pr = &wf->rays[k];
+        int child = pr->firstChild;
+        RGBf traced[3];
+
+        if (child < 0) {
+            continue;
+        }
+        // Rays that weren't traced have weight 0 and no entry
+        traced[0] = traced[1] = traced[2] = newRGB(0,0,0);
+        if (pr->reflect && pr->weight[0] > 0) {
+            traced[0] = wf->rays[child++].color;
+        }
+        for (int r=0; r<refractedRays(pr->refract); r++) {
+            if (pr->weight[r+1] > 0) {
+                traced[r+1] = wf->rays[child++].color;
+            }
+        }
+        pr->color = addSecondaryColors(pr->color, pr->reflect, pr->refract, pr->weight, traced);
+    }
+    STAT_PHASE(PHASE_COMBINE, timer);
+}
+
+// Render a tile with the wavefront pipeline. Takes samples [first, last)
+// of every pixel when antialiasing and returns their sum in sums, which
+// holds one color per tile pixel; otherwise writes the pixels directly.
+void wavefrontTile(int x0, int y0, int x1, int y1, int first, int last, RGBf* sums) {
+    Wavefront* wf = &wavefronts[poolWorker];
+    GLboolean sampled = antialias || depthOfField;
+    int samples = sampled ? last - first : 1;
+
+    wf->count = 0;
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            if (!sampled) {
+                int k = pushPathRay(wf, computeViewingRay(i,j,e), maxDepth, 1);
+                wf->rays[k].slot = gbufferSlot(i,j,0);
+                continue;
+            }
+            for (int s=first; s<last; s++) {
+                int k = pushPathRay(wf, antialiasRay(i,j,s), aaMaxDepth, 1);
+                wf->rays[k].slot = gbufferSlot(i,j,s);
+            }
+        }
+    }
+
+    traceWavefront(wf);
+
+    int k = 0;
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            if (!sampled) {
+                setPixelColor(wf->rays[k++].color, (RGBf*)&pixels[(j*window_width*3) + (i*3)]);
+                continue;
+            }
+            RGBf pixelColor = newRGB(0,0,0);
+            for (int s=0; s<samples; s++) {
+                pixelColor = addRGB(pixelColor, wf->rays[k++].color);
+            }
+            *sums++ = pixelColor;
+        }
+    }
+}
+
+GLboolean frameCancelled() {
+    return __atomic_load_n(&cancelRequested, __ATOMIC_RELAXED) != 0;
+}
+
+// Convert part of the pixel array for presentation. Tiles are converted as
+// soon as they are traced, so the window can show a frame in progress.
+void presentTile(int x0, int y0, int x1, int y1) {
+    if (presentPixels == NULL) {
+        return;
+    }
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            const float* src = &pixels[(j*window_width + i) * 3];
+            unsigned char* dst = &presentPixels[(j*window_width + i) * 4];
+            dst[0] = toByte(src[0]);
+            dst[1] = toByte(src[1]);
+            dst[2] = toByte(src[2]);
+            dst[3] = 255;
+        }
+    }
+}
+
+void presentFrame() {
+    presentTile(0, 0, window_width, window_height);
+}
+
+// Tile bounds of a job
+void tileBounds(int job, int* x0, int* y0, int* x1, int* y1) {
+    int tilesX = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+    *x0 = (job % tilesX) * TILE_SIZE;
+    *y0 = (job / tilesX) * TILE_SIZE;
+    *x1 = (*x0 + TILE_SIZE < window_width) ? *x0 + TILE_SIZE : window_width;
+    *y1 = (*y0 + TILE_SIZE < window_height) ? *y0 + TILE_SIZE : window_height;
+}
+
+// Ray-trace every pixel of one tile into the pixel array
+void renderTile(void* context, int job, int worker) {
+    int x0, y0, x1, y1;
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    if (frameCancelled()) {
+        return;
+    }
+
+    if (wavefrontRendering) {
+        RGBf sums[TILE_SIZE * TILE_SIZE];
+        float samples = aaSamples;
+
+        wavefrontTile(x0, y0, x1, y1, 0, aaSamples * aaSamples, sums);
+        if (antialias || depthOfField) {
+            for (int j=y0; j<y1; j++) {
+                for (int i=x0; i<x1; i++) {
+                    RGBf pixelColor = sums[(j-y0)*(x1-x0) + (i-x0)];
+                    setPixelColor(scaleRGB(pixelColor, 1/pow(samples,2.0)), (RGBf*)&pixels[(j*window_width*3) + (i*3)]);
+                }
+            }
+        }
+    } else if (packetTracing && !antialias && !depthOfField) {
+        for (int j=y0; j<y1; j+=PACKET_WIDTH) {
+            for (int i=x0; i<x1; i+=PACKET_WIDTH) {
+                tracePacketBlock(i, j, x1, y1);
+            }
+        }
+    } else {
+        shadingKernel->renderPixels(x0, y0, x1, y1);
+    }
+
+    presentTile(x0, y0, x1, y1);
+}
+
+// Add the next progressive sample to every pixel of one tile and store the
+// running average in the pixel array
+void accumulateTile(void* context, int job, int worker) {
+    int x0, y0, x1, y1;
+    float scale = 1/(double)(accumSamples+1);
+    RGBf samples[TILE_SIZE * TILE_SIZE];
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    if (frameCancelled()) {
+        return;
+    }
+    if (wavefrontRendering) {
+        wavefrontTile(x0, y0, x1, y1, accumSamples, accumSamples+1, samples);
+    }
+
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            RGBf* sum = (RGBf*)&accumulation[(j*window_width*3) + (i*3)];
+            RGBf sample = wavefrontRendering ? samples[(j-y0)*(x1-x0) + (i-x0)] : antialiasSample(i,j,accumSamples);
+            *sum = addRGB(*sum, sample);
+            setPixelColor(scaleRGB(*sum, scale), (RGBf*)&pixels[(j*window_width*3) + (i*3)]);
+        }
+    }
+    presentTile(x0, y0, x1, y1);
+}
+
+// Throw away the accumulated samples, e.g. after a setting changed
+void resetAccumulation() {
+    accumSamples = 0;
+}
+
+// Samples taken, one cache line per worker
+typedef struct __attribute__((aligned(64))) {
+    unsigned long samples;
+} AdaptiveStats;
+
+AdaptiveStats adaptiveStats[MAX_THREADS];
+
+// Average samples per pixel of the last adaptive frame
+double adaptiveSamplesPerPixel = 0;
+
+// Take extra[k] more samples for every pixel k of a tile, continuing each
+// pixel's sample sequence, and add them to its statistics
+void adaptiveSamples(int x0, int y0, int x1, int y1, const int* extra) {
+    Wavefront* wf = &wavefronts[poolWorker];
+    int k = 0, ray = 0;
+
+    if (wavefrontRendering) {
+        wf->count = 0;
+        for (int j=y0; j<y1; j++) {
+            for (int i=x0; i<x1; i++, k++) {
+                int first = adaptivePixels[j*window_width + i].samples;
+                for (int s=first; s<first+extra[k]; s++) {
+                    int queued = pushPathRay(wf, antialiasRay(i,j,s), aaMaxDepth, 1);
+                    wf->rays[queued].slot = gbufferSlot(i,j,s);
+                }
+            }
+        }
+        traceWavefront(wf);
+    }
+
+    k = 0;
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++, k++) {
+            AdaptivePixel* px = &adaptivePixels[j*window_width + i];
+            int first = px->samples;
+
+            for (int s=first; s<first+extra[k]; s++) {
+                RGBf color = wavefrontRendering ? wf->rays[ray++].color : antialiasSample(i,j,s);
+                float lum = (0.2126f*color.r + 0.7152f*color.g + 0.0722f*color.b) / 255;
+
+                px->sum = addRGB(px->sum, color);
+                px->lum += lum;
+                px->lum2 += lum*lum;
+                px->samples++;
+            }
+            adaptiveStats[poolWorker].samples += extra[k];
+        }
+    }
+}
+
+// First adaptive pass: the minimum number of samples for every pixel
+void adaptiveFirstPass(void* context, int job, int worker) {
+    int x0, y0, x1, y1;
+    int extra[TILE_SIZE * TILE_SIZE];
+    int maxSamples = aaSamples * aaSamples;
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    if (frameCancelled()) {
+        return;
+    }
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            adaptivePixels[j*window_width + i] = (AdaptivePixel){newRGB(0,0,0), 0, 0, 0, 0};
+        }
+    }
+    for (int k=0; k<(x1-x0)*(y1-y0); k++) {
+        extra[k] = (aaMinSamples < maxSamples) ? aaMinSamples : maxSamples;
+    }
+    adaptiveSamples(x0, y0, x1, y1, extra);
+}
+
+// Largest luminance difference between a pixel and its four neighbours,
+// measured once the first pass is done everywhere
+void adaptiveContrast(void* context, int job, int worker) {
+    int x0, y0, x1, y1;
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    if (frameCancelled()) {
+        return;
+    }
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            AdaptivePixel* px = &adaptivePixels[j*window_width + i];
+            float mean = px->lum / px->samples;
+            int neighbours[4][2] = {{i-1, j}, {i+1, j}, {i, j-1}, {i, j+1}};
+
+            px->contrast = 0;
+            for (int n=0; n<4; n++) {
+                int ni = neighbours[n][0], nj = neighbours[n][1];
+                if (ni >= 0 && nj >= 0 && ni < (int)window_width && nj < (int)window_height) {
+                    AdaptivePixel* other = &adaptivePixels[nj*window_width + ni];
+                    float difference = fabsf(mean - other->lum / other->samples);
+                    px->contrast = (difference > px->contrast) ? difference : px->contrast;
+                }
+            }
+        }
+    }
+}
+
+// Second adaptive pass: pixels on an edge get the full sample budget, the
+// others get more samples a batch at a time while the standard error of
+// their mean luminance is above the threshold
+void adaptiveRefine(void* context, int job, int worker) {
+    int x0, y0, x1, y1;
+    int extra[TILE_SIZE * TILE_SIZE];
+    int maxSamples = aaSamples * aaSamples;
+    int batch = (aaMinSamples > 0) ? aaMinSamples : 1;
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    if (frameCancelled()) {
+        return;
+    }
+    for (;;) {
+        int k = 0, more = 0;
+
+        for (int j=y0; j<y1; j++) {
+            for (int i=x0; i<x1; i++, k++) {
+                AdaptivePixel* px = &adaptivePixels[j*window_width + i];
+                float mean = px->lum / px->samples;
+                float variance = px->lum2 / px->samples - mean*mean;
+                float error = sqrtf((variance > 0 ? variance : 0) / px->samples);
+                int left = maxSamples - px->samples;
+
+                extra[k] = 0;
+                if (left > 0 && px->contrast > aaThreshold) {
+                    extra[k] = left;
+                } else if (left > 0 && error > aaThreshold) {
+                    extra[k] = (batch < left) ? batch : left;
+                }
+                more += extra[k];
+            }
+        }
+        if (more == 0 || frameCancelled()) {
+            break;
+        }
+        adaptiveSamples(x0, y0, x1, y1, extra);
+    }
+
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            AdaptivePixel* px = &adaptivePixels[j*window_width + i];
+            setPixelColor(scaleRGB(px->sum, 1/(double)px->samples), (RGBf*)&pixels[(j*window_width*3) + (i*3)]);
+        }
+    }
+    presentTile(x0, y0, x1, y1);
+}
+
+// Render an antialiased frame with adaptive sampling
+void renderAdaptiveFrame() {
+    int tilesX = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (window_height + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned long samples = 0;
+
+    if (adaptivePixels == NULL) {
+        adaptivePixels = malloc(sizeof(AdaptivePixel) * window_width * window_height);
+        if (adaptivePixels == NULL) {
+            fprintf(stderr, "Unable to allocate a %ux%u adaptive sampling buffer\n", window_width, window_height);
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(adaptiveStats, 0, sizeof(adaptiveStats));
+
+    parallelFor(tilesX * tilesY, adaptiveFirstPass, NULL);
+    parallelFor(tilesX * tilesY, adaptiveContrast, NULL);
+    parallelFor(tilesX * tilesY, adaptiveRefine, NULL);
+
+    for (int i=0; i<MAX_THREADS; i++) {
+        samples += adaptiveStats[i].samples;
+    }
+    adaptiveSamplesPerPixel = (double)samples / ((double)window_width * window_height);
+}
+
+// Samples pixel (i, j) of an antialiased frame has taken so far
+int samplesTaken(int i, int j) {
+    if (adaptiveAA) {
+        return adaptivePixels[j*window_width + i].samples;
+    }
+    return progressive ? accumSamples : aaSamples * aaSamples;
+}
+
+// Fill in the denoiser's planes for one tile: the pixel colors and the
+// albedo, normal and depth of the primary hits averaged over each pixel's
+// samples. The hits normally come from the G-buffer the frame just filled.
+void denoiseFeatures(void* context, int job, int worker) {
+    DenoiseBuffers* buffers = &denoiseBuffers;
+    int x0, y0, x1, y1;
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            int p = j*window_width + i, samples = samplesTaken(i,j);
+            RGBf albedo = newRGB(0,0,0);
+            Vector normal = newVector(0,0,0);
+            float depth = 0;
+            const Material* first = NULL;
+            int agree = 0;
+
+            for (int s=0; s<samples; s++) {
+                long slot = gbufferSlot(i,j,s);
+                GBufferHit hit;
+
+                // Samples missing from the G-buffer, e.g. those traced by
+                // remote workers, are traced again
+                if (slot >= 0 && gbufferValid[slot]) {
+                    hit = gbuffer[slot];
+                } else {
+                    Hit traced;
+                    primaryHit(slot, antialiasRay(i,j,s), &traced);
+                    hit.n = traced.n;
+                    hit.t = traced.t;
+                    hit.material = traced.material;
+                }
+                if (hit.t <= 0.001) {
+                    hit.material = NULL;
+                }
+                first = (s == 0) ? hit.material : first;
+                agree += (hit.material == first);
+                if (hit.t > 0.001) {
+                    albedo = addRGB(albedo, hit.material->color);
+                    normal = addVector(normal, hit.n);
+                    depth += hit.t;
+                } else {
+                    albedo = addRGB(albedo, bgColor);
+                    depth += DENOISE_MISS_DEPTH;
+                }
+            }
+
+            float scale = 1.0f / (samples > 0 ? samples : 1);
+            buffers->albedo[0][p] = albedo.r * scale / 255;
+            buffers->albedo[1][p] = albedo.g * scale / 255;
+            buffers->albedo[2][p] = albedo.b * scale / 255;
+            buffers->normal[0][p] = normal.x * scale;
+            buffers->normal[1][p] = normal.y * scale;
+            buffers->normal[2][p] = normal.z * scale;
+            buffers->depth[p] = (samples > 0) ? depth * scale : DENOISE_MISS_DEPTH;
+            // Samples split between surfaces make the averages a blend
+            // that changes with the noise, so they aren't trusted
+            buffers->trust[p] = (agree == samples) ? 1 : 0;
+            for (int c=0; c<3; c++) {
+                buffers->color[c][p] = pixels[p*3 + c];
+            }
+        }
+    }
+}
+
+// Copy one tile of the denoised image back into the pixel array
+void denoiseResult(void* context, int job, int worker) {
+    int x0, y0, x1, y1;
+
+    tileBounds(job, &x0, &y0, &x1, &y1);
+    for (int j=y0; j<y1; j++) {
+        for (int i=x0; i<x1; i++) {
+            int p = j*window_width + i;
+            for (int c=0; c<3; c++) {
+                pixels[p*3 + c] = denoiseBuffers.color[c][p];
+            }
+        }
+    }
+    presentTile(x0, y0, x1, y1);
+}
+
+// Denoise the antialiased frame in the pixel array
+void denoiseFrame() {
+    int tilesX = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (window_height + TILE_SIZE - 1) / TILE_SIZE;
+
+    if (frameCancelled() || prepareDenoiseBuffers(&denoiseBuffers, window_width, window_height) != 0) {
+        return;
+    }
+    parallelFor(tilesX * tilesY, denoiseFeatures, NULL);
+    denoiseImage(&denoiseBuffers);
+    parallelFor(tilesX * tilesY, denoiseResult, NULL);
+}
+
+// Ray-trace the whole frame on the thread pool. In progressive mode only
+// one more sample per pixel is traced, and nothing once the image has all
+// of its samples. Adaptive antialiasing always renders the whole frame.
+// With denoising on, every traced antialiased frame or pass is denoised.
+void renderFrame() {
+    int tilesX = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (window_height + TILE_SIZE - 1) / TILE_SIZE;
+    GLboolean sampled = antialias || depthOfField;
+
+    selectShadingKernel();
+    prepareGBuffer();
+    if (adaptiveAA && sampled) {
+        renderAdaptiveFrame();
+        if (denoise) {
+            denoiseFrame();
+        }
+        return;
+    }
+
+    if (progressive && sampled) {
+        if (accumCamera != cameraGeneration) {
+            accumCamera = cameraGeneration;
+            accumSamples = 0;
+        }
+        if (accumulation == NULL) {
+            accumulation = malloc(sizeof(float) * window_width * window_height * 3);
+            if (accumulation == NULL) {
+                fprintf(stderr, "Unable to allocate a %ux%u accumulation buffer\n", window_width, window_height);
+                exit(EXIT_FAILURE);
+            }
+            accumSamples = 0;
+        }
+        if (accumSamples == 0) {
+            memset(accumulation, 0, sizeof(float) * window_width * window_height * 3);
+        }
+        if (accumSamples < aaSamples * aaSamples) {
+            parallelFor(tilesX * tilesY, accumulateTile, NULL);
+            accumSamples++;
+            if (denoise) {
+                denoiseFrame();
+            }
+        }
+        return;
+    }
+
+    parallelFor(tilesX * tilesY, renderTile, NULL);
+    if (denoise && sampled) {
+        denoiseFrame();
+    }
+}
+
+// Whether the pixel array holds every sample of the frame
+GLboolean frameFinished() {
+    return !(progressive && (antialias || depthOfField)) || adaptiveAA || accumSamples >= aaSamples * aaSamples;
+}
+
+// Fill in the render state for the current settings
+void currentRenderState(RenderState* state) {
+    // Cleared first so padding doesn't affect comparisons
+    memset(state, 0, sizeof(RenderState));
+    state->antialias = antialias;
+    state->reflection = reflection;
+    state->transparency = transparency;
+    state->depthOfField = depthOfField;
+    state->numLights = numLights;
+    state->aaSamples = (antialias || depthOfField) ? aaSamples : 0;
+    state->maxDepth = maxDepth;
+    state->aaMaxDepth = (antialias || depthOfField) ? aaMaxDepth : 0;
+    state->roulette = rouletteThreshold;
+    state->sampler = (antialias || depthOfField) ? samplerType : 0;
+    state->seed = (antialias || depthOfField) ? frameSeed : 0;
+    if ((antialias || depthOfField) && adaptiveAA) {
+        state->adaptiveAA = GL_TRUE;
+        state->aaThreshold = aaThreshold;
+        state->aaMinSamples = aaMinSamples;
+    }
+    state->denoise = (antialias || depthOfField) && denoise;
+    state->width = window_width;
+    state->height = window_height;
+    state->camera = cameraGeneration;
+    state->scene = sceneGeneration;
+}
+
+// Find a cached frame for a render state, or -1
+int findCachedFrame(const RenderState* state) {
+    for (int i=0; i<FRAME_CACHE_SIZE; i++) {
+        if (frameCache[i].pixels != NULL && memcmp(&frameCache[i].key, state, sizeof(RenderState)) == 0) {
+            frameCache[i].lastUsed = ++frameClock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Copy the finished pixel array into the cache, replacing the least
+// recently used frame
+void storeCachedFrame(const RenderState* state) {
+    size_t size = sizeof(float) * window_width * window_height * 3;
+    int slot = 0;
+
+    for (int i=1; i<FRAME_CACHE_SIZE; i++) {
+        if (frameCache[i].lastUsed < frameCache[slot].lastUsed) {
+            slot = i;
+        }
+    }
+
+    CachedFrame* frame = &frameCache[slot];
+    if (frame->pixels == NULL || frame->key.width != window_width || frame->key.height != window_height) {
+        free(frame->pixels);
+        frame->pixels = malloc(size);
+        if (frame->pixels == NULL) {
+            return;
+        }
+    }
+    memcpy(frame->pixels, pixels, size);
+    frame->key = *state;
+    frame->lastUsed = ++frameClock;
+}
+
+// Move the workers' counters into frameStats once a traced frame has been
+// shown, and log them
+void finishFrameStats() {
+#ifdef RT_STATS
+    frameStats = totalRenderStats();
+    resetRenderStats();
+    statsFrame++;
+    if (statsJson != NULL) {
+        writeRenderStatsJSON(statsJson, &frameStats, statsFrame, window_width, window_height);
+    }
+#endif
+    frameTraced = GL_FALSE;
+}
+
+// Bring the pixel array up to date with the current settings: reuse it or
+// a cached frame if possible, otherwise trace (one more pass of) the frame.
+// Returns whether the frame is finished, i.e. whether another call would
+// do any work.
+GLboolean updateFrame() {
+    RenderState state;
+    currentRenderState(&state);
+
+    if (shownValid && memcmp(&state, &shownState, sizeof(RenderState)) == 0) {
+        if (shownComplete) {
+            return GL_TRUE;
+        }
+    } else {
+        int cached = findCachedFrame(&state);
+
+        shownState = state;
+        shownValid = GL_TRUE;
+        if (cached >= 0) {
+            memcpy(pixels, frameCache[cached].pixels, sizeof(float) * window_width * window_height * 3);
+            shownComplete = GL_TRUE;
+            return GL_TRUE;
+        }
+        resetAccumulation();
+    }
+
+    STAT_TIMER(timer);
+    renderFrame();
+    STAT_PHASE(PHASE_RENDER, timer);
+    frameTraced = GL_TRUE;
+
+    // Part of the frame is missing; start it over next time, and drop its
+    // counters rather than mix them into the next frame's
+    if (frameCancelled()) {
+        shownValid = GL_FALSE;
+        resetRenderStats();
+        frameTraced = GL_FALSE;
+        return GL_FALSE;
+    }
+
+    shownComplete = frameFinished();
+    if (adaptiveAA && (antialias || depthOfField)) {
+        printf("Adaptive antialiasing: %.2f samples per pixel (max %d)\n", adaptiveSamplesPerPixel, aaSamples * aaSamples);
+    }
+    if (shownComplete) {
+        storeCachedFrame(&state);
+    }
+    return shownComplete;
+}
+
+double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#ifndef NO_GLUT
+// The window renders on a thread of its own, so the GLUT thread never
+// waits on a frame: it only queues key presses for the render thread and
+// presents presentPixels, which tiles are converted into as they finish.
+// Rendering state belongs to the render thread from startPresentation on.
+
+#define KEY_QUEUE_SIZE 64
+
+pthread_mutex_t frameLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t frameWake = PTHREAD_COND_INITIALIZER;
+GLboolean framePending = GL_TRUE;           // Another pass would change the image
+unsigned char keyQueue[KEY_QUEUE_SIZE];
+int keyCount = 0;
+unsigned long renderedPasses = 0;           // Passes the render thread has finished
+unsigned long presentedPasses = 0;          // Passes the window has shown
+unsigned int resizeWidth = 0;               // New window size, or 0 if unchanged
+unsigned int resizeHeight = 0;
+unsigned int presentWidth, presentHeight;   // Size of presentPixels
+unsigned long presentNs = 0;                // Present time, kept apart from the render thread's counters
+
+GLboolean presentTimerArmed = GL_FALSE;
+GLuint presentBuffer = 0;                   // Pixel buffer object, or 0 if unsupported
+unsigned int viewWidth, viewHeight;         // Window size as the GLUT thread last saw it
+
+// Window size and resolution scaling, owned by the render thread. The
+// scale is kept in sixteenths so that small changes in frame time don't
+// reallocate the buffers every frame, and so cached frames get reused.
+#define MIN_RENDER_SCALE 0.25f
+unsigned int fullWidth, fullHeight;
+float budgetScale = 1;                      // Scale the budget allows
+
+// Keys that change the image cancel the frame in flight
+const char* cancellingKeys = "adrtlkpvsn";
+
+void toggle(GLboolean* toggle) {
+    *toggle = !(*toggle);
+}
+
+// Apply a key press on the render thread. Returns whether the image changed.
+GLboolean applyKey(unsigned char key) {
+    switch (key) {
+        case 'a':
+            toggle(&antialias);
+            break;
+        case 'd':
+            toggle(&depthOfField);
+            break;
+        case 'r':
+            toggle(&reflection);
+            break;
+        case 't':
+            toggle(&transparency);
+            break;
+        case 'l':
+            numLights += (numLights < lightCount) ? 1 : 0;
+            break;
+        case 'k':
+            numLights -= (numLights > 1) ? 1 : 0;
+            break;
+        case 'p':
+            toggle(&progressive);
+            break;
+        case 'v':
+            toggle(&adaptiveAA);
+            break;
+        case 'n':
+            toggle(&denoise);
+            break;
+        case 's':
+            samplerType = (SamplerType)((samplerType + 1) % 3);
+            printf("%s sampler\n", samplerNames[samplerType]);
+            break;
+        case 'w':
+            toggle(&wavefrontRendering);
+            printf("%s renderer\n", wavefrontRendering ? "Wavefront" : "Recursive");
+            return GL_FALSE;
+        case 'i':
+#ifdef RT_STATS
+            printf("Frame %lu\n", statsFrame);
+            printRenderStats(stdout, &frameStats);
+#else
+            printf("Render statistics are not compiled in; build with make STATS=1\n");
+#endif
+            return GL_FALSE;
+        default:
+            return GL_FALSE;
+    }
+    return GL_TRUE;
+}
+
+// Trace at a fraction of the window size, reallocating every buffer that
+// depends on it
+void setRenderScale(float scale) {
+    unsigned int width = (unsigned int)(fullWidth * scale + 0.5f);
+    unsigned int height = (unsigned int)(fullHeight * scale + 0.5f);
+
+    width = (width > 0) ? width : 1;
+    height = (height > 0) ? height : 1;
+    if (width == window_width && height == window_height) {
+        return;
+    }
+    window_width = width;
+    window_height = height;
+    setImagePlane();
+    allocatePixels();
+
+    pthread_mutex_lock(&frameLock);
+    free(presentPixels);
+    presentPixels = calloc((size_t)width * height, 4);
+    if (presentPixels == NULL) {
+        fprintf(stderr, "Unable to allocate a %ux%u presentation buffer\n", width, height);
+        exit(EXIT_FAILURE);
+    }
+    presentWidth = width;
+    presentHeight = height;
+    pthread_mutex_unlock(&frameLock);
+}
+
+// Fit the scale to the last pass: its cost is about proportional to the
+// number of pixels, i.e. to the square of the scale. Half of the correction
+// is applied each time so one odd frame doesn't swing the resolution.
+void updateBudgetScale(double ms) {
+    float scale = (float)window_width / fullWidth;
+    float target = scale * sqrtf(frameBudget / fmax(ms, 0.1));
+
+    budgetScale = 0.5f * (budgetScale + target);
+    budgetScale = (budgetScale < MIN_RENDER_SCALE) ? MIN_RENDER_SCALE : (budgetScale > 1) ? 1 : budgetScale;
+}
+
+void* renderThreadMain(void* arg) {
+    unsigned char keys[KEY_QUEUE_SIZE];
+    GLboolean interactive = GL_FALSE;
+
+    pthread_mutex_lock(&frameLock);
+    for (;;) {
+        while (!framePending && keyCount == 0 && resizeWidth == 0) {
+            pthread_cond_wait(&frameWake, &frameLock);
+        }
+        int count = keyCount;
+        memcpy(keys, keyQueue, count);
+        keyCount = 0;
+        if (resizeWidth != 0) {
+            fullWidth = resizeWidth;
+            fullHeight = resizeHeight;
+            resizeWidth = 0;
+            interactive = GL_TRUE;
+        }
+        __atomic_store_n(&cancelRequested, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&frameLock);
+
+        for (int k=0; k<count; k++) {
+            if (applyKey(keys[k])) {
+                resetAccumulation();
+                interactive = GL_TRUE;
+            }
+        }
+
+        // Trace what the budget allows while the image is changing
+        if (frameBudget > 0 && interactive) {
+            setRenderScale(floorf(budgetScale * 16) / 16);
+        } else {
+            setRenderScale(1);
+        }
+
+        double start = monotonicSeconds();
+        GLboolean complete = updateFrame();
+        if (!frameCancelled()) {
+            if (frameBudget > 0 && frameTraced) {
+                updateBudgetScale((monotonicSeconds() - start) * 1000);
+            }
+
+            // The reduced pass is on screen and nothing has changed since,
+            // so the view is still: go on at full resolution
+            if (interactive && window_width != fullWidth) {
+                complete = GL_FALSE;
+            }
+            interactive = GL_FALSE;
+
+            if (frameTraced) {
+                pthread_mutex_lock(&frameLock);
+                renderStats[0].phaseNs[PHASE_PRESENT] += presentNs;
+                presentNs = 0;
+                pthread_mutex_unlock(&frameLock);
+                finishFrameStats();
+            } else {
+                // Reused or cached frame, which has not been converted yet
+                presentFrame();
+            }
+        }
+
+        pthread_mutex_lock(&frameLock);
+        framePending = !complete;
+        renderedPasses++;
+    }
+    return NULL;
+}
+
+// Whether the window has anything new to show soon
+GLboolean presentationBusy() {
+    pthread_mutex_lock(&frameLock);
+    GLboolean busy = framePending || keyCount > 0 || resizeWidth != 0 || presentedPasses != renderedPasses;
+    pthread_mutex_unlock(&frameLock);
+    return busy;
+}
+
+// Redraw about 60 times a second while the render thread is working, so
+// tiles show up as they finish; stop once the last pass has been shown
+void presentTimer(int value) {
+    glutPostRedisplay();
+    presentTimerArmed = presentationBusy();
+    if (presentTimerArmed) {
+        glutTimerFunc(16, presentTimer, 0);
+    }
+}
+
+void armPresentTimer() {
+    if (!presentTimerArmed) {
+        presentTimerArmed = GL_TRUE;
+        glutTimerFunc(16, presentTimer, 0);
+    }
+}
+
+// Display method generates the image
+void display(void) {
+    // Reset drawing window
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Draw the latest pixels, which may be part way through a pass, scaled
+    // up to the window if they were traced at a lower resolution. With a
+    // pixel buffer object the driver copies them to the GPU asynchronously;
+    // orphaning the old storage keeps it from waiting on the last upload.
+    // The lock keeps the render thread from reallocating them meanwhile.
+    STAT_TIMER(timer);
+    pthread_mutex_lock(&frameLock);
+    presentedPasses = renderedPasses;
+    size_t size = (size_t)presentWidth * presentHeight * 4;
+    glWindowPos2i(0, 0);
+    glPixelZoom((float)viewWidth / presentWidth, (float)viewHeight / presentHeight);
+    if (presentBuffer != 0) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, presentBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        void* mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if (mapped != NULL) {
+            memcpy(mapped, presentPixels, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glDrawPixels(presentWidth, presentHeight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    } else {
+        glDrawPixels(presentWidth, presentHeight, GL_RGBA, GL_UNSIGNED_BYTE, presentPixels);
+    }
+    pthread_mutex_unlock(&frameLock);
+
+    // Reset buffer for next frame
+    glutSwapBuffers();
+#ifdef RT_STATS
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&frameLock);
+    presentNs += (now.tv_sec - timer.tv_sec) * 1000000000L + (now.tv_nsec - timer.tv_nsec);
+    pthread_mutex_unlock(&frameLock);
+#endif
+}
+
+// Render at the new window size from the next pass on
+void reshape(int width, int height) {
+    glViewport(0, 0, width, height);
+    if (width <= 0 || height <= 0 || ((unsigned int)width == viewWidth && (unsigned int)height == viewHeight)) {
+        return;
+    }
+    viewWidth = width;
+    viewHeight = height;
+
+    pthread_mutex_lock(&frameLock);
+    resizeWidth = width;
+    resizeHeight = height;
+    __atomic_store_n(&cancelRequested, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&frameWake);
+    pthread_mutex_unlock(&frameLock);
+
+    armPresentTimer();
+}
+
+void keyboard(unsigned char key, int x, int y) {
+    if (key == 'h') {
+        printf("HELP\n");
+        printf("----\n");
+        printf("a - toggle antialiasing\n");
+        printf("d - toggle depth of field\n");
+        printf("r - toggle reflections\n");
+        printf("t - toggle transparency\n");
+        printf("l - increase number of lights (max: number in the scene)\n");
+        printf("k - decrease number of lights (min: 1)\n");
+        printf("p - toggle progressive antialiasing\n");
+        printf("w - toggle wavefront rendering\n");
+        printf("v - toggle adaptive antialiasing\n");
+        printf("n - toggle denoising of antialiased frames\n");
+        printf("s - cycle the sampler (random, halton, sobol)\n");
+        printf("i - print the counters of the last traced frame\n");
+        return;
+    }
+
+    pthread_mutex_lock(&frameLock);
+    if (keyCount < KEY_QUEUE_SIZE) {
+        keyQueue[keyCount++] = key;
+    }
+    if (key != '\0' && strchr(cancellingKeys, key) != NULL) {
+        __atomic_store_n(&cancelRequested, 1, __ATOMIC_RELAXED);
+    }
+    pthread_cond_signal(&frameWake);
+    pthread_mutex_unlock(&frameLock);
+
+    armPresentTimer();
+}
+
+// Set up the presentation buffers and start rendering in the background.
+// Needs the window to exist.
+int startPresentation() {
+    pthread_t thread;
+
+    presentPixels = calloc((size_t)window_width * window_height, 4);
+    if (presentPixels == NULL) {
+        fprintf(stderr, "Unable to allocate a %ux%u presentation buffer\n", window_width, window_height);
+        return -1;
+    }
+    presentWidth = viewWidth = fullWidth = window_width;
+    presentHeight = viewHeight = fullHeight = window_height;
+    if (glutExtensionSupported("GL_ARB_pixel_buffer_object")) {
+        glGenBuffers(1, &presentBuffer);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    if (pthread_create(&thread, NULL, renderThreadMain, NULL) != 0) {
+        fprintf(stderr, "Unable to start the render thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    armPresentTimer();
+    return 0;
+}
+
+#endif
+
+void usage(const char* name) {
+    printf("Usage: %s [options]\n", name);
+    printf("  -j, --threads N     number of render threads\n");
+    printf("  -o, --output FILE   render one frame headless and write it to FILE (- for stdout)\n");
+    printf("      --headless      render without opening a window\n");
+    printf("      --format F      image format: ppm, pfm or png; y4m or rgb video with --animate (default: from file name)\n");
+    printf("      --width N       image width in pixels\n");
+    printf("      --height N      image height in pixels\n");
+    printf("      --samples N     antialiasing samples per axis (N*N per pixel)\n");
+    printf("      --depth N       maximum reflection/refraction depth\n");
+    printf("      --roulette T    weight below which reflection/refraction rays play Russian roulette, 0 for none (default 0.004)\n");
+    printf("      --lights N      number of lights (1-3)\n");
+    printf("      --antialias     enable antialiasing\n");
+    printf("      --sampler S     sample pattern: random, halton or sobol (default: sobol)\n");
+    printf("      --seed N        seed for the sample pattern (default: 0)\n");
+    printf("      --adaptive      sample adaptively, taking up to samples*samples where needed\n");
+    printf("      --aa-min N      samples every pixel gets with --adaptive (default 4)\n");
+    printf("      --aa-threshold T  luminance noise/contrast (0-1) that triggers more samples (default 0.03)\n");
+    printf("      --frame-budget MS  lower the window's resolution while the image changes to trace a pass in MS ms\n");
+    printf("      --dof           enable depth of field\n");
+    printf("      --denoise       filter antialiased and depth of field frames with the edge-avoiding denoiser\n");
+    printf("      --reflection    enable reflections\n");
+    printf("      --transparency  enable transparency/refraction\n");
+    printf("      --scene FILE    load a text or binary scene instead of the built-in one\n");
+    printf("      --convert IN OUT  convert a scene; OUT ending in .rtb is compiled to binary, .rtm converts a mesh\n");
+    printf("      --leaf-size N   maximum number of spheres in a BVH leaf\n");
+    printf("      --bvh-stats     print BVH build (and with STATS=1, traversal) statistics and mesh memory use\n");
+    printf("      --shadow-stats  print shadow ray and occluder cache counters (needs STATS=1)\n");
+    printf("      --stats         print every counter of the frame (needs STATS=1)\n");
+    printf("      --stats-json FILE  write the counters of each frame to FILE as JSON lines (needs STATS=1)\n");
+    printf("      --wavefront     render with the wavefront pipeline instead of recursive rays\n");
+    printf("      --no-packets    trace primary and shadow rays one at a time\n");
+    printf("      --no-shadow-grid  trace shadow rays through the BVH instead of the per-light occluder grids\n");
+    printf("      --no-gbuffer    retrace the primary rays of every window frame instead of keeping their hits\n");
+    printf("      --animate PATH  render the frames of a camera path file as a video stream\n");
+    printf("      --fps N         frame rate written to Y4M streams (default 24)\n");
+    printf("      --serve ADDR    run as a render worker listening on ADDR (HOST:PORT or unix:PATH)\n");
+    printf("      --workers LIST  render on the comma-separated worker addresses in LIST\n");
+    printf("      --simd K        intersection kernel: scalar, sse or avx2 (default: best supported)\n");
+}
+
+// Parse a positive integer argument, exiting with an error otherwise
+int parseCount(const char* option, const char* value, int min, int max) {
+    char* end;
+    long result = (value != NULL) ? strtol(value, &end, 10) : 0;
+    if (value == NULL || *end != '\0' || result < min || result > max) {
+        fprintf(stderr, "%s expects a number between %d and %d\n", option, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return (int)result;
+}
+
+// Parse a floating point argument, exiting with an error otherwise
+float parseFloat(const char* option, const char* value, float min, float max) {
+    char* end;
+    float result = (value != NULL) ? strtof(value, &end) : 0;
+    if (value == NULL || *end != '\0' || !(result >= min && result <= max)) {
+        fprintf(stderr, "%s expects a number between %g and %g\n", option, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+// Distributed rendering. A worker process (--serve ADDRESS) loads the same
+// scene as the coordinator and renders the tiles it is sent with its own
+// thread pool. The coordinator (--workers A,B,...) hands out tiles in
+// batches of one per worker thread, keeping a second batch queued so the
+// workers never wait on the network, and copies finished tiles into the
+// framebuffer. Tiles held by a worker that disconnects go back to the
+// queue. Once the queue is empty, idle workers also take copies of tiles
+// that have been out much longer than usual, so one slow worker can't hold
+// up the frame. If every worker is lost the coordinator finishes the frame
+// itself. Samples only depend on the pixel and the seed, so the image is
+// identical to a local render.
+
+#define MSG_SETUP 1     // coordinator: NetSettings
+#define MSG_READY 2     // worker: NetReady
+#define MSG_TILES 3     // coordinator: indices of tiles to render
+#define MSG_TILE 4      // worker: a tile index followed by the tile's pixels
+#define MSG_DONE 5      // coordinator: the frame is finished
+
+#define MAX_REMOTE_WORKERS 64
+#define NET_TIMEOUT 30
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width, height;
+    uint32_t antialias, depthOfField, reflection, transparency;
+    uint32_t lights, samples, maxDepth, aaMaxDepth;
+    uint32_t sampler, seed, wavefront, packets, shadowGrids;
+    float roulette;
+    uint32_t sceneHash;
+} NetSettings;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t threads;
+    uint32_t sceneHash;
+} NetReady;
+
+typedef struct {
+    const char* address;
+    int fd;
+    int threads;
+    int held;           // Number of tiles sent and not yet returned
+    int* heldTiles;
+    int rendered;
+} RemoteWorker;
+
+const char* remoteAddresses[MAX_REMOTE_WORKERS];
+int remoteCount = 0;
+
+// Tile index plus the largest tile's pixels
+char tileMessage[sizeof(uint32_t) + sizeof(float) * TILE_SIZE * TILE_SIZE * 3];
+
+uint32_t hashBytes(uint32_t hash, const void* data, size_t size) {
+    const unsigned char* p = data;
+    for (size_t i=0; i<size; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t hashMaterial(uint32_t hash, const Material* m) {
+    hash = hashBytes(hash, &m->color, sizeof(m->color));
+    hash = hashBytes(hash, &m->ri, sizeof(m->ri));
+    return hashBytes(hash, &m->reflective, sizeof(m->reflective));
+}
+
+// Spheres, meshes and instances of the scene or of a prototype
+uint32_t hashGeometry(uint32_t hash, const SphereStore* store, const Mesh* meshList, int meshTotal,
+                      const Instance* instanceList, int instanceTotal) {
+    size_t floats = sizeof(float) * store->count;
+
+    hash = hashBytes(hash, store->cx, floats);
+    hash = hashBytes(hash, store->cy, floats);
+    hash = hashBytes(hash, store->cz, floats);
+    hash = hashBytes(hash, store->r2, floats);
+    for (int i=0; i<store->count; i++) {
+        hash = hashMaterial(hash, &store->materials[i]);
+    }
+    for (int i=0; i<meshTotal; i++) {
+        const Mesh* mesh = &meshList[i];
+        hash = hashBytes(hash, mesh->vertices, sizeof(float) * 3 * mesh->vertexCount);
+        hash = hashBytes(hash, mesh->indices, sizeof(uint32_t) * 3 * mesh->triangleCount);
+        hash = hashMaterial(hash, &mesh->material);
+    }
+    for (int i=0; i<instanceTotal; i++) {
+        const Instance* instance = &instanceList[i];
+        hash = hashBytes(hash, instance->m, sizeof(instance->m));
+        hash = hashBytes(hash, &instance->prototype, sizeof(instance->prototype));
+        hash = hashBytes(hash, &instance->hasMaterial, sizeof(instance->hasMaterial));
+        if (instance->hasMaterial) {
+            hash = hashMaterial(hash, &instance->material);
+        }
+    }
+    return hash;
+}
+
+// FNV-1a hash of everything that decides what the scene looks like, so a
+// worker that loaded a different scene is caught
+uint32_t sceneHash() {
+    uint32_t hash = 2166136261u;
+
+    hash = hashGeometry(hash, &spheres, meshes, meshCount, instances, instanceCount);
+    for (int i=0; i<prototypeCount; i++) {
+        const Prototype* p = &prototypes[i];
+        hash = hashGeometry(hash, &p->spheres, p->meshes, p->meshCount, p->instances, p->instanceCount);
+    }
+    hash = hashBytes(hash, &e, sizeof(e));
+    hash = hashBytes(hash, &w, sizeof(w));
+    hash = hashBytes(hash, &u, sizeof(u));
+    hash = hashBytes(hash, &v, sizeof(v));
+    hash = hashBytes(hash, light, sizeof(Vector) * lightCount);
+    hash = hashBytes(hash, &lightI, sizeof(lightI));
+    return hashBytes(hash, &bgColor, sizeof(bgColor));
+}
+
+void currentNetSettings(NetSettings* s) {
+    s->magic = NET_MAGIC;
+    s->width = window_width;
+    s->height = window_height;
+    s->antialias = antialias;
+    s->depthOfField = depthOfField;
+    s->reflection = reflection;
+    s->transparency = transparency;
+    s->lights = numLights;
+    s->samples = aaSamples;
+    s->maxDepth = maxDepth;
+    s->aaMaxDepth = aaMaxDepth;
+    s->sampler = samplerType;
+    s->seed = frameSeed;
+    s->wavefront = wavefrontRendering;
+    s->packets = packetTracing;
+    s->shadowGrids = shadowGridsOn;
+    s->roulette = rouletteThreshold;
+    s->sceneHash = sceneHash();
+}
+
+// Take over the coordinator's settings. Returns -1 if they can't apply to
+// this worker's scene.
+int applyNetSettings(const NetSettings* s) {
+    if (s->width < 1 || s->width > 65536 || s->height < 1 || s->height > 65536 || s->lights > (uint32_t)lightCount ||
+        s->samples < 1 || s->samples > 64 || s->maxDepth > 64 || s->aaMaxDepth > 64 || s->sampler > SAMPLER_SOBOL ||
+        !(s->roulette >= 0 && s->roulette <= 1)) {
+        return -1;
+    }
+    if (s->width != window_width || s->height != window_height) {
+        window_width = s->width;
+        window_height = s->height;
+        setImagePlane();
+        allocatePixels();
+    }
+    antialias = s->antialias != 0;
+    depthOfField = s->depthOfField != 0;
+    reflection = s->reflection != 0;
+    transparency = s->transparency != 0;
+    numLights = s->lights;
+    aaSamples = s->samples;
+    maxDepth = s->maxDepth;
+    aaMaxDepth = s->aaMaxDepth;
+    samplerType = (SamplerType)s->sampler;
+    frameSeed = s->seed;
+    wavefrontRendering = s->wavefront != 0;
+    packetTracing = s->packets != 0;
+    // The grids decide a few grazing shadow rays differently from the BVH,
+    // so workers follow the coordinator, building them if they had none
+    if (s->shadowGrids && !shadowGridsOn) {
+        shadowGridsOn = GL_TRUE;
+        parallelFor(lightCount, buildShadowGridTask, NULL);
+    }
+    shadowGridsOn = s->shadowGrids != 0;
+    rouletteThreshold = s->roulette;
+    progressive = adaptiveAA = GL_FALSE;
+    selectShadingKernel();
+    prepareGBuffer();
+    return 0;
+}
+
+// Render one of a list of tiles
+void renderListedTile(void* context, int job, int worker) {
+    const uint32_t* tiles = context;
+    renderTile(NULL, tiles[job], worker);
+}
+
+// Size of the MSG_TILE payload for a tile
+uint32_t tileMessageSize(int tile) {
+    int x0, y0, x1, y1;
+    tileBounds(tile, &x0, &y0, &x1, &y1);
+    return sizeof(uint32_t) + sizeof(float) * (x1-x0) * (y1-y0) * 3;
+}
+
+// Send a rendered tile back to the coordinator
+int sendTile(int fd, uint32_t tile) {
+    float* out = (float*)(tileMessage + sizeof(uint32_t));
+    int x0, y0, x1, y1;
+
+    tileBounds(tile, &x0, &y0, &x1, &y1);
+    memcpy(tileMessage, &tile, sizeof(uint32_t));
+    for (int j=y0; j<y1; j++) {
+        memcpy(out, &pixels[(j*window_width + x0) * 3], sizeof(float) * (x1-x0) * 3);
+        out += (x1-x0) * 3;
+    }
+    return sendMessage(fd, MSG_TILE, tileMessage, tileMessageSize(tile));
+}
+
+// Copy a tile received from a worker into the framebuffer
+void receiveTile(uint32_t tile) {
+    const float* in = (const float*)(tileMessage + sizeof(uint32_t));
+    int x0, y0, x1, y1;
+
+    tileBounds(tile, &x0, &y0, &x1, &y1);
+    for (int j=y0; j<y1; j++) {
+        memcpy(&pixels[(j*window_width + x0) * 3], in, sizeof(float) * (x1-x0) * 3);
+        in += (x1-x0) * 3;
+    }
+}
+
+// Render tiles for one coordinator until it finishes or goes away
+void serveCoordinator(int fd) {
+    NetSettings settings;
+    uint32_t tiles[MAX_THREADS * 2];
+    uint32_t type;
+
+    setNetTimeout(fd, NET_TIMEOUT);
+    if (recvMessage(fd, &type, &settings, sizeof(settings)) != sizeof(settings) || type != MSG_SETUP ||
+        settings.magic != NET_MAGIC || applyNetSettings(&settings) != 0) {
+        fprintf(stderr, "Dropping a coordinator with invalid settings\n");
+        return;
+    }
+
+    NetReady ready = {NET_MAGIC, numWorkers, sceneHash()};
+    if (sendMessage(fd, MSG_READY, &ready, sizeof(ready)) != 0 || ready.sceneHash != settings.sceneHash) {
+        return;
+    }
+
+    // Between frames the coordinator may take any time to send more work
+    setNetTimeout(fd, 0);
+    for (;;) {
+        int size = recvMessage(fd, &type, tiles, sizeof(tiles));
+        int count = size / (int)sizeof(uint32_t);
+        int tileCount = ((window_width + TILE_SIZE - 1) / TILE_SIZE) * ((window_height + TILE_SIZE - 1) / TILE_SIZE);
+
+        if (size < 0 || type != MSG_TILES) {
+            return;
+        }
+        for (int k=0; k<count; k++) {
+            if (tiles[k] >= (uint32_t)tileCount) {
+                fprintf(stderr, "Dropping a coordinator that asked for tile %u of %d\n", tiles[k], tileCount);
+                return;
+            }
+        }
+
+        parallelFor(count, renderListedTile, tiles);
+        for (int k=0; k<count; k++) {
+            if (sendTile(fd, tiles[k]) != 0) {
+                return;
+            }
+        }
+    }
+}
+
+// Worker process: serve one coordinator at a time, forever
+int serveTiles(const char* address) {
+    int listener = netListen(address);
+
+    if (listener < 0) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Serving tiles on %s with %d threads\n", address, numWorkers);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Unable to accept on %s: %s\n", address, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        serveCoordinator(fd);
+        close(fd);
+    }
+}
+
+// Connect to a worker and agree on the frame's settings
+int connectRemote(RemoteWorker* rw, const NetSettings* settings) {
+    NetReady ready;
+    uint32_t type;
+
+    rw->fd = netConnect(rw->address);
+    if (rw->fd < 0) {
+        return -1;
+    }
+    setNetTimeout(rw->fd, NET_TIMEOUT);
+    if (sendMessage(rw->fd, MSG_SETUP, settings, sizeof(*settings)) != 0 ||
+        recvMessage(rw->fd, &type, &ready, sizeof(ready)) != sizeof(ready) || type != MSG_READY || ready.magic != NET_MAGIC) {
+        fprintf(stderr, "Worker %s did not accept the frame settings\n", rw->address);
+    } else if (ready.sceneHash != settings->sceneHash) {
+        fprintf(stderr, "Worker %s has loaded a different scene\n", rw->address);
+    } else {
+        rw->threads = (ready.threads >= 1 && ready.threads <= MAX_THREADS) ? ready.threads : 1;
+        rw->held = 0;
+        rw->heldTiles = malloc(sizeof(int) * rw->threads * 2);
+        rw->rendered = 0;
+        return 0;
+    }
+    close(rw->fd);
+    rw->fd = -1;
+    return -1;
+}
+
+// Frame-wide tile bookkeeping for the coordinator
+typedef struct {
+    unsigned char* done;
+    unsigned char* copies;  // Workers currently holding the tile
+    double* sent;           // When the first copy was handed out
+    int count;
+    int finished;
+    int next;               // No tile before this one is waiting
+    double tileTime;        // Mean time from handing out a tile to getting it back
+    int timed;
+} TileQueue;
+
+// Next tile for a worker: a waiting one if there is any, else a copy of
+// the tile that has been out longest, if that is far longer than usual
+int nextRemoteTile(TileQueue* q, const RemoteWorker* rw, double now) {
+    int oldest = -1;
+
+    for (; q->next < q->count; q->next++) {
+        if (!q->done[q->next] && q->copies[q->next] == 0) {
+            return q->next++;
+        }
+    }
+    if (q->timed == 0) {
+        return -1;
+    }
+
+    for (int k=0; k<q->count; k++) {
+        if (!q->done[k] && q->copies[k] == 1 && now - q->sent[k] > 3 * q->tileTime + 0.05 &&
+            (oldest < 0 || q->sent[k] < q->sent[oldest])) {
+            int mine = 0;
+            for (int h=0; h<rw->held; h++) {
+                mine |= (rw->heldTiles[h] == k);
+            }
+            oldest = mine ? oldest : k;
+        }
+    }
+    return oldest;
+}
+
+// Hand a worker the next batch once it is down to one batch in flight
+int sendRemoteBatch(TileQueue* q, RemoteWorker* rw, double now) {
+    uint32_t batch[MAX_THREADS];
+    int count = 0;
+
+    if (rw->held > rw->threads) {
+        return 0;
+    }
+    while (count < rw->threads) {
+        int tile = nextRemoteTile(q, rw, now);
+        if (tile < 0) {
+            break;
+        }
+        if (q->copies[tile]++ == 0) {
+            q->sent[tile] = now;
+        }
+        rw->heldTiles[rw->held++] = tile;
+        batch[count++] = tile;
+    }
+    return (count > 0) ? sendMessage(rw->fd, MSG_TILES, batch, sizeof(uint32_t) * count) : 0;
+}
+
+// Give up on a worker and put the tiles only it held back in the queue
+void dropRemote(TileQueue* q, RemoteWorker* rw) {
+    int requeued = 0;
+
+    for (int h=0; h<rw->held; h++) {
+        int tile = rw->heldTiles[h];
+        if (--q->copies[tile] == 0 && !q->done[tile]) {
+            q->next = (tile < q->next) ? tile : q->next;
+            requeued++;
+        }
+    }
+    fprintf(stderr, "Lost worker %s, %d tiles requeued\n", rw->address, requeued);
+    close(rw->fd);
+    rw->fd = -1;
+    rw->held = 0;
+}
+
+// Read one finished tile from a worker
+int receiveRemoteTile(TileQueue* q, RemoteWorker* rw, double now) {
+    uint32_t type, tile;
+    int size = recvMessage(rw->fd, &type, tileMessage, sizeof(tileMessage));
+
+    if (size < (int)sizeof(uint32_t) || type != MSG_TILE) {
+        return -1;
+    }
+    memcpy(&tile, tileMessage, sizeof(uint32_t));
+    if (tile >= (uint32_t)q->count || (uint32_t)size != tileMessageSize(tile)) {
+        return -1;
+    }
+
+    for (int h=0; h<rw->held; h++) {
+        if (rw->heldTiles[h] == (int)tile) {
+            rw->heldTiles[h] = rw->heldTiles[--rw->held];
+            q->copies[tile]--;
+            break;
+        }
+    }
+    if (!q->done[tile]) {
+        receiveTile(tile);
+        q->done[tile] = 1;
+        q->finished++;
+        q->tileTime = (q->tileTime * q->timed + (now - q->sent[tile])) / (q->timed + 1);
+        q->timed++;
+        rw->rendered++;
+    }
+    return 0;
+}
+
+// Render the frame on the workers given with --workers, finishing locally
+// whatever they can't
+void renderDistributed() {
+    RemoteWorker remote[MAX_REMOTE_WORKERS];
+    struct pollfd fds[MAX_REMOTE_WORKERS];
+    NetSettings settings;
+    TileQueue q;
+    int alive = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    selectShadingKernel();
+    prepareGBuffer();
+    currentNetSettings(&settings);
+    for (int i=0; i<remoteCount; i++) {
+        remote[i].address = remoteAddresses[i];
+        remote[i].heldTiles = NULL;
+        alive += (connectRemote(&remote[i], &settings) == 0);
+    }
+
+    q.count = ((window_width + TILE_SIZE - 1) / TILE_SIZE) * ((window_height + TILE_SIZE - 1) / TILE_SIZE);
+    q.done = calloc(q.count, 1);
+    q.copies = calloc(q.count, 1);
+    q.sent = calloc(q.count, sizeof(double));
+    q.finished = q.next = q.timed = 0;
+    q.tileTime = 0;
+
+    while (q.finished < q.count && alive > 0) {
+        double now = monotonicSeconds();
+        int polled = 0;
+
+        for (int i=0; i<remoteCount; i++) {
+            if (remote[i].fd >= 0 && sendRemoteBatch(&q, &remote[i], now) != 0) {
+                dropRemote(&q, &remote[i]);
+                alive--;
+            }
+            if (remote[i].fd >= 0) {
+                fds[polled].fd = remote[i].fd;
+                fds[polled].events = POLLIN;
+                polled++;
+            }
+        }
+        if (polled == 0 || poll(fds, polled, 50) <= 0) {
+            continue;
+        }
+
+        now = monotonicSeconds();
+        polled = 0;
+        for (int i=0; i<remoteCount; i++) {
+            if (remote[i].fd < 0) {
+                continue;
+            }
+            if ((fds[polled++].revents & (POLLIN | POLLHUP | POLLERR)) && receiveRemoteTile(&q, &remote[i], now) != 0) {
+                dropRemote(&q, &remote[i]);
+                alive--;
+            }
+        }
+    }
+
+    if (q.finished < q.count) {
+        uint32_t* left = malloc(sizeof(uint32_t) * q.count);
+        int count = 0;
+
+        for (int k=0; k<q.count; k++) {
+            if (!q.done[k]) {
+                left[count++] = k;
+            }
+        }
+        fprintf(stderr, "No workers left, rendering the remaining %d of %d tiles locally\n", count, q.count);
+        parallelFor(count, renderListedTile, left);
+        free(left);
+    }
+
+    for (int i=0; i<remoteCount; i++) {
+        if (remote[i].fd >= 0) {
+            sendMessage(remote[i].fd, MSG_DONE, NULL, 0);
+            close(remote[i].fd);
+            fprintf(stderr, "Worker %s rendered %d tiles\n", remote[i].address, remote[i].rendered);
+        }
+        free(remote[i].heldTiles);
+    }
+    free(q.done);
+    free(q.copies);
+    free(q.sent);
+
+    // The features are traced here, as the workers' hits stay with them
+    if (denoise && (antialias || depthOfField)) {
+        denoiseFrame();
+    }
+}
+
+// Render a frame locally or on the --workers
+void renderHeadlessFrame() {
+    STAT_TIMER(timer);
+    if (remoteCount > 0) {
+        renderDistributed();
+    } else {
+        renderFrame();
+    }
+    STAT_PHASE(PHASE_RENDER, timer);
+    finishFrameStats();
+}
+
+// Render a single frame without a window and write it out
+int renderHeadless(const char* output, ImageFormat format) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    renderHeadlessFrame();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fprintf(stderr, "Rendered %ux%u in %.3f s on %d threads (%s kernel)\n", window_width, window_height,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, numWorkers, sphereKernelName);
+
+    if (showBVHStats) {
+        printSceneStats(stderr);
+    }
+    if (showStats) {
+        printRenderStats(stderr, &frameStats);
+    } else if (showShadowStats) {
+        fprintf(stderr, "Shadow rays: %lu, occluder cache hits %lu (%.1f%%)\n", frameStats.shadowRays, frameStats.shadowCacheHits,
+                frameStats.shadowRays > 0 ? 100.0 * frameStats.shadowCacheHits / frameStats.shadowRays : 0.0);
+    }
+    if (adaptiveAA && (antialias || depthOfField)) {
+        fprintf(stderr, "Adaptive antialiasing: %.2f samples per pixel (max %d)\n", adaptiveSamplesPerPixel, aaSamples * aaSamples);
+    }
+
+    return writeImage(output, format, pixels, window_width, window_height) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void applyPathToggle(const PathToggle* toggle) {
+    switch (toggle->type) {
+        case TOGGLE_ANTIALIAS:
+            antialias = toggle->value;
+            break;
+        case TOGGLE_DOF:
+            depthOfField = toggle->value;
+            break;
+        case TOGGLE_REFLECTION:
+            reflection = toggle->value;
+            break;
+        case TOGGLE_TRANSPARENCY:
+            transparency = toggle->value;
+            break;
+        case TOGGLE_LIGHTS:
+            numLights = (toggle->value < lightCount) ? toggle->value : lightCount;
+            break;
+        default:
+            aaSamples = toggle->value;
+            break;
+    }
+}
+
+// Render every frame of a camera path and stream them to output. The
+// writer thread converts and writes each frame while the next renders.
+int renderAnimation(const char* pathFile, const char* output, VideoFormat format, int fps) {
+    CameraPath path;
+    FrameQueue queue;
+    struct timespec start, end;
+    FILE* out;
+    Vector up = v;
+
+    if (loadCameraPath(pathFile, &path) != 0) {
+        return EXIT_FAILURE;
+    }
+    out = (strcmp(output, "-") == 0) ? stdout : fopen(output, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", output);
+        free(path.keys);
+        free(path.toggles);
+        return EXIT_FAILURE;
+    }
+    if ((format == VIDEO_Y4M && writeY4MHeader(out, window_width, window_height, fps) != 0) ||
+        startFrameQueue(&queue, out, format, window_width, window_height) != 0) {
+        if (out != stdout) {
+            fclose(out);
+        }
+        free(path.keys);
+        free(path.toggles);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int f=0; f<path.frames; f++) {
+        Vector eye, view;
+
+        for (int k=0; k<path.toggleCount; k++) {
+            if (path.toggles[k].frame == f) {
+                applyPathToggle(&path.toggles[k]);
+            }
+        }
+        cameraAt(&path, f, &eye, &view, &d);
+        setCamera(eye, view, up);
+
+        renderHeadlessFrame();
+        queueFrame(&queue, pixels);
+    }
+    int result = finishFrameQueue(&queue);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Rendered %d frames of %ux%u in %.3f s (%.2f frames/s), waited %.3f s for the writer\n", path.frames,
+            window_width, window_height, seconds, path.frames / seconds, queue.stallSeconds);
+    if (out != stdout) {
+        result |= fclose(out);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error writing %s\n", output);
+    }
+    free(path.keys);
+    free(path.toggles);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The benchmark harness includes this file and brings its own main
+#ifndef NO_MAIN
+int main(int argc, char** argv) {
+    GLboolean headless = GL_FALSE;
+    GLboolean useGBuffer = GL_TRUE;
+    const char* output = NULL;
+    const char* kernel = NULL;
+    const char* convertInput = NULL;
+    const char* convertOutput = NULL;
+    const char* serveAddress = NULL;
+    const char* animationPath = NULL;
+    int format = -1;
+    int videoFormat = -1;
+    int fps = 24;
+
+#ifdef NO_GLUT
+    headless = GL_TRUE;
+#else
+    // GLUT strips its own options from argv, but must not be started at all
+    // when there is no display to connect to
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0 || strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0 ||
+            strcmp(argv[i], "--convert") == 0 || strcmp(argv[i], "--serve") == 0 ||
+            strcmp(argv[i], "--workers") == 0 || strcmp(argv[i], "--animate") == 0) {
+            headless = GL_TRUE;
+        }
+    }
+    if (!headless) {
+        glutInit(&argc, argv);
+    }
+#endif
+
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        const char* value = (i+1 < argc) ? argv[i+1] : NULL;
+
+        if (strcmp(arg, "-j") == 0 || strcmp(arg, "--threads") == 0) {
+            numThreads = parseCount(arg, value, 1, MAX_THREADS);
+            i++;
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            if (value == NULL) {
+                fprintf(stderr, "%s expects a file name\n", arg);
+                return EXIT_FAILURE;
+            }
+            output = value;
+            i++;
+        } else if (strcmp(arg, "--headless") == 0) {
+            headless = GL_TRUE;
+        } else if (strcmp(arg, "--format") == 0) {
+            if (value != NULL && strcmp(value, "ppm") == 0) {
+                format = IMAGE_PPM;
+            } else if (value != NULL && strcmp(value, "pfm") == 0) {
+                format = IMAGE_PFM;
+            } else if (value != NULL && strcmp(value, "png") == 0) {
+                format = IMAGE_PNG;
+            } else if (value != NULL && strcmp(value, "y4m") == 0) {
+                videoFormat = VIDEO_Y4M;
+            } else if (value != NULL && strcmp(value, "rgb") == 0) {
+                videoFormat = VIDEO_RGB;
+            } else {
+                fprintf(stderr, "--format expects ppm, pfm, png, or y4m or rgb with --animate\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(arg, "--width") == 0) {
+            window_width = parseCount(arg, value, 1, 65536);
+            i++;
+        } else if (strcmp(arg, "--height") == 0) {
+            window_height = parseCount(arg, value, 1, 65536);
+            i++;
+        } else if (strcmp(arg, "--samples") == 0) {
+            aaSamples = parseCount(arg, value, 1, 64);
+            i++;
+        } else if (strcmp(arg, "--depth") == 0) {
+            maxDepth = aaMaxDepth = parseCount(arg, value, 0, 64);
+            i++;
+        } else if (strcmp(arg, "--roulette") == 0) {
+            rouletteThreshold = parseFloat(arg, value, 0, 1);
+            i++;
+        } else if (strcmp(arg, "--lights") == 0) {
+            numLights = parseCount(arg, value, 1, MAX_LIGHTS);
+            i++;
+        } else if (strcmp(arg, "--antialias") == 0) {
+            antialias = GL_TRUE;
+        } else if (strcmp(arg, "--sampler") == 0) {
+            int sampler = (value != NULL) ? samplerFromName(value) : -1;
+            if (sampler < 0) {
+                fprintf(stderr, "--sampler expects random, halton or sobol\n");
+                return EXIT_FAILURE;
+            }
+            samplerType = (SamplerType)sampler;
+            i++;
+        } else if (strcmp(arg, "--seed") == 0) {
+            frameSeed = (unsigned int)parseCount(arg, value, 0, 2147483647);
+            i++;
+        } else if (strcmp(arg, "--adaptive") == 0) {
+            adaptiveAA = GL_TRUE;
+        } else if (strcmp(arg, "--aa-min") == 0) {
+            aaMinSamples = parseCount(arg, value, 1, 64*64);
+            i++;
+        } else if (strcmp(arg, "--aa-threshold") == 0) {
+            aaThreshold = parseFloat(arg, value, 0, 1);
+            i++;
+        } else if (strcmp(arg, "--frame-budget") == 0) {
+            frameBudget = parseFloat(arg, value, 0, 10000);
+            i++;
+        } else if (strcmp(arg, "--dof") == 0) {
+            depthOfField = GL_TRUE;
+        } else if (strcmp(arg, "--reflection") == 0) {
+            reflection = GL_TRUE;
+        } else if (strcmp(arg, "--transparency") == 0) {
+            transparency = GL_TRUE;
+        } else if (strcmp(arg, "--scene") == 0) {
+            if (value == NULL) {
+                fprintf(stderr, "--scene expects a file name\n");
+                return EXIT_FAILURE;
+            }
+            sceneFile = value;
+            i++;
+        } else if (strcmp(arg, "--convert") == 0) {
+            if (value == NULL || i+2 >= argc) {
+                fprintf(stderr, "--convert expects an input and an output file name\n");
+                return EXIT_FAILURE;
+            }
+            convertInput = value;
+            convertOutput = argv[i+2];
+            i += 2;
+        } else if (strcmp(arg, "--leaf-size") == 0) {
+            bvhLeafSize = parseCount(arg, value, 1, 64);
+            leafSizeSet = GL_TRUE;
+            i++;
+        } else if (strcmp(arg, "--bvh-stats") == 0) {
+            showBVHStats = GL_TRUE;
+        } else if (strcmp(arg, "--shadow-stats") == 0) {
+            showShadowStats = GL_TRUE;
+        } else if (strcmp(arg, "--animate") == 0) {
+            if (value == NULL) {
+                fprintf(stderr, "--animate expects a camera path file\n");
+                return EXIT_FAILURE;
+            }
+            animationPath = value;
+            headless = GL_TRUE;
+            i++;
+        } else if (strcmp(arg, "--fps") == 0) {
+            fps = parseCount(arg, value, 1, 1000);
+            i++;
+        } else if (strcmp(arg, "--serve") == 0) {
+            if (value == NULL) {
+                fprintf(stderr, "--serve expects an address\n");
+                return EXIT_FAILURE;
+            }
+            serveAddress = value;
+            headless = GL_TRUE;
+            i++;
+        } else if (strcmp(arg, "--workers") == 0) {
+            char* list = (value != NULL) ? strdup(value) : NULL;
+            for (char* item = (list != NULL) ? strtok(list, ",") : NULL; item != NULL; item = strtok(NULL, ",")) {
+                if (remoteCount == MAX_REMOTE_WORKERS) {
+                    fprintf(stderr, "--workers takes at most %d addresses\n", MAX_REMOTE_WORKERS);
+                    return EXIT_FAILURE;
+                }
+                remoteAddresses[remoteCount++] = item;
+            }
+            if (remoteCount == 0) {
+                fprintf(stderr, "--workers expects a comma-separated list of addresses\n");
+                return EXIT_FAILURE;
+            }
+            headless = GL_TRUE;
+            i++;
+        } else if (strcmp(arg, "--stats") == 0) {
+            showStats = GL_TRUE;
+        } else if (strcmp(arg, "--stats-json") == 0) {
+            if (value == NULL) {
+                fprintf(stderr, "--stats-json expects a file name\n");
+                return EXIT_FAILURE;
+            }
+            statsJson = (strcmp(value, "-") == 0) ? stdout : fopen(value, "w");
+            if (statsJson == NULL) {
+                perror(value);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(arg, "--wavefront") == 0) {
+            wavefrontRendering = GL_TRUE;
+        } else if (strcmp(arg, "--no-packets") == 0) {
+            packetTracing = GL_FALSE;
+        } else if (strcmp(arg, "--no-shadow-grid") == 0) {
+            shadowGridsOn = GL_FALSE;
+        } else if (strcmp(arg, "--denoise") == 0) {
+            denoise = GL_TRUE;
+        } else if (strcmp(arg, "--no-gbuffer") == 0) {
+            useGBuffer = GL_FALSE;
+        } else if (strcmp(arg, "--simd") == 0) {
+            if (value == NULL) {
+                fprintf(stderr, "--simd expects scalar, sse or avx2\n");
+                return EXIT_FAILURE;
+            }
+            kernel = value;
+            i++;
+        } else if (strcmp(arg, "--help") == 0) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (selectSphereKernels(kernel) != 0) {
+        fprintf(stderr, "Intersection kernel %s is not supported on this CPU\n", kernel);
+        return EXIT_FAILURE;
+    }
+    selectDenoiseKernel(sphereKernelName);
+#ifndef RT_STATS
+    if (showShadowStats || showStats || statsJson != NULL) {
+        fprintf(stderr, "Render statistics are not compiled in; build with make STATS=1\n");
+        return EXIT_FAILURE;
+    }
+#endif
+
+    if (headless && animationPath == NULL) {
+        if (format < 0) {
+            format = formatFromName(output != NULL ? output : "-");
+        }
+        if (checkImageFormat((ImageFormat)format) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (remoteCount > 0 && adaptiveAA) {
+        fprintf(stderr, "--adaptive can't be combined with --workers\n");
+        return EXIT_FAILURE;
+    }
+
+    startPool(numThreads > 0 ? numThreads : hardwareThreads());
+
+    if (convertInput != NULL) {
+        return convertScene(convertInput, convertOutput, bvhLeafSize) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    init();
+    setImagePlane();
+    allocatePixels();
+
+    if (serveAddress != NULL) {
+        return serveTiles(serveAddress);
+    }
+
+    if (headless) {
+        // A headless render always takes every sample in one go
+        progressive = GL_FALSE;
+        if (output == NULL) {
+            output = "-";
+        }
+        if (animationPath != NULL) {
+            return renderAnimation(animationPath, output, (videoFormat >= 0) ? (VideoFormat)videoFormat : videoFormatFromName(output), fps);
+        }
+        return renderHeadless(output, (format >= 0) ? (ImageFormat)format : formatFromName(output));
+    }
+    gbufferOn = useGBuffer;
+
+#ifndef NO_GLUT
+    if (showBVHStats) {
+        printSceneStats(stderr);
+    }
+
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+    glutInitWindowSize(window_width, window_height);
+
+    glutCreateWindow("CAP 4730 | Final Project | Advanced Ray-Tracer");
+    glutDisplayFunc(display);
+    glutKeyboardFunc(keyboard);
+    glutReshapeFunc(reshape);
+
+    if (startPresentation() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    glutMainLoop();
+#endif
+
+    return EXIT_SUCCESS;
+}
+#endif
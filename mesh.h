@@ -0,0 +1,550 @@
+#include <stdint.h>
+
+// Triangle meshes. A mesh is stored indexed: shared vertex positions, three
+// 32-bit vertex indices per triangle and, if the model has them, one
+// quantized normal per vertex (two 16-bit octahedral coordinates). Every
+// mesh has its own BVH, built with the same builder as the sphere BVH, and
+// the triangles are reordered so every leaf refers to a contiguous range of
+// index triples. A mesh loaded from a binary file points into the mapping
+// and is marked mapped, like a mapped sphere store.
+//
+// All triangles of a mesh share one material.
+
+typedef struct {
+    float* vertices;      // x, y, z per vertex
+    uint32_t* indices;    // 3 per triangle, in BVH leaf order
+    int16_t* normals;     // 2 per vertex, or NULL for flat shading
+    int vertexCount;
+    int triangleCount;
+    BVH bvh;
+    Material material;
+    char source[256];     // File the mesh was loaded from
+    int mapped;
+} Mesh;
+
+// Octahedral normal encoding: the unit sphere is projected onto an
+// octahedron and unfolded into a square, which keeps the error even over
+// all directions at 4 bytes per normal
+static inline float signNotZero(float x) {
+    return (x >= 0) ? 1 : -1;
+}
+
+void encodeNormal(Vector n, int16_t* out) {
+    float s = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = (s > 0) ? n.x / s : 0;
+    float y = (s > 0) ? n.y / s : 0;
+
+    if (n.z < 0) {
+        float fx = (1 - fabsf(y)) * signNotZero(x);
+        y = (1 - fabsf(x)) * signNotZero(y);
+        x = fx;
+    }
+    out[0] = (int16_t)roundf(x * 32767);
+    out[1] = (int16_t)roundf(y * 32767);
+}
+
+Vector decodeNormal(const int16_t* in) {
+    float x = in[0] / 32767.0f;
+    float y = in[1] / 32767.0f;
+    float z = 1 - fabsf(x) - fabsf(y);
+
+    if (z < 0) {
+        float fx = (1 - fabsf(y)) * signNotZero(x);
+        y = (1 - fabsf(x)) * signNotZero(y);
+        x = fx;
+    }
+    Vector n = newVector(x, y, z);
+    return scaleVector(1/mag(n), n);
+}
+
+// Per-ray setup of the watertight ray-triangle test (Woop, Benthin and
+// Wald, 2013). The ray is transformed so it runs along +z from the origin;
+// the edge tests are then 2D and exactly consistent between neighbouring
+// triangles, so rays can't slip through the shared edges of a mesh.
+typedef struct {
+    Vector origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+} TriangleRay;
+
+TriangleRay triangleRay(const Ray* ray) {
+    TriangleRay tr;
+    float d[3] = {ray->direction.x, ray->direction.y, ray->direction.z};
+    float ax = fabsf(d[0]), ay = fabsf(d[1]), az = fabsf(d[2]);
+
+    tr.origin = ray->origin;
+    tr.kz = (ax > ay) ? ((ax > az) ? 0 : 2) : ((ay > az) ? 1 : 2);
+    tr.kx = (tr.kz + 1) % 3;
+    tr.ky = (tr.kx + 1) % 3;
+    // Keep the winding of the transformed triangle
+    if (d[tr.kz] < 0) {
+        int swap = tr.kx; tr.kx = tr.ky; tr.ky = swap;
+    }
+    tr.sx = d[tr.kx] / d[tr.kz];
+    tr.sy = d[tr.ky] / d[tr.kz];
+    tr.sz = 1 / d[tr.kz];
+    return tr;
+}
+
+// Intersect a ray with triangle i of a mesh from either side. Returns
+// whether it is hit with 0 < t < tMax, and if so t and the barycentric
+// weights of the second and third vertex.
+static inline int intersectTriangle(const Mesh* mesh, int i, const TriangleRay* tr, float tMax, float* t, float* b1, float* b2) {
+    const uint32_t* index = &mesh->indices[3*i];
+    const float* p0 = &mesh->vertices[3*index[0]];
+    const float* p1 = &mesh->vertices[3*index[1]];
+    const float* p2 = &mesh->vertices[3*index[2]];
+    float o[3] = {tr->origin.x, tr->origin.y, tr->origin.z};
+    float a[3], b[3], c[3];
+
+    for (int k=0; k<3; k++) {
+        a[k] = p0[k] - o[k];
+        b[k] = p1[k] - o[k];
+        c[k] = p2[k] - o[k];
+    }
+
+    // Shear the vertices into ray space
+    float ax = a[tr->kx] - tr->sx * a[tr->kz], ay = a[tr->ky] - tr->sy * a[tr->kz];
+    float bx = b[tr->kx] - tr->sx * b[tr->kz], by = b[tr->ky] - tr->sy * b[tr->kz];
+    float cx = c[tr->kx] - tr->sx * c[tr->kz], cy = c[tr->ky] - tr->sy * c[tr->kz];
+
+    // Scaled barycentrics as 2D edge functions, redone in double precision
+    // when the ray runs exactly along an edge
+    float u = cx*by - cy*bx;
+    float v = ax*cy - ay*cx;
+    float w = bx*ay - by*ax;
+    if (u == 0 || v == 0 || w == 0) {
+        u = (float)((double)cx*by - (double)cy*bx);
+        v = (float)((double)ax*cy - (double)ay*cx);
+        w = (float)((double)bx*ay - (double)by*ax);
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) {
+        return 0;
+    }
+    float det = u + v + w;
+    if (det == 0) {
+        return 0;
+    }
+
+    // Scaled distance, compared before the division
+    float dist = u * (tr->sz * a[tr->kz]) + v * (tr->sz * b[tr->kz]) + w * (tr->sz * c[tr->kz]);
+    if ((det > 0) ? (dist <= 0 || dist >= tMax * det) : (dist >= 0 || dist <= tMax * det)) {
+        return 0;
+    }
+
+    float inv = 1 / det;
+    *t = dist * inv;
+    *b1 = v * inv;
+    *b2 = w * inv;
+    return 1;
+}
+
+// Closest-hit traversal of a mesh: returns the nearest triangle hit with
+// 0 < t < *tHit and lowers *tHit to it, or -1
+int bvhNearestTriangle(const Mesh* mesh, const TriangleRay* tr, const Ray* ray, float* tHit) {
+    const BVH* bvh = &mesh->bvh;
+    int stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int sp = 0, node = 0, result = -1;
+    float inv[3] = {1 / ray->direction.x, 1 / ray->direction.y, 1 / ray->direction.z};
+
+    STAT_ADD(bvhRays, 1);
+    if (bvh->count == 0 || boxEntry(&bvh->nodes[0], &ray->origin, inv, *tHit) == INFINITY) {
+        return -1;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(nodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(triangleTests, n->count);
+            for (int i=n->leftFirst; i<n->leftFirst+n->count; i++) {
+                float t, b1, b2;
+                if (intersectTriangle(mesh, i, tr, *tHit, &t, &b1, &b2)) {
+                    *tHit = t;
+                    result = i;
+                }
+            }
+        } else {
+            int near = n->leftFirst, far = n->leftFirst + 1;
+            float dNear = boxEntry(&bvh->nodes[near], &ray->origin, inv, *tHit);
+            float dFar = boxEntry(&bvh->nodes[far], &ray->origin, inv, *tHit);
+
+            if (dFar < dNear) {
+                int swap = near; near = far; far = swap;
+                float swapEntry = dNear; dNear = dFar; dFar = swapEntry;
+            }
+            if (dNear != INFINITY) {
+                if (dFar != INFINITY) {
+                    stack[sp] = far;
+                    stackEntry[sp++] = dFar;
+                }
+                node = near;
+                continue;
+            }
+        }
+
+        do {
+            if (sp == 0) {
+                return result;
+            }
+            node = stack[--sp];
+        } while (stackEntry[sp] >= *tHit);
+    }
+}
+
+// Any-hit traversal of a mesh: whether any triangle is hit with
+// 0 < t < tMax
+int bvhAnyTriangle(const Mesh* mesh, const TriangleRay* tr, const Ray* ray, float tMax) {
+    const BVH* bvh = &mesh->bvh;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0, node = 0;
+    float inv[3] = {1 / ray->direction.x, 1 / ray->direction.y, 1 / ray->direction.z};
+
+    STAT_ADD(bvhRays, 1);
+    if (bvh->count == 0 || boxEntry(&bvh->nodes[0], &ray->origin, inv, tMax) == INFINITY) {
+        return 0;
+    }
+
+    for (;;) {
+        const BVHNode* n = &bvh->nodes[node];
+        STAT_ADD(nodesVisited, 1);
+
+        if (n->count > 0) {
+            STAT_ADD(triangleTests, n->count);
+            for (int i=n->leftFirst; i<n->leftFirst+n->count; i++) {
+                float t, b1, b2;
+                if (intersectTriangle(mesh, i, tr, tMax, &t, &b1, &b2)) {
+                    return 1;
+                }
+            }
+        } else {
+            int left = n->leftFirst, right = n->leftFirst + 1;
+            int hitLeft = boxEntry(&bvh->nodes[left], &ray->origin, inv, tMax) != INFINITY;
+            int hitRight = boxEntry(&bvh->nodes[right], &ray->origin, inv, tMax) != INFINITY;
+
+            if (hitLeft || hitRight) {
+                if (hitLeft && hitRight) {
+                    stack[sp++] = right;
+                }
+                node = hitLeft ? left : right;
+                continue;
+            }
+        }
+
+        if (sp == 0) {
+            return 0;
+        }
+        node = stack[--sp];
+    }
+}
+
+// Surface normal of a hit on triangle i, following the convention of the
+// sphere normals: it points away from the side the ray came from, i.e.
+// into the mesh for a ray arriving at the front (counter-clockwise) face.
+// Transparent meshes keep the normal given by the winding so the
+// refraction code can tell entering from leaving; opaque ones are shaded
+// the same from both sides.
+Vector triangleNormal(const Mesh* mesh, int i, const Ray* ray) {
+    const uint32_t* index = &mesh->indices[3*i];
+    const float* p0 = &mesh->vertices[3*index[0]];
+    const float* p1 = &mesh->vertices[3*index[1]];
+    const float* p2 = &mesh->vertices[3*index[2]];
+    Vector e1 = newVector(p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2]);
+    Vector e2 = newVector(p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2]);
+    Vector g = cross(e1, e2);
+    Vector n = g;
+
+    if (mesh->normals != NULL) {
+        TriangleRay tr = triangleRay(ray);
+        float t, b1, b2;
+
+        if (intersectTriangle(mesh, i, &tr, INFINITY, &t, &b1, &b2)) {
+            Vector n0 = decodeNormal(&mesh->normals[2*index[0]]);
+            Vector n1 = decodeNormal(&mesh->normals[2*index[1]]);
+            Vector n2 = decodeNormal(&mesh->normals[2*index[2]]);
+            n = addVector(scaleVector(1-b1-b2, n0), addVector(scaleVector(b1, n1), scaleVector(b2, n2)));
+            // Vertex normals that disagree with the winding are flipped
+            if (dot(n, g) < 0) {
+                n = scaleVector(-1, n);
+            }
+        }
+    }
+
+    n = scaleVector(-1/mag(n), n);
+    if (mesh->material.ri == 1 && dot(ray->direction, g) > 0) {
+        n = scaleVector(-1, n);
+    }
+    return n;
+}
+
+// Build the BVH of a mesh and reorder its triangles to match it
+void buildMeshBVH(Mesh* mesh, int maxLeafSize) {
+    AABB* bounds = malloc(sizeof(AABB) * (mesh->triangleCount > 0 ? mesh->triangleCount : 1));
+    uint32_t* indices = malloc(sizeof(uint32_t) * 3 * (mesh->triangleCount > 0 ? mesh->triangleCount : 1));
+
+    for (int i=0; i<mesh->triangleCount; i++) {
+        bounds[i] = emptyBox();
+        for (int k=0; k<3; k++) {
+            growBoxPoint(&bounds[i], &mesh->vertices[3*mesh->indices[3*i+k]]);
+        }
+    }
+
+    buildBVH(&mesh->bvh, bounds, mesh->triangleCount, maxLeafSize);
+    for (int i=0; i<mesh->triangleCount; i++) {
+        memcpy(&indices[3*i], &mesh->indices[3*mesh->bvh.order[i]], sizeof(uint32_t) * 3);
+    }
+    if (!mesh->mapped) {
+        free(mesh->indices);
+    }
+    mesh->indices = indices;
+
+    free(bounds);
+}
+
+// Bytes a mesh takes in memory, for the per-triangle report
+size_t meshBytes(const Mesh* mesh, size_t* vertexBytes, size_t* normalBytes, size_t* indexBytes, size_t* nodeBytes) {
+    *vertexBytes = sizeof(float) * 3 * mesh->vertexCount;
+    *normalBytes = (mesh->normals != NULL) ? sizeof(int16_t) * 2 * mesh->vertexCount : 0;
+    *indexBytes = sizeof(uint32_t) * 3 * mesh->triangleCount;
+    *nodeBytes = sizeof(BVHNode) * mesh->bvh.nodeCount;
+    return *vertexBytes + *normalBytes + *indexBytes + *nodeBytes;
+}
+
+void printMeshStats(FILE* out, const Mesh* mesh) {
+    size_t vertexBytes, normalBytes, indexBytes, nodeBytes;
+    size_t total = meshBytes(mesh, &vertexBytes, &normalBytes, &indexBytes, &nodeBytes);
+    double triangles = (mesh->triangleCount > 0) ? mesh->triangleCount : 1;
+
+    fprintf(out, "Mesh %s: %d triangles, %d vertices, %.2f MB, %.1f bytes per triangle "
+            "(vertices %.1f, normals %.1f, indices %.1f, BVH %.1f)\n",
+            mesh->source, mesh->triangleCount, mesh->vertexCount, total / 1e6, total / triangles,
+            vertexBytes / triangles, normalBytes / triangles, indexBytes / triangles, nodeBytes / triangles);
+}
+
+// Growable array helper for the OBJ parser
+void* growArray(void* array, int* capacity, int needed, size_t size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    *capacity = (needed > 2 * *capacity) ? needed : 2 * *capacity;
+    array = realloc(array, size * *capacity);
+    if (array == NULL) {
+        fprintf(stderr, "Out of memory loading a mesh\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+// Vertex of the mesh for an OBJ position/normal pair. Positions are shared
+// as they are in the file; with normals, each distinct pair becomes one
+// vertex, found through an open addressing table.
+typedef struct {
+    uint64_t* keys;
+    int* values;
+    int size;
+} VertexTable;
+
+int objVertex(VertexTable* table, Mesh* mesh, int* capacity, const float* positions, const float* normals, int p, int n) {
+    if (normals == NULL) {
+        return p;
+    }
+
+    uint64_t key = ((uint64_t)p << 32) | (uint32_t)n;
+    size_t slot = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 20) & (table->size - 1);
+    while (table->values[slot] >= 0) {
+        if (table->keys[slot] == key) {
+            return table->values[slot];
+        }
+        slot = (slot + 1) & (table->size - 1);
+    }
+
+    // Keep the table at most half full
+    if (2 * (mesh->vertexCount + 1) > table->size) {
+        VertexTable bigger = {calloc(2 * table->size, sizeof(uint64_t)), malloc(sizeof(int) * 2 * table->size), 2 * table->size};
+        for (int i=0; i<bigger.size; i++) {
+            bigger.values[i] = -1;
+        }
+        for (int i=0; i<table->size; i++) {
+            if (table->values[i] >= 0) {
+                size_t s = (size_t)((table->keys[i] * 0x9e3779b97f4a7c15ull) >> 20) & (bigger.size - 1);
+                while (bigger.values[s] >= 0) {
+                    s = (s + 1) & (bigger.size - 1);
+                }
+                bigger.keys[s] = table->keys[i];
+                bigger.values[s] = table->values[i];
+            }
+        }
+        free(table->keys);
+        free(table->values);
+        *table = bigger;
+        return objVertex(table, mesh, capacity, positions, normals, p, n);
+    }
+
+    int v = mesh->vertexCount++;
+    mesh->vertices = growArray(mesh->vertices, capacity, mesh->vertexCount, sizeof(float) * 3);
+    mesh->normals = realloc(mesh->normals, sizeof(int16_t) * 2 * *capacity);
+    memcpy(&mesh->vertices[3*v], &positions[3*p], sizeof(float) * 3);
+    encodeNormal(newVector(normals[3*n], normals[3*n+1], normals[3*n+2]), &mesh->normals[2*v]);
+    table->keys[slot] = key;
+    table->values[slot] = v;
+    return v;
+}
+
+// Resolve a 1-based (or negative, relative) OBJ index. Returns -1 if it is
+// out of range.
+int objIndex(long index, int count) {
+    long result = (index < 0) ? count + index : index - 1;
+    return (index != 0 && result >= 0 && result < count) ? (int)result : -1;
+}
+
+// Load the triangles of an OBJ file. Faces with more than three corners
+// are split into fans; texture coordinates, groups and materials are
+// ignored. Vertex normals are kept if every face corner has one. Returns 0
+// on success or -1 after printing an error. The BVH is not built here.
+int loadOBJ(const char* path, Mesh* mesh) {
+    FILE* in = fopen(path, "r");
+    char line[4096];
+    int lineNumber = 0;
+    float* positions = NULL;
+    float* normals = NULL;
+    int positionCount = 0, positionCapacity = 0;
+    int normalCount = 0, normalCapacity = 0;
+    int* corners = NULL;        // Position and normal index of each face corner
+    int cornerCount = 0, cornerCapacity = 0;
+    int* faces = NULL;          // Number of corners of each face
+    int faceCount = 0, faceCapacity = 0;
+    int allNormals = 1;
+
+    if (in == NULL) {
+        fprintf(stderr, "Unable to open mesh %s\n", path);
+        return -1;
+    }
+    memset(mesh, 0, sizeof(*mesh));
+    snprintf(mesh->source, sizeof(mesh->source), "%s", path);
+
+    // First pass: read the positions, normals and face corners
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char* cursor = line;
+        float values[3];
+
+        lineNumber++;
+        while (*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+        if (cursor[0] == 'v' && (cursor[1] == ' ' || cursor[1] == '\t')) {
+            if (sscanf(cursor + 2, "%f %f %f", &values[0], &values[1], &values[2]) != 3) {
+                goto error;
+            }
+            positions = growArray(positions, &positionCapacity, positionCount + 1, sizeof(float) * 3);
+            memcpy(&positions[3*positionCount++], values, sizeof(values));
+        } else if (cursor[0] == 'v' && cursor[1] == 'n') {
+            if (sscanf(cursor + 2, "%f %f %f", &values[0], &values[1], &values[2]) != 3) {
+                goto error;
+            }
+            normals = growArray(normals, &normalCapacity, normalCount + 1, sizeof(float) * 3);
+            memcpy(&normals[3*normalCount++], values, sizeof(values));
+        } else if (cursor[0] == 'f' && (cursor[1] == ' ' || cursor[1] == '\t')) {
+            int count = 0;
+            char* end;
+
+            cursor += 2;
+            for (;;) {
+                long p = strtol(cursor, &end, 10), n = 0;
+                if (end == cursor) {
+                    break;
+                }
+                cursor = end;
+                if (*cursor == '/') {
+                    cursor++;
+                    strtol(cursor, &end, 10);   // Texture coordinate, unused
+                    cursor = end;
+                    if (*cursor == '/') {
+                        cursor++;
+                        n = strtol(cursor, &end, 10);
+                        cursor = end;
+                    }
+                }
+                int pi = objIndex(p, positionCount);
+                int ni = (n != 0) ? objIndex(n, normalCount) : -1;
+                if (pi < 0 || (n != 0 && ni < 0)) {
+                    goto error;
+                }
+                allNormals &= (ni >= 0);
+                corners = growArray(corners, &cornerCapacity, cornerCount + 1, sizeof(int) * 2);
+                corners[2*cornerCount] = pi;
+                corners[2*cornerCount+1] = ni;
+                cornerCount++;
+                count++;
+            }
+            if (count < 3) {
+                goto error;
+            }
+            faces = growArray(faces, &faceCapacity, faceCount + 1, sizeof(int));
+            faces[faceCount++] = count;
+        }
+    }
+    fclose(in);
+
+    // Second pass: fan-triangulate the faces into shared vertices
+    int useNormals = allNormals && normalCount > 0;
+    int vertexCapacity = 0, triangleCapacity = 0;
+    VertexTable table = {NULL, NULL, 0};
+
+    if (useNormals) {
+        table.size = 1024;
+        table.keys = calloc(table.size, sizeof(uint64_t));
+        table.values = malloc(sizeof(int) * table.size);
+        for (int i=0; i<table.size; i++) {
+            table.values[i] = -1;
+        }
+    } else {
+        mesh->vertices = positions;
+        mesh->vertexCount = positionCount;
+        positions = NULL;
+    }
+
+    for (int f=0, c=0; f<faceCount; c+=faces[f++]) {
+        int count = faces[f];
+        int face[3];
+        const int* corner = &corners[2*c];
+
+        for (int k=0; k<count; k++) {
+            int v = useNormals ? objVertex(&table, mesh, &vertexCapacity, positions, normals, corner[2*k], corner[2*k+1]) : corner[2*k];
+            if (k < 2) {
+                face[k] = v;
+                continue;
+            }
+            face[2] = v;
+            mesh->indices = growArray(mesh->indices, &triangleCapacity, mesh->triangleCount + 1, sizeof(uint32_t) * 3);
+            for (int a=0; a<3; a++) {
+                mesh->indices[3*mesh->triangleCount + a] = face[a];
+            }
+            mesh->triangleCount++;
+            face[1] = v;
+        }
+    }
+
+    free(table.keys);
+    free(table.values);
+    free(positions);
+    free(normals);
+    free(corners);
+    free(faces);
+
+    if (mesh->triangleCount == 0) {
+        fprintf(stderr, "%s has no faces\n", path);
+        return -1;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s:%d: invalid OBJ line: %s", path, lineNumber, line);
+    fclose(in);
+    free(positions);
+    free(normals);
+    free(corners);
+    free(faces);
+    return -1;
+}
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Sockets for distributed rendering. An address is either "unix:PATH" for
+// a Unix domain socket or "HOST:PORT" for TCP, where an empty host means
+// every interface when listening and localhost when connecting.
+//
+// Every message is a NetHeader followed by size bytes of payload. Values
+// are sent in host byte order; both ends check NET_MAGIC when they meet,
+// so peers of a different architecture refuse each other instead of
+// rendering garbage.
+
+#define NET_MAGIC 0x52544e33u   // "RTN3"
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+} NetHeader;
+
+// Split "HOST:PORT" at the last colon. host must hold at least 256 bytes.
+int splitAddress(const char* address, char* host, const char** port) {
+    const char* colon = strrchr(address, ':');
+    size_t length = (colon != NULL) ? (size_t)(colon - address) : 0;
+
+    if (colon == NULL || colon[1] == '\0' || length >= 256) {
+        fprintf(stderr, "%s is not an address (expected HOST:PORT or unix:PATH)\n", address);
+        return -1;
+    }
+    memcpy(host, address, length);
+    host[length] = '\0';
+    *port = colon + 1;
+    return 0;
+}
+
+// Unix socket address for "unix:PATH", or -1 if the path is too long
+int unixAddress(const char* address, struct sockaddr_un* sun) {
+    const char* path = address + 5;
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+// Open a socket of either kind and bind or connect it. Returns the socket
+// or -1.
+int netOpen(const char* address, int listening) {
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        if (unixAddress(address, &sun) != 0) {
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listening) {
+            unlink(sun.sun_path);
+        }
+        if (fd >= 0 && (listening ? bind(fd, (struct sockaddr*)&sun, sizeof(sun)) : connect(fd, (struct sockaddr*)&sun, sizeof(sun))) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        struct addrinfo hints, *list, *ai;
+        char host[256];
+        const char* port;
+
+        if (splitAddress(address, host, &port) != 0) {
+            return -1;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &list) != 0) {
+            fprintf(stderr, "Unable to resolve %s\n", address);
+            return -1;
+        }
+        for (ai = list; ai != NULL && fd < 0; ai = ai->ai_next) {
+            int one = 1;
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if ((listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(list);
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "Unable to %s %s: %s\n", listening ? "listen on" : "connect to", address, strerror(errno));
+        return -1;
+    }
+    if (listening && listen(fd, 8) != 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int netListen(const char* address) {
+    return netOpen(address, 1);
+}
+
+int netConnect(const char* address) {
+    return netOpen(address, 0);
+}
+
+// Give up on a peer that stalls in the middle of a message
+void setNetTimeout(int fd, int seconds) {
+    struct timeval timeout = {seconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+int sendAll(int fd, const void* data, size_t size) {
+    const char* p = data;
+
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int recvAll(int fd, void* data, size_t size) {
+    char* p = data;
+
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Send one message, which may have an empty payload
+int sendMessage(int fd, uint32_t type, const void* data, uint32_t size) {
+    NetHeader header = {type, size};
+    if (sendAll(fd, &header, sizeof(header)) != 0) {
+        return -1;
+    }
+    return (size > 0) ? sendAll(fd, data, size) : 0;
+}
+
+// Receive a message into a buffer of capacity bytes. Returns the payload
+// size, or -1 on a closed connection, an error or an oversized message.
+int recvMessage(int fd, uint32_t* type, void* data, uint32_t capacity) {
+    NetHeader header;
+
+    if (recvAll(fd, &header, sizeof(header)) != 0 || header.size > capacity) {
+        return -1;
+    }
+    if (header.size > 0 && recvAll(fd, data, header.size) != 0) {
+        return -1;
+    }
+    *type = header.type;
+    return (int)header.size;
+}
@@ -0,0 +1,110 @@
+// Coherent ray packets. Primary rays of a pixel block all start at the eye
+// and shadow rays toward a directional light all share one direction, so
+// the per-sphere setup can be done once for the whole packet. The inner
+// loops run across the rays of the packet without branches so the compiler
+// can vectorize them, and use the same arithmetic as calcIntersection so
+// packets and single rays find exactly the same hits.
+
+#define PACKET_WIDTH 8
+#define PACKET_SIZE (PACKET_WIDTH * PACKET_WIDTH)
+
+typedef struct {
+    float ox[PACKET_SIZE] __attribute__((aligned(32)));
+    float oy[PACKET_SIZE] __attribute__((aligned(32)));
+    float oz[PACKET_SIZE] __attribute__((aligned(32)));
+    float dx[PACKET_SIZE] __attribute__((aligned(32)));
+    float dy[PACKET_SIZE] __attribute__((aligned(32)));
+    float dz[PACKET_SIZE] __attribute__((aligned(32)));
+    float d2[PACKET_SIZE] __attribute__((aligned(32)));
+    float ix[PACKET_SIZE] __attribute__((aligned(32)));
+    float iy[PACKET_SIZE] __attribute__((aligned(32)));
+    float iz[PACKET_SIZE] __attribute__((aligned(32)));
+    float t[PACKET_SIZE] __attribute__((aligned(32)));
+    int sphere[PACKET_SIZE] __attribute__((aligned(32)));
+    int active[PACKET_SIZE] __attribute__((aligned(32)));
+} RayPacket;
+
+// Store a ray into a packet slot
+void setPacketRay(RayPacket* packet, int k, Ray ray) {
+    packet->ox[k] = ray.origin.x;
+    packet->oy[k] = ray.origin.y;
+    packet->oz[k] = ray.origin.z;
+    packet->dx[k] = ray.direction.x;
+    packet->dy[k] = ray.direction.y;
+    packet->dz[k] = ray.direction.z;
+    packet->d2[k] = ray.direction.x*ray.direction.x + ray.direction.y*ray.direction.y + ray.direction.z*ray.direction.z;
+    packet->ix[k] = 1 / ray.direction.x;
+    packet->iy[k] = 1 / ray.direction.y;
+    packet->iz[k] = 1 / ray.direction.z;
+}
+
+// Read a ray back out of a packet slot
+Ray packetRay(const RayPacket* packet, int k) {
+    Ray ray;
+    ray.origin = newVector(packet->ox[k], packet->oy[k], packet->oz[k]);
+    ray.direction = newVector(packet->dx[k], packet->dy[k], packet->dz[k]);
+    return ray;
+}
+
+// Nearest-hit test of spheres [first, first+count) against a packet whose
+// active rays all start at origin. packet->t and packet->sphere hold the
+// closest hit so far and are lowered in place.
+void nearestSpheresPacket(const SphereStore* store, int first, int count, Vector origin, RayPacket* packet) {
+    for (int i=first; i<first+count; i++) {
+        // Per-sphere setup shared by every ray of the packet
+        float ocx = origin.x - store->cx[i];
+        float ocy = origin.y - store->cy[i];
+        float ocz = origin.z - store->cz[i];
+        float c = (ocx*ocx + ocy*ocy + ocz*ocz) - store->r2[i];
+
+        for (int k=0; k<PACKET_SIZE; k++) {
+            float b = packet->dx[k]*ocx + packet->dy[k]*ocy + packet->dz[k]*ocz;
+            float disc = b*b - packet->d2[k]*c;
+            float s = sqrtf(disc > 0 ? disc : 0);
+            float t2 = (-b - s) / packet->d2[k];
+            float t1 = (-b + s) / packet->d2[k];
+            float t = (t2 > 0) ? t2 : t1;
+            int closer = packet->active[k] & (disc >= 0) & (t > 0) & (t < packet->t[k]);
+
+            packet->t[k] = closer ? t : packet->t[k];
+            packet->sphere[k] = closer ? i : packet->sphere[k];
+        }
+    }
+}
+
+// Any-hit test of spheres [first, first+count) against a packet whose
+// active rays all travel along direction. Blocked rays are made inactive
+// and get the blocking sphere; returns how many rays are still unblocked,
+// stopping early once every ray is.
+int occludedSpheresPacket(const SphereStore* store, int first, int count, Vector direction, RayPacket* packet) {
+    float d2 = direction.x*direction.x + direction.y*direction.y + direction.z*direction.z;
+    int remaining = 0;
+
+    for (int k=0; k<PACKET_SIZE; k++) {
+        remaining += packet->active[k];
+    }
+
+    for (int i=first; i<first+count && remaining > 0; i++) {
+        float cx = store->cx[i], cy = store->cy[i], cz = store->cz[i], r2 = store->r2[i];
+
+        remaining = 0;
+        for (int k=0; k<PACKET_SIZE; k++) {
+            float ocx = packet->ox[k] - cx;
+            float ocy = packet->oy[k] - cy;
+            float ocz = packet->oz[k] - cz;
+            float b = direction.x*ocx + direction.y*ocy + direction.z*ocz;
+            float c = (ocx*ocx + ocy*ocy + ocz*ocz) - r2;
+            float disc = b*b - d2*c;
+            float s = sqrtf(disc > 0 ? disc : 0);
+            float t2 = (-b - s) / d2;
+            float t1 = (-b + s) / d2;
+            float t = (t2 > 0) ? t2 : t1;
+            int blocked = packet->active[k] & (disc >= 0) & (t > 0) & (t < packet->t[k]);
+
+            packet->sphere[k] = blocked ? i : packet->sphere[k];
+            packet->active[k] &= !blocked;
+            remaining += packet->active[k];
+        }
+    }
+    return remaining;
+}
@@ -0,0 +1,195 @@
+#include <pthread.h>
+#include <unistd.h>
+
+// Work-stealing thread pool. Every worker owns a deque of job indices; it
+// pops from the bottom of its own deque and steals from the top of the
+// others once it runs dry, so expensive tiles don't leave threads idle.
+
+#define MAX_THREADS 64
+
+typedef void (*JobFunc)(void* context, int job, int worker);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int* jobs;
+    int top;
+    int bottom;
+    int capacity;
+} JobDeque;
+
+JobDeque deques[MAX_THREADS];
+pthread_t poolThreads[MAX_THREADS];
+int numWorkers = 1;
+
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t poolCallLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+unsigned long poolGeneration = 0;
+int poolRemaining = 0;
+JobFunc poolFunc;
+void* poolContext;
+
+// Set while the current thread is executing a job, so nested calls to
+// parallelFor run inline instead of deadlocking the pool
+__thread int poolInJob = 0;
+
+// Index of the worker running on the current thread, for per-thread data
+// such as statistics counters. Threads outside the pool count as worker 0.
+__thread int poolWorker = 0;
+
+// Number of hardware threads available to the process
+int hardwareThreads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+// Pop a job from the bottom of a deque (owner side)
+int popJob(JobDeque* q, int* job) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        *job = q->jobs[--q->bottom];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// Steal a job from the top of a deque (thief side)
+int stealJob(JobDeque* q, int* job) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        *job = q->jobs[q->top++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// Find the next job for a worker, stealing from its neighbours if needed
+int nextJob(int worker, int* job) {
+    if (popJob(&deques[worker], job)) {
+        return 1;
+    }
+    for (int k=1; k<numWorkers; k++) {
+        if (stealJob(&deques[(worker + k) % numWorkers], job)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run jobs until every deque is empty
+void runJobs(int worker) {
+    int job;
+
+    poolInJob = 1;
+    poolWorker = worker;
+    while (nextJob(worker, &job)) {
+        poolFunc(poolContext, job, worker);
+        if (__atomic_sub_fetch(&poolRemaining, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&poolLock);
+            pthread_cond_signal(&poolDone);
+            pthread_mutex_unlock(&poolLock);
+        }
+    }
+    poolInJob = 0;
+}
+
+void* poolWorkerMain(void* arg) {
+    int worker = (int)(long)arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&poolLock);
+    for (;;) {
+        while (poolGeneration == seen) {
+            pthread_cond_wait(&poolWake, &poolLock);
+        }
+        seen = poolGeneration;
+        pthread_mutex_unlock(&poolLock);
+
+        runJobs(worker);
+
+        pthread_mutex_lock(&poolLock);
+    }
+    return NULL;
+}
+
+// Start the pool. The calling thread counts as worker 0, so only
+// numThreads-1 background threads are spawned.
+void startPool(int numThreads) {
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+    if (numThreads > MAX_THREADS) {
+        numThreads = MAX_THREADS;
+    }
+    numWorkers = numThreads;
+
+    for (int i=0; i<numWorkers; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].jobs = NULL;
+        deques[i].top = deques[i].bottom = deques[i].capacity = 0;
+    }
+    for (int i=1; i<numWorkers; i++) {
+        pthread_create(&poolThreads[i], NULL, poolWorkerMain, (void*)(long)i);
+    }
+}
+
+// Run func(context, job, worker) for every job in [0, count) and wait for
+// all of them to finish. Each worker is seeded with a contiguous block of
+// jobs so neighbouring tiles stay on the same core until stolen.
+void parallelFor(int count, JobFunc func, void* context) {
+    if (count <= 0) {
+        return;
+    }
+
+    if (numWorkers == 1 || poolInJob) {
+        for (int job=0; job<count; job++) {
+            func(context, job, poolWorker);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&poolCallLock);
+
+    poolRemaining = count;
+    poolFunc = func;
+    poolContext = context;
+
+    for (int w=0; w<numWorkers; w++) {
+        int first = (int)((long)count * w / numWorkers);
+        int last = (int)((long)count * (w+1) / numWorkers);
+        JobDeque* q = &deques[w];
+
+        pthread_mutex_lock(&q->lock);
+        if (q->capacity < last - first) {
+            q->capacity = last - first;
+            q->jobs = realloc(q->jobs, sizeof(int) * q->capacity);
+        }
+        // Stored in reverse so the owner pops its block front to back
+        q->top = 0;
+        q->bottom = last - first;
+        for (int k=0; k<last-first; k++) {
+            q->jobs[k] = last - 1 - k;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&poolLock);
+    poolGeneration++;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolLock);
+
+    runJobs(0);
+
+    pthread_mutex_lock(&poolLock);
+    while (__atomic_load_n(&poolRemaining, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&poolDone, &poolLock);
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    pthread_mutex_unlock(&poolCallLock);
+}
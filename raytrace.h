@@ -83,6 +83,16 @@ typedef struct {
 
 
 
+// Surface properties of a sphere, kept apart from its geometry
+typedef struct {
+    RGBf color;
+    float ri;
+    int reflective;
+    int id;
+} Material;
+
+
+
 typedef struct {
     Vector direction;
     Vector origin;
@@ -91,8 +101,12 @@ typedef struct {
 
 
 typedef struct {
-    Sphere* sphere;
-    Vector n;
+    int sphere;
+    int mesh;           // Mesh and triangle hit instead of a sphere, or -1
+    int triangle;
+    int instance;       // Instance holding the surface hit, or -1
+    const Material* material;
+    Vector n;           // Found by the traversal for instances
     Vector p;
     float t;
 } Hit;
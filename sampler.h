@@ -0,0 +1,164 @@
+#include <stdint.h>
+
+// Sample generation for antialiasing and depth of field. Every sample is a
+// pure function of (pixel, sample index, dimension, seed), with no
+// generator state at all, so threads never share anything and an image is
+// bit-identical whatever thread renders which tile. Dimensions come in
+// pairs: 0-1 jitter the position on the film, 2-3 the position on the lens.
+//
+//  - random: counter-based PCG hash, one jittered sample per cell of the
+//    samples x samples grid
+//  - halton: Halton sequence (bases 2, 3, 5, 7) with nested random digit
+//    scrambling seeded per pixel
+//  - sobol:  Sobol sequence with hash-based Owen scrambling and a per-pixel
+//    shuffle of the sample order (Burley 2020)
+//
+// The two low-discrepancy samplers are well spread over the pixel after any
+// number of samples, which makes them converge faster than the grid.
+
+typedef enum {
+    SAMPLER_RANDOM,
+    SAMPLER_HALTON,
+    SAMPLER_SOBOL
+} SamplerType;
+
+const char* samplerNames[] = {"random", "halton", "sobol"};
+
+// Sampler type from its name, or -1
+int samplerFromName(const char* name) {
+    for (int i=0; i<3; i++) {
+        if (strcmp(name, samplerNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// PCG output permutation used as a hash (Jarzynski and Olano 2020)
+static inline uint32_t pcgHash(uint32_t x) {
+    uint32_t state = x * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Hash two values into one
+static inline uint32_t hashCombine(uint32_t seed, uint32_t value) {
+    return pcgHash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// Map 32 random bits to a float in [0, 1)
+static inline float bitsToFloat(uint32_t bits) {
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// Key identifying a pixel, independent of the image size
+static inline uint32_t pixelKey(int i, int j) {
+    return hashCombine(pcgHash((uint32_t)i), (uint32_t)j);
+}
+
+// Cell of the samples x samples grid for sample s. The cells are walked
+// with a stride coprime to their number, so the first few samples are
+// already spread over the pixel and any cells consecutive samples cover
+// every cell once.
+int gridCell(uint32_t s, int cells) {
+    int step = (int)(cells * 0.618f);
+    int a, b;
+
+    do {
+        step++;
+        for (a = step, b = cells; b != 0; ) {
+            int r = a % b;
+            a = b;
+            b = r;
+        }
+    } while (a != 1 && step < cells);
+
+    return (int)(((uint64_t)s * step) % cells);
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash-based Owen scrambling of the bits of x, most significant bit first
+static inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// First two dimensions of the Sobol sequence. Dimension 0 is the van der
+// Corput sequence; dimension 1 uses the primitive polynomial x + 1.
+static inline uint32_t sobol(uint32_t index, int dimension) {
+    uint32_t result = 0;
+    uint32_t v = 1u << 31;
+
+    for (; index != 0; index >>= 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+        v = (dimension == 0) ? v >> 1 : v ^ (v >> 1);
+    }
+    return result;
+}
+
+// Radical inverse of index in a prime base, with every digit shifted by a
+// hash of the digits before it (nested random digit scrambling)
+float scrambledRadicalInverse(uint32_t index, uint32_t base, uint32_t seed) {
+    float invBase = 1.0f / base;
+    float scale = invBase;
+    float result = 0;
+    uint32_t prefix = seed;
+
+    // Enough digits to fill a float mantissa
+    while (scale > 1e-7f) {
+        uint32_t digit = index % base;
+        uint32_t scrambled = (digit + hashCombine(prefix, base)) % base;
+
+        result += scrambled * scale;
+        prefix = hashCombine(prefix, digit);
+        index /= base;
+        scale *= invBase;
+    }
+    return (result < 1) ? result : 0x1.fffffep-1f;
+}
+
+// Sample s of dimensions dimension and dimension+1 for a pixel. The random
+// sampler stratifies over a gridSize x gridSize grid.
+void sample2D(SamplerType type, uint32_t pixel, uint32_t s, int dimension, uint32_t seed, int gridSize, float* u, float* v) {
+    uint32_t key = hashCombine(hashCombine(pixel, seed), (uint32_t)dimension);
+
+    switch (type) {
+        case SAMPLER_HALTON: {
+            static const uint32_t bases[] = {2, 3, 5, 7};
+            int d = dimension & 3;
+            *u = scrambledRadicalInverse(s, bases[d], hashCombine(key, 0));
+            *v = scrambledRadicalInverse(s, bases[(d+1) & 3], hashCombine(key, 1));
+            break;
+        }
+        case SAMPLER_SOBOL: {
+            // Each dimension pair gets its own shuffle of the sample order,
+            // so pairs don't correlate with each other
+            uint32_t index = owenScramble(s, hashCombine(key, 2));
+            *u = bitsToFloat(owenScramble(sobol(index, 0), hashCombine(key, 0)));
+            *v = bitsToFloat(owenScramble(sobol(index, 1), hashCombine(key, 1)));
+            break;
+        }
+        default: {
+            int n = gridSize;
+            int cell = gridCell(s, n*n);
+            uint32_t bits = hashCombine(key, s);
+            *u = ((cell / n) + bitsToFloat(bits)) / n;
+            *v = ((cell % n) + bitsToFloat(pcgHash(bits))) / n;
+            break;
+        }
+    }
+}
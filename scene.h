@@ -0,0 +1,838 @@
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Scene files. Scenes are authored in a line-based text format:
+//
+//     # comment
+//     background 0 0 0
+//     eye 5 0 0
+//     view -1 0 0
+//     up 0 0 1
+//     intensity 0.7
+//     light 0 -1 -1                          (up to 3, normalized on load)
+//     sphere x y z radius  r g b  ri reflective [id]
+//     mesh model.obj  r g b  ri reflective [id]
+//     prototype name                         (spheres, meshes and instances
+//     ...                                     up to the end line are placed
+//     end                                     only through instances)
+//     instance name  [translate x y z] [rotate ax ay az degrees]
+//                    [scale s | scale sx sy sz] [matrix m00 .. m23]
+//                    [material r g b ri reflective [id]]
+//
+// and compiled to a binary format that is loaded with mmap. The binary file
+// holds a versioned header followed by 64-byte aligned arrays laid out
+// exactly like the in-memory SphereStore (with the vector padding) and the
+// flattened BVH, so loading does no parsing or copying at all; pages are
+// only read from disk as the renderer touches them. Meshes are embedded the
+// same way, each with its own BVH.
+//
+// A mesh line names an OBJ file or a binary mesh (.rtm), relative to the
+// scene file. Binary meshes hold one mesh in the same layout as the meshes
+// embedded in binary scenes, so large models only need converting once.
+//
+// An instance places a copy of an earlier prototype, inside another
+// prototype or in the scene. Its transforms apply in the order given, so
+// "scale 2 translate 1 0 0" scales first. Instanced scenes are small by
+// nature and are only written as text.
+
+#define SCENE_MAGIC "RTSCENE"
+#define SCENE_VERSION 2
+#define MESH_MAGIC "RTMESH"
+#define MESH_VERSION 1
+#define SCENE_BYTE_ORDER 0x01020304u
+#define SCENE_ALIGN 64
+#define MAX_LIGHTS 3
+
+typedef struct {
+    Vector eye;
+    Vector view;
+    Vector up;
+    Vector lights[MAX_LIGHTS];
+    int lightCount;
+    float lightIntensity;
+    RGBf background;
+    SphereStore spheres;
+    BVH bvh;
+    Mesh* meshes;
+    int meshCount;
+    Prototype* prototypes;
+    int prototypeCount;
+    Instance* instances;
+    int instanceCount;
+    void* mapping;
+    size_t mappingSize;
+} Scene;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t headerSize;
+    uint32_t lightCount;
+    uint32_t sphereCount;
+    uint32_t nodeCount;
+    uint32_t leafSize;
+    uint32_t meshCount;
+    float eye[3];
+    float view[3];
+    float up[3];
+    float lights[MAX_LIGHTS][3];
+    float lightIntensity;
+    float background[3];
+    uint64_t cxOffset;
+    uint64_t cyOffset;
+    uint64_t czOffset;
+    uint64_t r2Offset;
+    uint64_t materialOffset;
+    uint64_t nodeOffset;
+    uint64_t meshOffset;
+    uint64_t fileSize;
+} SceneFileHeader;
+
+// Where a mesh's arrays are in a file. Offsets are from the start of the
+// file and 64-byte aligned.
+typedef struct {
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t nodeCount;
+    uint32_t leafSize;
+    uint32_t hasNormals;
+    uint32_t reserved;
+    uint64_t vertexOffset;
+    uint64_t indexOffset;
+    uint64_t normalOffset;
+    uint64_t nodeOffset;
+} MeshLayout;
+
+// A mesh embedded in a binary scene
+typedef struct {
+    Material material;
+    char source[256];
+    MeshLayout layout;
+} SceneMeshEntry;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t headerSize;
+    uint32_t reserved;
+    MeshLayout layout;
+    uint64_t fileSize;
+} MeshFileHeader;
+
+// Start a scene with the same camera and lights the renderer defaults to
+void initScene(Scene* scene) {
+    memset(scene, 0, sizeof(Scene));
+    scene->eye = newVector(5, 0, 0);
+    scene->view = newVector(-1, 0, 0);
+    scene->up = newVector(0, 0, 1);
+    scene->lightIntensity = .7;
+    scene->background = newRGB(0, 0, 0);
+}
+
+// Read n floats following a keyword, returning the number read
+int readFloats(char** cursor, float* out, int n) {
+    for (int i=0; i<n; i++) {
+        char* end;
+        out[i] = strtof(*cursor, &end);
+        if (end == *cursor) {
+            return i;
+        }
+        *cursor = end;
+    }
+    return n;
+}
+
+// Resolve a path given in a file relative to that file's directory
+void relativePath(const char* base, const char* name, char* out, size_t size) {
+    const char* slash = strrchr(base, '/');
+
+    if (name[0] == '/' || slash == NULL) {
+        snprintf(out, size, "%s", name);
+    } else {
+        snprintf(out, size, "%.*s/%s", (int)(slash - base), base, name);
+    }
+}
+
+void addMesh(Mesh** meshes, int* count, const Mesh* mesh) {
+    *meshes = realloc(*meshes, sizeof(Mesh) * (*count + 1));
+    (*meshes)[(*count)++] = *mesh;
+}
+
+void addInstance(Instance** instances, int* count, const Instance* instance) {
+    *instances = realloc(*instances, sizeof(Instance) * (*count + 1));
+    (*instances)[(*count)++] = *instance;
+}
+
+int findPrototype(const Scene* scene, const char* name) {
+    for (int i=0; i<scene->prototypeCount; i++) {
+        if (strcmp(scene->prototypes[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parse the rest of an instance line: a prototype name followed by
+// transforms and a material, each introduced by a keyword
+int parseInstance(char* cursor, const Scene* scene, int index, Instance* instance) {
+    char name[64], keyword[32];
+    float values[12], step[12];
+    int consumed = 0, n;
+
+    memset(instance, 0, sizeof(*instance));
+    identityTransform(instance->m);
+    if (sscanf(cursor, " %63s%n", name, &consumed) != 1 || (instance->prototype = findPrototype(scene, name)) < 0) {
+        return -1;
+    }
+    cursor += consumed;
+
+    while (sscanf(cursor, " %31s%n", keyword, &consumed) == 1) {
+        cursor += consumed;
+        identityTransform(step);
+        if (strcmp(keyword, "translate") == 0) {
+            if (readFloats(&cursor, values, 3) != 3) {
+                return -1;
+            }
+            step[3] = values[0];
+            step[7] = values[1];
+            step[11] = values[2];
+        } else if (strcmp(keyword, "rotate") == 0) {
+            if (readFloats(&cursor, values, 4) != 4 ||
+                rotationTransform(newVector(values[0], values[1], values[2]), values[3], step) != 0) {
+                return -1;
+            }
+        } else if (strcmp(keyword, "scale") == 0) {
+            n = readFloats(&cursor, values, 3);
+            if (n != 1 && n != 3) {
+                return -1;
+            }
+            step[0] = values[0];
+            step[5] = values[n == 3 ? 1 : 0];
+            step[10] = values[n == 3 ? 2 : 0];
+        } else if (strcmp(keyword, "matrix") == 0) {
+            if (readFloats(&cursor, step, 12) != 12) {
+                return -1;
+            }
+        } else if (strcmp(keyword, "material") == 0) {
+            n = readFloats(&cursor, values, 6);
+            if (n < 5) {
+                return -1;
+            }
+            instance->hasMaterial = 1;
+            instance->material.color = newRGB(values[0], values[1], values[2]);
+            instance->material.ri = values[3];
+            instance->material.reflective = (int)values[4];
+            instance->material.id = (n == 6) ? (int)values[5] : index;
+            continue;
+        } else {
+            return -1;
+        }
+        multiplyTransform(step, instance->m, instance->m);
+    }
+    return invertTransform(instance->m, instance->inv);
+}
+
+int loadMesh(const char* path, Mesh* mesh);
+
+// Parse a text scene. Returns 0 on success or -1 after printing an error.
+int loadSceneText(const char* path, Scene* scene) {
+    FILE* in = fopen(path, "r");
+    char line[1024];
+    int lineNumber = 0;
+    // The prototype being defined, if any
+    Prototype prototype;
+    int inPrototype = 0;
+
+    if (in == NULL) {
+        fprintf(stderr, "Unable to open scene %s\n", path);
+        return -1;
+    }
+
+    initScene(scene);
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char keyword[32];
+        char* cursor = line;
+        float values[10];
+        int consumed = 0;
+        int n;
+
+        lineNumber++;
+        if (sscanf(line, " %31s%n", keyword, &consumed) != 1 || keyword[0] == '#') {
+            continue;
+        }
+        cursor += consumed;
+
+        SphereStore* store = inPrototype ? &prototype.spheres : &scene->spheres;
+        Mesh** meshList = inPrototype ? &prototype.meshes : &scene->meshes;
+        int* meshTotal = inPrototype ? &prototype.meshCount : &scene->meshCount;
+        Instance** instanceList = inPrototype ? &prototype.instances : &scene->instances;
+        int* instanceTotal = inPrototype ? &prototype.instanceCount : &scene->instanceCount;
+
+        if (strcmp(keyword, "sphere") == 0) {
+            n = readFloats(&cursor, values, 10);
+            if (n < 9) {
+                goto error;
+            }
+            Sphere sphere;
+            sphere.c = newVector(values[0], values[1], values[2]);
+            sphere.r = values[3];
+            sphere.color = newRGB(values[4], values[5], values[6]);
+            sphere.ri = values[7];
+            sphere.reflective = (int)values[8];
+            sphere.id = (n == 10) ? (int)values[9] : store->count;
+            addSphere(store, sphere);
+        } else if (strcmp(keyword, "mesh") == 0) {
+            char name[256], file[512];
+            Mesh mesh;
+
+            if (sscanf(cursor, " %255s%n", name, &consumed) != 1) {
+                goto error;
+            }
+            cursor += consumed;
+            n = readFloats(&cursor, values, 6);
+            if (n < 5) {
+                goto error;
+            }
+            relativePath(path, name, file, sizeof(file));
+            if (loadMesh(file, &mesh) != 0) {
+                fclose(in);
+                return -1;
+            }
+            mesh.material.color = newRGB(values[0], values[1], values[2]);
+            mesh.material.ri = values[3];
+            mesh.material.reflective = (int)values[4];
+            mesh.material.id = (n == 6) ? (int)values[5] : *meshTotal;
+            addMesh(meshList, meshTotal, &mesh);
+        } else if (strcmp(keyword, "instance") == 0) {
+            Instance instance;
+            if (parseInstance(cursor, scene, *instanceTotal, &instance) != 0) {
+                goto error;
+            }
+            addInstance(instanceList, instanceTotal, &instance);
+        } else if (strcmp(keyword, "prototype") == 0) {
+            memset(&prototype, 0, sizeof(prototype));
+            if (inPrototype || sscanf(cursor, " %63s", prototype.name) != 1 || findPrototype(scene, prototype.name) >= 0) {
+                goto error;
+            }
+            inPrototype = 1;
+        } else if (strcmp(keyword, "end") == 0) {
+            if (!inPrototype) {
+                goto error;
+            }
+            if (prototype.spheres.count == 0 && prototype.meshCount == 0 && prototype.instanceCount == 0) {
+                fprintf(stderr, "%s:%d: prototype %s is empty\n", path, lineNumber, prototype.name);
+                fclose(in);
+                return -1;
+            }
+            scene->prototypes = realloc(scene->prototypes, sizeof(Prototype) * (scene->prototypeCount + 1));
+            scene->prototypes[scene->prototypeCount++] = prototype;
+            inPrototype = 0;
+        } else if (strcmp(keyword, "light") == 0) {
+            if (readFloats(&cursor, values, 3) != 3 || scene->lightCount == MAX_LIGHTS) {
+                goto error;
+            }
+            scene->lights[scene->lightCount++] = newVector(values[0], values[1], values[2]);
+        } else if (strcmp(keyword, "eye") == 0 || strcmp(keyword, "view") == 0 || strcmp(keyword, "up") == 0) {
+            if (readFloats(&cursor, values, 3) != 3) {
+                goto error;
+            }
+            Vector* target = (keyword[0] == 'e') ? &scene->eye : (keyword[0] == 'v') ? &scene->view : &scene->up;
+            *target = newVector(values[0], values[1], values[2]);
+        } else if (strcmp(keyword, "background") == 0) {
+            if (readFloats(&cursor, values, 3) != 3) {
+                goto error;
+            }
+            scene->background = newRGB(values[0], values[1], values[2]);
+        } else if (strcmp(keyword, "intensity") == 0) {
+            if (readFloats(&cursor, values, 1) != 1) {
+                goto error;
+            }
+            scene->lightIntensity = values[0];
+        } else {
+            goto error;
+        }
+    }
+
+    fclose(in);
+    if (inPrototype) {
+        fprintf(stderr, "%s: prototype %s has no end line\n", path, prototype.name);
+        return -1;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "%s:%d: invalid scene line: %s", path, lineNumber, line);
+    fclose(in);
+    return -1;
+}
+
+void writeSpheresText(FILE* out, const SphereStore* s) {
+    for (int i=0; i<s->count; i++) {
+        const Material* m = &s->materials[i];
+        fprintf(out, "sphere %.9g %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %d %d\n",
+                s->cx[i], s->cy[i], s->cz[i], sqrtf(s->r2[i]),
+                m->color.r, m->color.g, m->color.b, m->ri, m->reflective, m->id);
+    }
+}
+
+void writeMeshesText(FILE* out, const Mesh* meshes, int count) {
+    for (int i=0; i<count; i++) {
+        const Material* m = &meshes[i].material;
+        fprintf(out, "mesh %s  %.9g %.9g %.9g  %.9g %d %d\n", meshes[i].source,
+                m->color.r, m->color.g, m->color.b, m->ri, m->reflective, m->id);
+    }
+}
+
+// Instances are written with their combined transform
+void writeInstancesText(FILE* out, const Instance* instances, int count, const Prototype* prototypes) {
+    for (int i=0; i<count; i++) {
+        const Instance* instance = &instances[i];
+        fprintf(out, "instance %s matrix", prototypes[instance->prototype].name);
+        for (int k=0; k<12; k++) {
+            fprintf(out, " %.9g", instance->m[k]);
+        }
+        if (instance->hasMaterial) {
+            const Material* m = &instance->material;
+            fprintf(out, " material %.9g %.9g %.9g %.9g %d %d",
+                    m->color.r, m->color.g, m->color.b, m->ri, m->reflective, m->id);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+// Write a scene in the text format
+int saveSceneText(const char* path, const Scene* scene) {
+    FILE* out = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+
+    if (out == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", path);
+        return -1;
+    }
+
+    fprintf(out, "background %.9g %.9g %.9g\n", scene->background.r, scene->background.g, scene->background.b);
+    fprintf(out, "eye %.9g %.9g %.9g\n", scene->eye.x, scene->eye.y, scene->eye.z);
+    fprintf(out, "view %.9g %.9g %.9g\n", scene->view.x, scene->view.y, scene->view.z);
+    fprintf(out, "up %.9g %.9g %.9g\n", scene->up.x, scene->up.y, scene->up.z);
+    fprintf(out, "intensity %.9g\n", scene->lightIntensity);
+    for (int i=0; i<scene->lightCount; i++) {
+        fprintf(out, "light %.9g %.9g %.9g\n", scene->lights[i].x, scene->lights[i].y, scene->lights[i].z);
+    }
+    writeSpheresText(out, &scene->spheres);
+    writeMeshesText(out, scene->meshes, scene->meshCount);
+    for (int i=0; i<scene->prototypeCount; i++) {
+        const Prototype* prototype = &scene->prototypes[i];
+        fprintf(out, "prototype %s\n", prototype->name);
+        writeSpheresText(out, &prototype->spheres);
+        writeMeshesText(out, prototype->meshes, prototype->meshCount);
+        writeInstancesText(out, prototype->instances, prototype->instanceCount, scene->prototypes);
+        fprintf(out, "end\n");
+    }
+    writeInstancesText(out, scene->instances, scene->instanceCount, scene->prototypes);
+
+    if (out == stdout) {
+        fflush(out);
+        return ferror(out) ? -1 : 0;
+    }
+    return (fclose(out) == 0) ? 0 : -1;
+}
+
+// Round a file offset up to the array alignment
+uint64_t alignOffset(uint64_t offset) {
+    return (offset + SCENE_ALIGN - 1) / SCENE_ALIGN * SCENE_ALIGN;
+}
+
+// Write one array at its offset, zero-filling the gap before it
+int writeAt(FILE* out, uint64_t* position, uint64_t offset, const void* data, size_t size) {
+    static const char zeros[SCENE_ALIGN] = {0};
+
+    while (*position < offset) {
+        size_t gap = (offset - *position < SCENE_ALIGN) ? offset - *position : SCENE_ALIGN;
+        fwrite(zeros, 1, gap, out);
+        *position += gap;
+    }
+    if (size > 0) {
+        fwrite(data, 1, size, out);
+    }
+    *position += size;
+    return ferror(out) ? -1 : 0;
+}
+
+// Lay out a mesh's arrays from offset on. Returns the end of the last one.
+uint64_t layoutMesh(const Mesh* mesh, MeshLayout* layout, uint64_t offset) {
+    memset(layout, 0, sizeof(*layout));
+    layout->vertexCount = mesh->vertexCount;
+    layout->triangleCount = mesh->triangleCount;
+    layout->nodeCount = mesh->bvh.nodeCount;
+    layout->leafSize = mesh->bvh.maxLeafSize;
+    layout->hasNormals = mesh->normals != NULL;
+    layout->vertexOffset = alignOffset(offset);
+    layout->indexOffset = alignOffset(layout->vertexOffset + sizeof(float) * 3 * mesh->vertexCount);
+    layout->normalOffset = alignOffset(layout->indexOffset + sizeof(uint32_t) * 3 * mesh->triangleCount);
+    layout->nodeOffset = alignOffset(layout->normalOffset + (layout->hasNormals ? sizeof(int16_t) * 2 * mesh->vertexCount : 0));
+    return layout->nodeOffset + sizeof(BVHNode) * layout->nodeCount;
+}
+
+int writeMesh(FILE* out, uint64_t* position, const Mesh* mesh, const MeshLayout* layout) {
+    int result = writeAt(out, position, layout->vertexOffset, mesh->vertices, sizeof(float) * 3 * mesh->vertexCount);
+    result |= writeAt(out, position, layout->indexOffset, mesh->indices, sizeof(uint32_t) * 3 * mesh->triangleCount);
+    if (layout->hasNormals) {
+        result |= writeAt(out, position, layout->normalOffset, mesh->normals, sizeof(int16_t) * 2 * mesh->vertexCount);
+    }
+    result |= writeAt(out, position, layout->nodeOffset, mesh->bvh.nodes, sizeof(BVHNode) * layout->nodeCount);
+    return result;
+}
+
+// Compile a scene to the binary format. The BVH is built here if the scene
+// doesn't have one yet, which also puts the spheres in BVH order.
+int saveSceneBinary(const char* path, Scene* scene, int leafSize) {
+    SphereStore* s = &scene->spheres;
+    SceneFileHeader header;
+    FILE* out;
+    uint64_t position = 0;
+    // Float arrays keep the SPHERE_LANES slack the vector kernels read past the end
+    size_t floatBytes = sizeof(float) * (s->count + SPHERE_LANES);
+
+    if (scene->prototypeCount > 0) {
+        fprintf(stderr, "Scenes with instances can only be saved as text\n");
+        return -1;
+    }
+    if (scene->bvh.count != s->count || scene->bvh.nodes == NULL) {
+        buildSphereBVH(&scene->bvh, s, leafSize);
+    }
+    for (int i=0; i<scene->meshCount; i++) {
+        if (scene->meshes[i].bvh.nodes == NULL) {
+            buildMeshBVH(&scene->meshes[i], leafSize);
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    header.byteOrder = SCENE_BYTE_ORDER;
+    header.headerSize = sizeof(header);
+    header.lightCount = scene->lightCount;
+    header.sphereCount = s->count;
+    header.nodeCount = scene->bvh.nodeCount;
+    header.leafSize = scene->bvh.maxLeafSize;
+    header.meshCount = scene->meshCount;
+    memcpy(header.eye, &scene->eye, sizeof(header.eye));
+    memcpy(header.view, &scene->view, sizeof(header.view));
+    memcpy(header.up, &scene->up, sizeof(header.up));
+    memcpy(header.lights, scene->lights, sizeof(Vector) * scene->lightCount);
+    header.lightIntensity = scene->lightIntensity;
+    memcpy(header.background, &scene->background, sizeof(header.background));
+
+    header.cxOffset = alignOffset(sizeof(header));
+    header.cyOffset = alignOffset(header.cxOffset + floatBytes);
+    header.czOffset = alignOffset(header.cyOffset + floatBytes);
+    header.r2Offset = alignOffset(header.czOffset + floatBytes);
+    header.materialOffset = alignOffset(header.r2Offset + floatBytes);
+    header.nodeOffset = alignOffset(header.materialOffset + sizeof(Material) * s->count);
+    header.meshOffset = alignOffset(header.nodeOffset + sizeof(BVHNode) * header.nodeCount);
+
+    SceneMeshEntry* entries = calloc(scene->meshCount > 0 ? scene->meshCount : 1, sizeof(SceneMeshEntry));
+    uint64_t end = header.meshOffset + sizeof(SceneMeshEntry) * scene->meshCount;
+    for (int i=0; i<scene->meshCount; i++) {
+        entries[i].material = scene->meshes[i].material;
+        snprintf(entries[i].source, sizeof(entries[i].source), "%s", scene->meshes[i].source);
+        end = layoutMesh(&scene->meshes[i], &entries[i].layout, end);
+    }
+    header.fileSize = end;
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", path);
+        free(entries);
+        return -1;
+    }
+
+    int result = writeAt(out, &position, 0, &header, sizeof(header));
+    result |= writeAt(out, &position, header.cxOffset, s->cx, floatBytes);
+    result |= writeAt(out, &position, header.cyOffset, s->cy, floatBytes);
+    result |= writeAt(out, &position, header.czOffset, s->cz, floatBytes);
+    result |= writeAt(out, &position, header.r2Offset, s->r2, floatBytes);
+    result |= writeAt(out, &position, header.materialOffset, s->materials, sizeof(Material) * s->count);
+    result |= writeAt(out, &position, header.nodeOffset, scene->bvh.nodes, sizeof(BVHNode) * header.nodeCount);
+    result |= writeAt(out, &position, header.meshOffset, entries, sizeof(SceneMeshEntry) * scene->meshCount);
+    for (int i=0; i<scene->meshCount; i++) {
+        result |= writeMesh(out, &position, &scene->meshes[i], &entries[i].layout);
+    }
+    free(entries);
+
+    if (fclose(out) != 0 || result != 0) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Check that an array described by a header lies inside the file
+int inFile(uint64_t fileSize, uint64_t offset, uint64_t size) {
+    return offset % SCENE_ALIGN == 0 && offset <= fileSize && size <= fileSize - offset;
+}
+
+// Point a mesh at its arrays in a mapped file. Returns -1 if the layout
+// doesn't fit in the file or a triangle uses a vertex it doesn't have. A
+// damaged BVH is left out so applyScene builds a new one.
+int mapMesh(const char* base, uint64_t fileSize, const MeshLayout* layout, Mesh* mesh, const char* path) {
+    if (layout->vertexCount > INT32_MAX / 3 || layout->triangleCount > INT32_MAX / 3 || layout->nodeCount > INT32_MAX ||
+        !inFile(fileSize, layout->vertexOffset, sizeof(float) * 3 * (uint64_t)layout->vertexCount) ||
+        !inFile(fileSize, layout->indexOffset, sizeof(uint32_t) * 3 * (uint64_t)layout->triangleCount) ||
+        (layout->hasNormals && !inFile(fileSize, layout->normalOffset, sizeof(int16_t) * 2 * (uint64_t)layout->vertexCount)) ||
+        !inFile(fileSize, layout->nodeOffset, sizeof(BVHNode) * (uint64_t)layout->nodeCount)) {
+        return -1;
+    }
+
+    const uint32_t* indices = (const uint32_t*)(base + layout->indexOffset);
+    for (uint64_t i=0; i<3 * (uint64_t)layout->triangleCount; i++) {
+        if (indices[i] >= layout->vertexCount) {
+            return -1;
+        }
+    }
+
+    const BVHNode* nodes = (const BVHNode*)(base + layout->nodeOffset);
+    if (layout->nodeCount > 0 && checkBVH(nodes, layout->nodeCount, layout->triangleCount) != 0) {
+        fprintf(stderr, "%s has a damaged mesh BVH, rebuilding it\n", path);
+        nodes = NULL;
+    }
+
+    mesh->vertices = (float*)(base + layout->vertexOffset);
+    mesh->indices = (uint32_t*)(base + layout->indexOffset);
+    mesh->normals = layout->hasNormals ? (int16_t*)(base + layout->normalOffset) : NULL;
+    mesh->vertexCount = layout->vertexCount;
+    mesh->triangleCount = layout->triangleCount;
+    mesh->mapped = 1;
+    if (layout->nodeCount > 0 && nodes != NULL) {
+        mesh->bvh.nodes = (BVHNode*)nodes;
+        mesh->bvh.nodeCount = layout->nodeCount;
+        mesh->bvh.count = layout->triangleCount;
+        mesh->bvh.maxLeafSize = layout->leafSize;
+        mesh->bvh.mapped = 1;
+    }
+    return 0;
+}
+
+// Map a binary scene. The sphere store and BVH point straight into the
+// mapping, which stays alive for the rest of the run.
+int loadSceneBinary(const char* path, Scene* scene) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    void* mapping;
+    const SceneFileHeader* header;
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Unable to open scene %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if ((size_t)info.st_size < sizeof(SceneFileHeader)) {
+        fprintf(stderr, "%s is too small to be a scene\n", path);
+        close(fd);
+        return -1;
+    }
+
+    mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Unable to map scene %s\n", path);
+        return -1;
+    }
+
+    header = mapping;
+    size_t floatBytes = sizeof(float) * ((size_t)header->sphereCount + SPHERE_LANES);
+    if (memcmp(header->magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0 || header->version != SCENE_VERSION ||
+        header->byteOrder != SCENE_BYTE_ORDER || header->headerSize != sizeof(SceneFileHeader) ||
+        header->fileSize > (uint64_t)info.st_size || header->lightCount > MAX_LIGHTS ||
+        header->sphereCount > INT32_MAX ||
+        !inFile(header->fileSize, header->cxOffset, floatBytes) || !inFile(header->fileSize, header->cyOffset, floatBytes) ||
+        !inFile(header->fileSize, header->czOffset, floatBytes) || !inFile(header->fileSize, header->r2Offset, floatBytes) ||
+        !inFile(header->fileSize, header->materialOffset, sizeof(Material) * header->sphereCount) ||
+        !inFile(header->fileSize, header->nodeOffset, sizeof(BVHNode) * header->nodeCount) ||
+        !inFile(header->fileSize, header->meshOffset, sizeof(SceneMeshEntry) * (uint64_t)header->meshCount)) {
+        fprintf(stderr, "%s is not a compatible binary scene (version %d expected)\n", path, SCENE_VERSION);
+        munmap(mapping, info.st_size);
+        return -1;
+    }
+
+    initScene(scene);
+    scene->mapping = mapping;
+    scene->mappingSize = info.st_size;
+    scene->eye = newVector(header->eye[0], header->eye[1], header->eye[2]);
+    scene->view = newVector(header->view[0], header->view[1], header->view[2]);
+    scene->up = newVector(header->up[0], header->up[1], header->up[2]);
+    scene->lightCount = header->lightCount;
+    for (int i=0; i<scene->lightCount; i++) {
+        scene->lights[i] = newVector(header->lights[i][0], header->lights[i][1], header->lights[i][2]);
+    }
+    scene->lightIntensity = header->lightIntensity;
+    scene->background = newRGB(header->background[0], header->background[1], header->background[2]);
+
+    const char* base = mapping;
+    SphereStore* s = &scene->spheres;
+    s->cx = (float*)(base + header->cxOffset);
+    s->cy = (float*)(base + header->cyOffset);
+    s->cz = (float*)(base + header->czOffset);
+    s->r2 = (float*)(base + header->r2Offset);
+    s->materials = (Material*)(base + header->materialOffset);
+    s->count = s->capacity = header->sphereCount;
+    s->mapped = 1;
+
+    // A damaged tree is left out, so applyScene builds a new one
+    const BVHNode* nodes = (const BVHNode*)(base + header->nodeOffset);
+    if (header->nodeCount > 0 && (header->nodeCount > INT32_MAX || checkBVH(nodes, header->nodeCount, header->sphereCount) != 0)) {
+        fprintf(stderr, "%s has a damaged BVH, rebuilding it\n", path);
+    } else if (header->nodeCount > 0) {
+        scene->bvh.nodes = (BVHNode*)nodes;
+        scene->bvh.nodeCount = header->nodeCount;
+        scene->bvh.count = header->sphereCount;
+        scene->bvh.maxLeafSize = header->leafSize;
+        scene->bvh.mapped = 1;
+    }
+
+    const SceneMeshEntry* entries = (const SceneMeshEntry*)(base + header->meshOffset);
+    scene->meshes = calloc(header->meshCount > 0 ? header->meshCount : 1, sizeof(Mesh));
+    for (uint32_t i=0; i<header->meshCount; i++) {
+        Mesh* mesh = &scene->meshes[i];
+        mesh->material = entries[i].material;
+        snprintf(mesh->source, sizeof(mesh->source), "%.*s", (int)sizeof(entries[i].source), entries[i].source);
+        if (mapMesh(base, header->fileSize, &entries[i].layout, mesh, path) != 0) {
+            fprintf(stderr, "%s has a damaged mesh table\n", path);
+            free(scene->meshes);
+            munmap(scene->mapping, scene->mappingSize);
+            initScene(scene);
+            return -1;
+        }
+        scene->meshCount++;
+    }
+    return 0;
+}
+
+// Write a mesh in the binary mesh format, building its BVH if needed
+int saveMeshBinary(const char* path, Mesh* mesh, int leafSize) {
+    MeshFileHeader header;
+    uint64_t position = 0;
+    FILE* out;
+
+    if (mesh->bvh.nodes == NULL) {
+        buildMeshBVH(mesh, leafSize);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+    header.version = MESH_VERSION;
+    header.byteOrder = SCENE_BYTE_ORDER;
+    header.headerSize = sizeof(header);
+    header.fileSize = layoutMesh(mesh, &header.layout, sizeof(header));
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", path);
+        return -1;
+    }
+    int result = writeAt(out, &position, 0, &header, sizeof(header));
+    result |= writeMesh(out, &position, mesh, &header.layout);
+    if (fclose(out) != 0 || result != 0) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Map a binary mesh. Like a binary scene, the mapping is never released.
+int loadMeshBinary(const char* path, Mesh* mesh) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    void* mapping;
+
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(MeshFileHeader)) {
+        fprintf(stderr, "Unable to open mesh %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Unable to map mesh %s\n", path);
+        return -1;
+    }
+
+    const MeshFileHeader* header = mapping;
+    memset(mesh, 0, sizeof(*mesh));
+    if (memcmp(header->magic, MESH_MAGIC, sizeof(MESH_MAGIC)) != 0 || header->version != MESH_VERSION ||
+        header->byteOrder != SCENE_BYTE_ORDER || header->headerSize != sizeof(MeshFileHeader) ||
+        header->fileSize > (uint64_t)info.st_size || mapMesh(mapping, header->fileSize, &header->layout, mesh, path) != 0) {
+        fprintf(stderr, "%s is not a compatible binary mesh (version %d expected)\n", path, MESH_VERSION);
+        munmap(mapping, info.st_size);
+        return -1;
+    }
+    snprintf(mesh->source, sizeof(mesh->source), "%s", path);
+    return 0;
+}
+
+// Load an OBJ or binary mesh, telling them apart by the magic number
+int loadMesh(const char* path, Mesh* mesh) {
+    char magic[8] = {0};
+    FILE* in = fopen(path, "rb");
+
+    if (in == NULL) {
+        fprintf(stderr, "Unable to open mesh %s\n", path);
+        return -1;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), in);
+    fclose(in);
+
+    if (n == sizeof(magic) && memcmp(magic, MESH_MAGIC, sizeof(MESH_MAGIC)) == 0) {
+        return loadMeshBinary(path, mesh);
+    }
+    return loadOBJ(path, mesh);
+}
+
+// Load a scene file, telling the formats apart by the magic number
+int loadScene(const char* path, Scene* scene) {
+    char magic[8] = {0};
+    FILE* in = fopen(path, "rb");
+
+    if (in == NULL) {
+        fprintf(stderr, "Unable to open scene %s\n", path);
+        return -1;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), in);
+    fclose(in);
+
+    if (n == sizeof(magic) && memcmp(magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) == 0) {
+        return loadSceneBinary(path, scene);
+    }
+    return loadSceneText(path, scene);
+}
+
+// Convert a scene between the two formats. Output names ending in .rtb get
+// the binary format, anything else the text format. An output ending in
+// .rtm converts a mesh instead, and reports its memory use.
+int convertScene(const char* input, const char* output, int leafSize) {
+    Scene scene;
+    const char* ext = strrchr(output, '.');
+
+    if (ext != NULL && strcmp(ext, ".rtm") == 0) {
+        Mesh mesh;
+        if (loadMesh(input, &mesh) != 0 || saveMeshBinary(output, &mesh, leafSize) != 0) {
+            return -1;
+        }
+        printMeshStats(stderr, &mesh);
+        return 0;
+    }
+    if (loadScene(input, &scene) != 0) {
+        return -1;
+    }
+    if (ext != NULL && strcmp(ext, ".rtb") == 0) {
+        return saveSceneBinary(output, &scene, leafSize);
+    }
+    return saveSceneText(output, &scene);
+}
@@ -0,0 +1,267 @@
+// Occluder grids for directional lights. Every shadow ray toward a light
+// has the same direction, so whether a sphere can block it only depends on
+// where the ray starts in the plane perpendicular to the light. Each
+// light's grid projects the spheres onto that plane and lists every sphere
+// under the cells its disc covers. A shadow query then looks at the one
+// cell below its origin, where the spheres are sorted by how far along the
+// light they reach, so those entirely behind the origin are skipped with a
+// binary search.
+//
+// The entries also keep the projected centers, so a sphere the ray passes
+// beside is rejected in the plane before the full intersection test. That
+// is cheaper, and for spheres far down the ray more precise: the quadratic
+// loses most of its digits there and can report grazing hits the BVH's
+// box tests would have culled. The occluder caches in front of the grid
+// use the same test (gridSphereBlocks), so whether a ray is blocked never
+// depends on which sphere happens to be cached. Images can still differ
+// from --no-shadow-grid in those grazing cases.
+
+#define SHADOW_GRID_CELLS_PER_SPHERE 1
+#define SHADOW_GRID_MAX_CELLS (1 << 22)
+// Coarsen the grid while spheres cover more cells than this on average
+#define SHADOW_GRID_MAX_COVERAGE 8
+
+typedef struct {
+    float u;            // Projected center
+    float v;
+    float far;          // Distance along the light direction to the back of the sphere
+    int sphere;
+} ShadowGridEntry;
+
+typedef struct {
+    Vector direction;   // Direction of the shadow rays
+    Vector axisU;
+    Vector axisV;
+    float minU;
+    float minV;
+    float invCell;      // Cells per unit in the plane
+    int cellsU;
+    int cellsV;
+    int* cellStart;     // First entry of every cell, plus the end
+    ShadowGridEntry* entries;
+    int entryCount;
+    double buildMs;
+} ShadowGrid;
+
+void freeShadowGrid(ShadowGrid* grid) {
+    free(grid->cellStart);
+    free(grid->entries);
+    memset(grid, 0, sizeof(*grid));
+}
+
+int compareShadowEntries(const void* a, const void* b) {
+    float fa = ((const ShadowGridEntry*)a)->far, fb = ((const ShadowGridEntry*)b)->far;
+    return (fa > fb) - (fa < fb);
+}
+
+// Position of a point in the grid's plane. The build and the queries both
+// project through here so a center always lands on the same coordinates.
+static inline void shadowGridProject(const ShadowGrid* grid, Vector p, float* u, float* v) {
+    *u = dot(p, grid->axisU);
+    *v = dot(p, grid->axisV);
+}
+
+// Range of cells a projected disc covers along one axis
+static inline void shadowGridSpan(float center, float radius, float min, float invCell, int cells, int* first, int* last) {
+    *first = (int)((center - radius - min) * invCell);
+    *last = (int)((center + radius - min) * invCell);
+    *first = (*first < 0) ? 0 : *first;
+    *last = (*last >= cells) ? cells - 1 : *last;
+}
+
+// Build the grid of the spheres in a store for shadow rays travelling along
+// direction, which must be a unit vector
+void buildShadowGrid(ShadowGrid* grid, const SphereStore* store, Vector direction) {
+    struct timespec start, end;
+    int count = store->count;
+    float* u = malloc(sizeof(float) * (count > 0 ? count : 1));
+    float* v = malloc(sizeof(float) * (count > 0 ? count : 1));
+    float* radius = malloc(sizeof(float) * (count > 0 ? count : 1));
+    float maxU = -INFINITY, maxV = -INFINITY;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    freeShadowGrid(grid);
+    grid->direction = direction;
+
+    // Any two axes perpendicular to the light and each other
+    Vector helper = (fabsf(direction.x) < 0.5f) ? newVector(1, 0, 0) : newVector(0, 1, 0);
+    grid->axisU = cross(direction, helper);
+    grid->axisU = scaleVector(1/mag(grid->axisU), grid->axisU);
+    grid->axisV = cross(direction, grid->axisU);
+
+    grid->minU = grid->minV = INFINITY;
+    for (int i=0; i<count; i++) {
+        shadowGridProject(grid, sphereCenter(store, i), &u[i], &v[i]);
+        // Widened a little so rounding can't drop a sphere from a cell
+        radius[i] = sqrtf(store->r2[i]);
+        radius[i] += 1e-4f * (radius[i] + fabsf(u[i]) + fabsf(v[i]));
+        grid->minU = minf(grid->minU, u[i] - radius[i]);
+        grid->minV = minf(grid->minV, v[i] - radius[i]);
+        maxU = maxf(maxU, u[i] + radius[i]);
+        maxV = maxf(maxV, v[i] + radius[i]);
+    }
+
+    // Square cells, about SHADOW_GRID_CELLS_PER_SPHERE per sphere to begin with
+    double width = (count > 0) ? maxU - grid->minU : 1, height = (count > 0) ? maxV - grid->minV : 1;
+    double cells = (double)SHADOW_GRID_CELLS_PER_SPHERE * (count > 0 ? count : 1);
+    cells = (cells > SHADOW_GRID_MAX_CELLS) ? SHADOW_GRID_MAX_CELLS : cells;
+    double cellSize = sqrt(width * height / cells);
+    if (!(cellSize > 0)) {
+        cellSize = (width > height ? width : height) / sqrt(cells);
+        cellSize = (cellSize > 0) ? cellSize : 1;
+    }
+
+    for (;;) {
+        double total = 0;
+
+        if ((floor(width / cellSize) + 1) * (floor(height / cellSize) + 1) > SHADOW_GRID_MAX_CELLS) {
+            cellSize *= 2;
+            continue;
+        }
+        grid->invCell = 1 / cellSize;
+        grid->cellsU = (int)(width / cellSize) + 1;
+        grid->cellsV = (int)(height / cellSize) + 1;
+        for (int i=0; i<count; i++) {
+            int u0, u1, v0, v1;
+            shadowGridSpan(u[i], radius[i], grid->minU, grid->invCell, grid->cellsU, &u0, &u1);
+            shadowGridSpan(v[i], radius[i], grid->minV, grid->invCell, grid->cellsV, &v0, &v1);
+            total += (double)(u1 - u0 + 1) * (v1 - v0 + 1);
+        }
+        if (total <= (double)SHADOW_GRID_MAX_COVERAGE * count + (double)grid->cellsU * grid->cellsV) {
+            grid->entryCount = (int)total;
+            break;
+        }
+        cellSize *= 2;
+    }
+
+    int cellCount = grid->cellsU * grid->cellsV;
+    grid->cellStart = calloc(cellCount + 1, sizeof(int));
+    grid->entries = malloc(sizeof(ShadowGridEntry) * (grid->entryCount > 0 ? grid->entryCount : 1));
+
+    // Count the entries of every cell, turn the counts into offsets and fill
+    // the cells in, reusing cellStart[c+1] as the fill position of cell c
+    for (int pass=0; pass<2; pass++) {
+        for (int i=0; i<count; i++) {
+            int u0, u1, v0, v1;
+            float depth = dot(sphereCenter(store, i), direction);
+            float far = depth + radius[i] + 1e-4f * fabsf(depth);
+
+            shadowGridSpan(u[i], radius[i], grid->minU, grid->invCell, grid->cellsU, &u0, &u1);
+            shadowGridSpan(v[i], radius[i], grid->minV, grid->invCell, grid->cellsV, &v0, &v1);
+            for (int cv=v0; cv<=v1; cv++) {
+                for (int cu=u0; cu<=u1; cu++) {
+                    int cell = cv * grid->cellsU + cu;
+                    if (pass == 0) {
+                        grid->cellStart[cell + 1]++;
+                    } else {
+                        ShadowGridEntry* entry = &grid->entries[grid->cellStart[cell + 1]++];
+                        entry->u = u[i];
+                        entry->v = v[i];
+                        entry->far = far;
+                        entry->sphere = i;
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            // Exclusive prefix sum shifted by one cell
+            int sum = 0;
+            for (int c=0; c<cellCount; c++) {
+                int n = grid->cellStart[c + 1];
+                grid->cellStart[c + 1] = sum;
+                sum += n;
+            }
+        }
+    }
+
+    for (int c=0; c<cellCount; c++) {
+        int first = grid->cellStart[c], n = grid->cellStart[c + 1] - first;
+        if (n > 1) {
+            qsort(&grid->entries[first], n, sizeof(ShadowGridEntry), compareShadowEntries);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    grid->buildMs = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    free(u);
+    free(v);
+    free(radius);
+}
+
+// Whether a sphere whose center projects to (su, sv) blocks a shadow ray
+// along the grid's direction whose origin projects to (u, v), before tMax
+static inline int gridSphereBlocks(const SphereStore* store, const Ray* ray, float u, float v,
+                                   float su, float sv, int sphere, float tMax) {
+    float du = su - u, dv = sv - v;
+
+    if (du*du + dv*dv >= store->r2[sphere]) {
+        return 0;
+    }
+    float t = calcIntersection(ray, store, sphere);
+    return t > 0 && t < tMax;
+}
+
+// gridSphereBlocks for a sphere known by its index, as the occluder caches
+// have it
+int gridCachedBlocks(const ShadowGrid* grid, const SphereStore* store, const Ray* ray, int sphere, float tMax) {
+    float u, v, su, sv;
+
+    shadowGridProject(grid, ray->origin, &u, &v);
+    shadowGridProject(grid, sphereCenter(store, sphere), &su, &sv);
+    return gridSphereBlocks(store, ray, u, v, su, sv, sphere, tMax);
+}
+
+// Any-hit query for a shadow ray along the grid's direction: returns a
+// sphere hit with 0 < t < tMax, or -1
+int gridAnySphere(const ShadowGrid* grid, const SphereStore* store, const Ray* ray, float tMax) {
+    float u, v;
+
+    if (grid->entryCount == 0) {
+        return -1;
+    }
+    shadowGridProject(grid, ray->origin, &u, &v);
+
+    // Compared as floats, so origins far outside can't overflow the cell index
+    float fu = floorf((u - grid->minU) * grid->invCell);
+    float fv = floorf((v - grid->minV) * grid->invCell);
+    if (!(fu >= 0 && fv >= 0 && fu < grid->cellsU && fv < grid->cellsV)) {
+        return -1;
+    }
+    int cu = (int)fu, cv = (int)fv;
+
+    // Skip the spheres that end before the origin
+    int cell = cv * grid->cellsU + cu;
+    int lo = grid->cellStart[cell], hi = grid->cellStart[cell + 1];
+    float depth = dot(ray->origin, grid->direction);
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (grid->entries[mid].far <= depth) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (int k=lo; k<grid->cellStart[cell + 1]; k++) {
+        const ShadowGridEntry* entry = &grid->entries[k];
+
+        STAT_ADD(sphereTests, 1);
+        if (gridSphereBlocks(store, ray, u, v, entry->u, entry->v, entry->sphere, tMax)) {
+            return entry->sphere;
+        }
+    }
+    return -1;
+}
+
+void printShadowGridStats(FILE* out, const ShadowGrid* grid, int light) {
+    int cells = grid->cellsU * grid->cellsV, occupied = 0;
+
+    for (int c=0; c<cells; c++) {
+        occupied += grid->cellStart[c + 1] > grid->cellStart[c];
+    }
+    fprintf(out, "Shadow grid for light %d: %dx%d cells, %d entries (%.2f MB), %.1f per occupied cell, built in %.2f ms\n",
+            light, grid->cellsU, grid->cellsV, grid->entryCount,
+            (sizeof(ShadowGridEntry) * grid->entryCount + sizeof(int) * (cells + 1)) / 1e6,
+            occupied > 0 ? (double)grid->entryCount / occupied : 0.0, grid->buildMs);
+}
@@ -0,0 +1,409 @@
+#if defined(__x86_64__)
+    #include <immintrin.h>
+    #define HAVE_X86_SIMD
+#endif
+
+// Sphere geometry is stored hot/cold split: the intersection kernels only
+// touch the structure-of-arrays centers and squared radii, while colors and
+// refraction data live in a separate material table indexed the same way.
+// Arrays are 32-byte aligned and carry SPHERE_LANES floats of slack past
+// their capacity so the vector kernels can always load full vectors, even
+// for a range that starts at an unaligned index. A store loaded from a
+// binary scene file points into the file mapping and is marked mapped; its
+// arrays are copied instead of freed or resized in place.
+
+#define SPHERE_LANES 8
+
+typedef struct {
+    float* cx;
+    float* cy;
+    float* cz;
+    float* r2;
+    Material* materials;
+    int count;
+    int capacity;
+    int mapped;
+} SphereStore;
+
+// Allocate a 32-byte aligned array
+void* alignedAlloc(size_t size) {
+    void* result = NULL;
+    if (posix_memalign(&result, 32, size) != 0) {
+        fprintf(stderr, "Out of memory allocating %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+// Grow an aligned float array, keeping its contents. The old array is freed
+// unless it is mapped.
+float* growFloats(float* old, int count, int capacity, int mapped) {
+    float* result = alignedAlloc(sizeof(float) * (capacity + SPHERE_LANES));
+    if (old != NULL) {
+        memcpy(result, old, sizeof(float) * count);
+        if (!mapped) {
+            free(old);
+        }
+    }
+    memset(result + count, 0, sizeof(float) * (capacity + SPHERE_LANES - count));
+    return result;
+}
+
+// Make room for at least the given number of spheres
+void reserveSpheres(SphereStore* store, int capacity) {
+    if (capacity <= store->capacity) {
+        return;
+    }
+    capacity = (capacity + SPHERE_LANES - 1) / SPHERE_LANES * SPHERE_LANES;
+
+    store->cx = growFloats(store->cx, store->count, capacity, store->mapped);
+    store->cy = growFloats(store->cy, store->count, capacity, store->mapped);
+    store->cz = growFloats(store->cz, store->count, capacity, store->mapped);
+    store->r2 = growFloats(store->r2, store->count, capacity, store->mapped);
+    if (store->mapped) {
+        Material* materials = malloc(sizeof(Material) * capacity);
+        memcpy(materials, store->materials, sizeof(Material) * store->count);
+        store->materials = materials;
+    } else {
+        store->materials = realloc(store->materials, sizeof(Material) * capacity);
+    }
+    store->capacity = capacity;
+    store->mapped = 0;
+}
+
+// Add a sphere to the store, splitting it into geometry and material
+int addSphere(SphereStore* store, Sphere sphere) {
+    int i = store->count;
+
+    if (i == store->capacity) {
+        reserveSpheres(store, (i < SPHERE_LANES) ? SPHERE_LANES : i * 2);
+    }
+
+    store->cx[i] = sphere.c.x;
+    store->cy[i] = sphere.c.y;
+    store->cz[i] = sphere.c.z;
+    store->r2[i] = sphere.r * sphere.r;
+    store->materials[i].color = sphere.color;
+    store->materials[i].ri = sphere.ri;
+    store->materials[i].reflective = sphere.reflective;
+    store->materials[i].id = sphere.id;
+    store->count++;
+
+    return i;
+}
+
+// Reorder the store so that sphere i becomes the old sphere order[i]
+void permuteSpheres(SphereStore* store, const int* order) {
+    float** arrays[4] = {&store->cx, &store->cy, &store->cz, &store->r2};
+    Material* materials = malloc(sizeof(Material) * (store->capacity > 0 ? store->capacity : 1));
+
+    for (int a=0; a<4; a++) {
+        float* old = *arrays[a];
+        float* result = growFloats(NULL, 0, store->capacity, 0);
+        for (int i=0; i<store->count; i++) {
+            result[i] = old[order[i]];
+        }
+        if (!store->mapped) {
+            free(old);
+        }
+        *arrays[a] = result;
+    }
+
+    for (int i=0; i<store->count; i++) {
+        materials[i] = store->materials[order[i]];
+    }
+    if (!store->mapped) {
+        free(store->materials);
+    }
+    store->materials = materials;
+    store->mapped = 0;
+}
+
+// Center of a sphere in the store
+Vector sphereCenter(const SphereStore* store, int i) {
+    return newVector(store->cx[i], store->cy[i], store->cz[i]);
+}
+
+// Intersect a ray with one sphere of the store. Returns the nearest positive
+// t along the ray, or -1 if the sphere is missed or entirely behind it.
+float calcIntersection(const Ray* ray, const SphereStore* store, int i) {
+    // Compute discriminate
+    // (d . (e - c))^2 - (d.d) * ((e-c).(e-c) - r^2)
+    float ocx = ray->origin.x - store->cx[i];
+    float ocy = ray->origin.y - store->cy[i];
+    float ocz = ray->origin.z - store->cz[i];
+    float b = ray->direction.x*ocx + ray->direction.y*ocy + ray->direction.z*ocz;
+    float c = (ocx*ocx + ocy*ocy + ocz*ocz) - store->r2[i];
+    float d2 = ray->direction.x*ray->direction.x + ray->direction.y*ray->direction.y + ray->direction.z*ray->direction.z;
+    float discriminate = b*b - d2*c;
+
+    if (discriminate >= 0) {
+        // Solve quadratic for t, the smaller root first
+        float s = sqrtf(discriminate);
+        float t2 = (-b - s) / d2;
+        float t1 = (-b + s) / d2;
+
+        if (t2 > 0) {
+            return t2;
+        } else if (t1 > 0) {
+            return t1;
+        }
+    }
+    return -1;
+}
+
+// Scalar kernels, used when no vector unit is available
+int nearestSphereScalar(const SphereStore* store, int first, int count, const Ray* ray, float* tHit) {
+    int result = -1;
+    float best = *tHit;
+
+    for (int i=first; i<first+count; i++) {
+        float t = calcIntersection(ray, store, i);
+        if (t > 0 && t < best) {
+            best = t;
+            result = i;
+        }
+    }
+
+    *tHit = best;
+    return result;
+}
+
+int anySphereScalar(const SphereStore* store, int first, int count, const Ray* ray, float tMax) {
+    for (int i=first; i<first+count; i++) {
+        float t = calcIntersection(ray, store, i);
+        if (t > 0 && t < tMax) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+// SSE kernels, 4 spheres per instruction. The arithmetic is done in the
+// same order as calcIntersection so every kernel returns identical hits.
+int nearestSphereSSE(const SphereStore* store, int first, int count, const Ray* ray, float* tHit) {
+    __m128 ox = _mm_set1_ps(ray->origin.x), oy = _mm_set1_ps(ray->origin.y), oz = _mm_set1_ps(ray->origin.z);
+    __m128 dx = _mm_set1_ps(ray->direction.x), dy = _mm_set1_ps(ray->direction.y), dz = _mm_set1_ps(ray->direction.z);
+    float dd = ray->direction.x*ray->direction.x + ray->direction.y*ray->direction.y + ray->direction.z*ray->direction.z;
+    __m128 d2 = _mm_set1_ps(dd);
+    __m128 zero = _mm_setzero_ps();
+    __m128 bestT = _mm_set1_ps(*tHit);
+    __m128i bestI = _mm_set1_epi32(-1);
+    __m128i index = _mm_setr_epi32(first, first+1, first+2, first+3);
+    __m128i end = _mm_set1_epi32(first + count);
+    int last = first + count;
+
+    for (int i=first; i<last; i+=4) {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(store->cx + i));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(store->cy + i));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(store->cz + i));
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                              _mm_loadu_ps(store->r2 + i));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(d2, c));
+        __m128 valid = _mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_castsi128_ps(_mm_cmplt_epi32(index, end)));
+        __m128 s = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 nb = _mm_sub_ps(zero, b);
+        __m128 t2 = _mm_div_ps(_mm_sub_ps(nb, s), d2);
+        __m128 t1 = _mm_div_ps(_mm_add_ps(nb, s), d2);
+        __m128 near = _mm_cmpgt_ps(t2, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(near, t2), _mm_andnot_ps(near, t1));
+        __m128 closer = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, bestT)));
+
+        bestT = _mm_or_ps(_mm_and_ps(closer, t), _mm_andnot_ps(closer, bestT));
+        bestI = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), index),
+                             _mm_andnot_si128(_mm_castps_si128(closer), bestI));
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+
+    float lanesT[4];
+    int lanesI[4];
+    int result = -1;
+    float best = *tHit;
+    _mm_storeu_ps(lanesT, bestT);
+    _mm_storeu_si128((__m128i*)lanesI, bestI);
+    for (int k=0; k<4; k++) {
+        if (lanesI[k] >= 0 && (lanesT[k] < best || (lanesT[k] == best && lanesI[k] < result))) {
+            best = lanesT[k];
+            result = lanesI[k];
+        }
+    }
+
+    *tHit = best;
+    return result;
+}
+
+int anySphereSSE(const SphereStore* store, int first, int count, const Ray* ray, float tMax) {
+    __m128 ox = _mm_set1_ps(ray->origin.x), oy = _mm_set1_ps(ray->origin.y), oz = _mm_set1_ps(ray->origin.z);
+    __m128 dx = _mm_set1_ps(ray->direction.x), dy = _mm_set1_ps(ray->direction.y), dz = _mm_set1_ps(ray->direction.z);
+    float dd = ray->direction.x*ray->direction.x + ray->direction.y*ray->direction.y + ray->direction.z*ray->direction.z;
+    __m128 d2 = _mm_set1_ps(dd);
+    __m128 zero = _mm_setzero_ps();
+    __m128 limit = _mm_set1_ps(tMax);
+    __m128i index = _mm_setr_epi32(first, first+1, first+2, first+3);
+    __m128i end = _mm_set1_epi32(first + count);
+    int last = first + count;
+
+    for (int i=first; i<last; i+=4) {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(store->cx + i));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(store->cy + i));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(store->cz + i));
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                              _mm_loadu_ps(store->r2 + i));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(d2, c));
+        __m128 valid = _mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_castsi128_ps(_mm_cmplt_epi32(index, end)));
+        __m128 s = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 nb = _mm_sub_ps(zero, b);
+        __m128 t2 = _mm_div_ps(_mm_sub_ps(nb, s), d2);
+        __m128 t1 = _mm_div_ps(_mm_add_ps(nb, s), d2);
+        __m128 near = _mm_cmpgt_ps(t2, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(near, t2), _mm_andnot_ps(near, t1));
+        int mask = _mm_movemask_ps(_mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, limit))));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+    return -1;
+}
+
+// AVX2 kernels, 8 spheres per instruction
+__attribute__((target("avx2")))
+int nearestSphereAVX2(const SphereStore* store, int first, int count, const Ray* ray, float* tHit) {
+    __m256 ox = _mm256_set1_ps(ray->origin.x), oy = _mm256_set1_ps(ray->origin.y), oz = _mm256_set1_ps(ray->origin.z);
+    __m256 dx = _mm256_set1_ps(ray->direction.x), dy = _mm256_set1_ps(ray->direction.y), dz = _mm256_set1_ps(ray->direction.z);
+    float dd = ray->direction.x*ray->direction.x + ray->direction.y*ray->direction.y + ray->direction.z*ray->direction.z;
+    __m256 d2 = _mm256_set1_ps(dd);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 bestT = _mm256_set1_ps(*tHit);
+    __m256i bestI = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i end = _mm256_set1_epi32(first + count);
+    int last = first + count;
+
+    for (int i=first; i<last; i+=8) {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(store->cx + i));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(store->cy + i));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(store->cz + i));
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                                 _mm256_loadu_ps(store->r2 + i));
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(d2, c));
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ),
+                                     _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+        __m256 s = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+        __m256 nb = _mm256_sub_ps(zero, b);
+        __m256 t2 = _mm256_div_ps(_mm256_sub_ps(nb, s), d2);
+        __m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, s), d2);
+        __m256 t = _mm256_blendv_ps(t1, t2, _mm256_cmp_ps(t2, zero, _CMP_GT_OQ));
+        __m256 closer = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ),
+                                                           _mm256_cmp_ps(t, bestT, _CMP_LT_OQ)));
+
+        bestT = _mm256_blendv_ps(bestT, t, closer);
+        bestI = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestI), _mm256_castsi256_ps(index), closer));
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+
+    float lanesT[8];
+    int lanesI[8];
+    int result = -1;
+    float best = *tHit;
+    _mm256_storeu_ps(lanesT, bestT);
+    _mm256_storeu_si256((__m256i*)lanesI, bestI);
+    for (int k=0; k<8; k++) {
+        if (lanesI[k] >= 0 && (lanesT[k] < best || (lanesT[k] == best && lanesI[k] < result))) {
+            best = lanesT[k];
+            result = lanesI[k];
+        }
+    }
+
+    *tHit = best;
+    return result;
+}
+
+__attribute__((target("avx2")))
+int anySphereAVX2(const SphereStore* store, int first, int count, const Ray* ray, float tMax) {
+    __m256 ox = _mm256_set1_ps(ray->origin.x), oy = _mm256_set1_ps(ray->origin.y), oz = _mm256_set1_ps(ray->origin.z);
+    __m256 dx = _mm256_set1_ps(ray->direction.x), dy = _mm256_set1_ps(ray->direction.y), dz = _mm256_set1_ps(ray->direction.z);
+    float dd = ray->direction.x*ray->direction.x + ray->direction.y*ray->direction.y + ray->direction.z*ray->direction.z;
+    __m256 d2 = _mm256_set1_ps(dd);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 limit = _mm256_set1_ps(tMax);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i end = _mm256_set1_epi32(first + count);
+    int last = first + count;
+
+    for (int i=first; i<last; i+=8) {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(store->cx + i));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(store->cy + i));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(store->cz + i));
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                                 _mm256_loadu_ps(store->r2 + i));
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(d2, c));
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ),
+                                     _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+        __m256 s = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+        __m256 nb = _mm256_sub_ps(zero, b);
+        __m256 t2 = _mm256_div_ps(_mm256_sub_ps(nb, s), d2);
+        __m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, s), d2);
+        __m256 t = _mm256_blendv_ps(t1, t2, _mm256_cmp_ps(t2, zero, _CMP_GT_OQ));
+        int mask = _mm256_movemask_ps(_mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ),
+                                                                        _mm256_cmp_ps(t, limit, _CMP_LT_OQ))));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    return -1;
+}
+#endif
+
+// Kernels picked at startup for the CPU we're running on.
+// nearestSphere returns the index of the closest sphere in
+// [first, first+count) hit with 0 < t < *tHit and lowers *tHit to it, or -1.
+// anySphere returns the index of any sphere hit with 0 < t < tMax, or -1.
+int (*nearestSphere)(const SphereStore*, int, int, const Ray*, float*) = nearestSphereScalar;
+int (*anySphere)(const SphereStore*, int, int, const Ray*, float) = anySphereScalar;
+const char* sphereKernelName = "scalar";
+
+// Select the intersection kernels. Passing NULL picks the widest one the CPU
+// supports, otherwise "scalar", "sse" or "avx2" forces a specific one.
+int selectSphereKernels(const char* name) {
+    const char* best = "scalar";
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    best = __builtin_cpu_supports("avx2") ? "avx2" : "sse";
+#endif
+
+    if (name == NULL) {
+        name = best;
+    }
+
+    if (strcmp(name, "scalar") == 0) {
+        nearestSphere = nearestSphereScalar;
+        anySphere = anySphereScalar;
+        sphereKernelName = "scalar";
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    if (strcmp(name, "sse") == 0) {
+        nearestSphere = nearestSphereSSE;
+        anySphere = anySphereSSE;
+        sphereKernelName = "sse";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && strcmp(best, "avx2") == 0) {
+        nearestSphere = nearestSphereAVX2;
+        anySphere = anySphereAVX2;
+        sphereKernelName = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
@@ -0,0 +1,132 @@
+// Render statistics. Every worker counts into its own cache line, and the
+// counters are summed once the frame is done. Builds without RT_STATS
+// (make STATS=1) leave the counting and timing out entirely.
+
+// Recursion depths tracked individually; deeper rays share the last bin
+#define STATS_DEPTHS 8
+
+// Timed phases. Render and present are wall time on the threads doing them; the
+// wavefront stages are summed over the workers.
+typedef enum {
+    PHASE_RENDER,
+    PHASE_PRESENT,
+    PHASE_INTERSECT,
+    PHASE_SHADOW,
+    PHASE_SHADE,
+    PHASE_COMBINE,
+    PHASE_COUNT
+} StatsPhase;
+
+const char* phaseNames[PHASE_COUNT] = {"render", "present", "intersect", "shadow", "shade", "combine"};
+
+typedef struct __attribute__((aligned(64))) {
+    unsigned long primaryRays;
+    unsigned long gbufferHits;      // Primary rays answered from the G-buffer
+    unsigned long shadowRays;
+    unsigned long reflectionRays;
+    unsigned long refractionRays;
+    unsigned long terminatedRays;   // Secondary rays dropped for their low throughput
+    unsigned long shadowCacheHits;
+    unsigned long sphereTests;
+    unsigned long triangleTests;
+    unsigned long instanceTests;
+    unsigned long bvhRays;
+    unsigned long nodesVisited;
+    unsigned long packets;
+    unsigned long packetNodesVisited;
+    unsigned long depthHistogram[STATS_DEPTHS];
+    unsigned long phaseNs[PHASE_COUNT];
+} RenderStats;
+
+RenderStats renderStats[MAX_THREADS];
+
+#ifdef RT_STATS
+    #define STAT_ADD(field, n) (renderStats[poolWorker].field += (n))
+    #define STAT_DEPTH(depth, n) (renderStats[poolWorker].depthHistogram[(depth) < STATS_DEPTHS ? (depth) : STATS_DEPTHS-1] += (n))
+    #define STAT_TIMER(name) struct timespec name; clock_gettime(CLOCK_MONOTONIC, &name)
+    #define STAT_PHASE(phase, timer) statPhase(phase, &timer)
+#else
+    #define STAT_ADD(field, n) ((void)0)
+    #define STAT_DEPTH(depth, n) ((void)0)
+    #define STAT_TIMER(name)
+    #define STAT_PHASE(phase, timer) ((void)0)
+#endif
+
+// Add the time since a timer to a phase and restart the timer, so that
+// consecutive phases can share one
+static inline void statPhase(StatsPhase phase, struct timespec* timer) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    renderStats[poolWorker].phaseNs[phase] += (now.tv_sec - timer->tv_sec) * 1000000000L + (now.tv_nsec - timer->tv_nsec);
+    *timer = now;
+}
+
+// Clear the counters of every worker
+void resetRenderStats() {
+    memset(renderStats, 0, sizeof(renderStats));
+}
+
+// Sum of the counters of every worker
+RenderStats totalRenderStats() {
+    RenderStats total;
+    unsigned long* sum = (unsigned long*)&total;
+    int fields = sizeof(RenderStats) / sizeof(unsigned long);
+
+    // Every field is an unsigned long, so the structs can be summed as arrays
+    memset(&total, 0, sizeof(total));
+    for (int i=0; i<MAX_THREADS; i++) {
+        const unsigned long* worker = (const unsigned long*)&renderStats[i];
+        for (int f=0; f<fields; f++) {
+            sum[f] += worker[f];
+        }
+    }
+    return total;
+}
+
+// Human-readable summary of a frame's counters
+void printRenderStats(FILE* out, const RenderStats* stats) {
+    unsigned long rays = stats->primaryRays + stats->shadowRays + stats->reflectionRays + stats->refractionRays;
+
+    fprintf(out, "Rays: %lu primary (%lu from the G-buffer), %lu shadow, %lu reflection, %lu refraction (%lu total), %lu terminated\n",
+            stats->primaryRays, stats->gbufferHits, stats->shadowRays, stats->reflectionRays, stats->refractionRays, rays,
+            stats->terminatedRays);
+    fprintf(out, "Ray-sphere tests: %lu (%.1f per ray), ray-triangle tests: %lu (%.1f per ray), instances entered: %lu (%.1f per ray), "
+            "occluder cache hits %lu (%.1f%% of shadow rays)\n",
+            stats->sphereTests, rays > 0 ? (double)stats->sphereTests / rays : 0.0,
+            stats->triangleTests, rays > 0 ? (double)stats->triangleTests / rays : 0.0,
+            stats->instanceTests, rays > 0 ? (double)stats->instanceTests / rays : 0.0, stats->shadowCacheHits,
+            stats->shadowRays > 0 ? 100.0 * stats->shadowCacheHits / stats->shadowRays : 0.0);
+    fprintf(out, "BVH: %lu single rays visiting %.1f nodes each, %lu packets visiting %.1f nodes each\n",
+            stats->bvhRays, stats->bvhRays > 0 ? (double)stats->nodesVisited / stats->bvhRays : 0.0,
+            stats->packets, stats->packets > 0 ? (double)stats->packetNodesVisited / stats->packets : 0.0);
+    fprintf(out, "Rays by depth:");
+    for (int d=0; d<STATS_DEPTHS; d++) {
+        fprintf(out, " %lu", stats->depthHistogram[d]);
+    }
+    fprintf(out, "\nTime (ms):");
+    for (int p=0; p<PHASE_COUNT; p++) {
+        fprintf(out, " %s %.2f", phaseNames[p], stats->phaseNs[p] / 1e6);
+    }
+    fprintf(out, "\n");
+}
+
+// One JSON object per line describing a frame's counters
+void writeRenderStatsJSON(FILE* out, const RenderStats* stats, unsigned long frame, unsigned int width, unsigned int height) {
+    fprintf(out, "{\"frame\": %lu, \"width\": %u, \"height\": %u, ", frame, width, height);
+    fprintf(out, "\"rays\": {\"primary\": %lu, \"shadow\": %lu, \"reflection\": %lu, \"refraction\": %lu}, \"gbufferHits\": %lu, \"terminatedRays\": %lu, ",
+            stats->primaryRays, stats->shadowRays, stats->reflectionRays, stats->refractionRays, stats->gbufferHits,
+            stats->terminatedRays);
+    fprintf(out, "\"sphereTests\": %lu, \"triangleTests\": %lu, \"instanceTests\": %lu, \"shadowCacheHits\": %lu, \"bvhRays\": %lu, \"nodesVisited\": %lu, ",
+            stats->sphereTests, stats->triangleTests, stats->instanceTests, stats->shadowCacheHits, stats->bvhRays, stats->nodesVisited);
+    fprintf(out, "\"packets\": %lu, \"packetNodesVisited\": %lu, \"depthHistogram\": [",
+            stats->packets, stats->packetNodesVisited);
+    for (int d=0; d<STATS_DEPTHS; d++) {
+        fprintf(out, "%s%lu", d > 0 ? ", " : "", stats->depthHistogram[d]);
+    }
+    fprintf(out, "], \"phaseMs\": {");
+    for (int p=0; p<PHASE_COUNT; p++) {
+        fprintf(out, "%s\"%s\": %.3f", p > 0 ? ", " : "", phaseNames[p], stats->phaseNs[p] / 1e6);
+    }
+    fprintf(out, "}}\n");
+    fflush(out);
+}
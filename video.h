@@ -0,0 +1,188 @@
+// Video output for animations. Frames are streamed either as YUV4MPEG2
+// (4:4:4, which encoders such as ffmpeg and x264 read directly) or as raw
+// 8-bit RGB with rows top to bottom.
+//
+// Writing runs on its own thread behind a small ring of frame buffers:
+// the renderer copies each finished frame into a free slot and goes on
+// with the next one while the writer converts and writes the oldest. It
+// only waits when every slot is full, i.e. when the output is slower than
+// the renderer.
+
+#define FRAME_QUEUE_SIZE 3
+
+typedef enum {
+    VIDEO_Y4M,
+    VIDEO_RGB
+} VideoFormat;
+
+// Raw RGB for files ending in .rgb, Y4M for anything else
+VideoFormat videoFormatFromName(const char* name) {
+    const char* ext = strrchr(name, '.');
+    return (ext != NULL && strcmp(ext, ".rgb") == 0) ? VIDEO_RGB : VIDEO_Y4M;
+}
+
+int writeY4MHeader(FILE* out, int width, int height, int fps) {
+    fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+    return ferror(out) ? -1 : 0;
+}
+
+// Write one frame. scratch holds width*height*3 bytes.
+int writeVideoFrame(FILE* out, VideoFormat format, const float* pixels, int width, int height, unsigned char* scratch) {
+    size_t plane = (size_t)width * height;
+
+    for (int j=0; j<height; j++) {
+        const float* src = &pixels[(size_t)(height-1-j) * width * 3];
+        size_t row = (size_t)j * width;
+
+        for (int i=0; i<width; i++) {
+            unsigned char r = toByte(src[i*3]), g = toByte(src[i*3+1]), b = toByte(src[i*3+2]);
+
+            if (format == VIDEO_RGB) {
+                scratch[(row + i) * 3] = r;
+                scratch[(row + i) * 3 + 1] = g;
+                scratch[(row + i) * 3 + 2] = b;
+                continue;
+            }
+
+            // BT.601 studio range, one plane after another
+            scratch[row + i] = (unsigned char)(16.5f + (65.481f * r + 128.553f * g + 24.966f * b) / 255);
+            scratch[plane + row + i] = (unsigned char)(128.5f + (-37.797f * r - 74.203f * g + 112.0f * b) / 255);
+            scratch[2*plane + row + i] = (unsigned char)(128.5f + (112.0f * r - 93.786f * g - 18.214f * b) / 255);
+        }
+    }
+
+    if (format == VIDEO_Y4M) {
+        fputs("FRAME\n", out);
+    }
+    fwrite(scratch, 1, plane * 3, out);
+    return ferror(out) ? -1 : 0;
+}
+
+typedef struct {
+    float* frames[FRAME_QUEUE_SIZE];
+    int head;           // Oldest queued frame
+    int count;          // Frames queued, including the one being written
+    int closed;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t notFull;
+    pthread_cond_t notEmpty;
+    pthread_t writer;
+    FILE* out;
+    VideoFormat format;
+    int width;
+    int height;
+    double stallSeconds; // Time the renderer spent waiting for a free slot
+} FrameQueue;
+
+void* frameWriterMain(void* arg) {
+    FrameQueue* q = arg;
+    unsigned char* scratch = malloc((size_t)q->width * q->height * 3);
+
+    // Without scratch space the queue is still drained, but nothing is written
+    if (scratch == NULL) {
+        fprintf(stderr, "Unable to allocate the frame writer's buffer\n");
+        pthread_mutex_lock(&q->lock);
+        q->error = 1;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->closed) {
+            pthread_cond_wait(&q->notEmpty, &q->lock);
+        }
+        if (q->count == 0) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        float* frame = q->frames[q->head];
+        pthread_mutex_unlock(&q->lock);
+
+        // The slot stays taken until the frame is written
+        int error = (q->error == 0) ? writeVideoFrame(q->out, q->format, frame, q->width, q->height, scratch) : 0;
+
+        pthread_mutex_lock(&q->lock);
+        q->error |= error;
+        q->head = (q->head + 1) % FRAME_QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->notFull);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+void freeFrameSlots(FrameQueue* q) {
+    for (int i=0; i<FRAME_QUEUE_SIZE; i++) {
+        free(q->frames[i]);
+        q->frames[i] = NULL;
+    }
+}
+
+// Allocate the slots and start the writer. On failure nothing is left
+// allocated.
+int startFrameQueue(FrameQueue* q, FILE* out, VideoFormat format, int width, int height) {
+    memset(q, 0, sizeof(*q));
+    for (int i=0; i<FRAME_QUEUE_SIZE; i++) {
+        q->frames[i] = malloc(sizeof(float) * width * height * 3);
+        if (q->frames[i] == NULL) {
+            fprintf(stderr, "Unable to allocate the frame queue\n");
+            freeFrameSlots(q);
+            return -1;
+        }
+    }
+    q->out = out;
+    q->format = format;
+    q->width = width;
+    q->height = height;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    if (pthread_create(&q->writer, NULL, frameWriterMain, q) != 0) {
+        fprintf(stderr, "Unable to start the frame writer\n");
+        pthread_cond_destroy(&q->notEmpty);
+        pthread_cond_destroy(&q->notFull);
+        pthread_mutex_destroy(&q->lock);
+        freeFrameSlots(q);
+        return -1;
+    }
+    return 0;
+}
+
+// Queue a copy of a frame, waiting for a free slot if the writer is behind
+void queueFrame(FrameQueue* q, const float* pixels) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == FRAME_QUEUE_SIZE) {
+        pthread_cond_wait(&q->notFull, &q->lock);
+    }
+    float* slot = q->frames[(q->head + q->count) % FRAME_QUEUE_SIZE];
+    pthread_mutex_unlock(&q->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    q->stallSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Only this thread adds frames, so the slot stays free while it is filled
+    memcpy(slot, pixels, sizeof(float) * q->width * q->height * 3);
+
+    pthread_mutex_lock(&q->lock);
+    q->count++;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Write out the queued frames and stop the writer. Returns -1 if any write
+// failed.
+int finishFrameQueue(FrameQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->writer, NULL);
+
+    freeFrameSlots(q);
+    return (fflush(q->out) != 0 || q->error) ? -1 : 0;
+}